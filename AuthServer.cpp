@@ -18,11 +18,14 @@
 #include <cpprest/http_listener.h>
 #include <cpprest/json.h>
 
+#include <pplx/pplxtasks.h>
+
 #include <was/common.h>
 #include <was/table.h>
 
 #include "TableCache.h"
 #include "make_unique.h"
+#include "ServerUtils.h"
 #include "azure_keys.h"
 
 using azure::storage::storage_exception;
@@ -86,6 +89,10 @@ const string get_update_data {"GetUpdateData"};
 
 const string get_update_data_op{ "GetUpdateData" };
 
+// GetUpdateData also returns the user's DataTable entity and its ETag
+const string update_data_entity_prop {"Entity"};
+const string update_data_etag_prop {"ETag"};
+
 /*
   Cache of opened tables
  */
@@ -109,44 +116,6 @@ prop_str_vals_t get_string_properties (const table_entity::properties_type& prop
   return values;
 }
 
-/*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
-
-  Note that all types of JSON values are returned as strings.
-  Use C++ conversion utilities to convert to numbers or dates
-  as necessary.
- */
-unordered_map<string,string> get_json_body(http_request message) {  
-  unordered_map<string,string> results {};
-  const http_headers& headers {message.headers()};
-  auto content_type (headers.find("Content-Type"));
-  if (content_type == headers.end() ||
-      content_type->second != "application/json")
-    return results;
-
-  value json{};
-  message.extract_json(true)
-    .then([&json](value v) -> bool
-          {
-            json = v;
-            return true;
-          })
-    .wait();
-
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-        results[v.first] = v.second.as_string();
-      }
-      else {
-        results[v.first] = v.second.serialize();
-      }
-    }
-  }
-  return results;
-}
-
 /*
   Return a token for 24 hours of access to the specified table,
   for the single entity defind by the partition and row.
@@ -209,16 +178,18 @@ void handle_get(http_request message) {
   /////////////////////////////////////////////////////////////////
 
   cloud_table auth_table{ table_cache.lookup_table(auth_table_name) };
+  cloud_table data_table{ table_cache.lookup_table(data_table_name) };
 
-  if (!auth_table.exists()) {
+  // Check for both tables at once rather than one round trip after the other
+  vector<bool> tables_exist {(auth_table.exists_async() && data_table.exists_async()).get()};
+
+  if (!tables_exist[0]) {
       cout << "AuthTable does not exist.\n";
       message.reply(status_codes::NotFound);
       return;
   }
-  
-  cloud_table data_table{ table_cache.lookup_table(data_table_name) };
 
-  if (!data_table.exists()) {
+  if (!tables_exist[1]) {
       cout << "DataTable does not exist.\n";
       message.reply(status_codes::NotFound);
       return;
@@ -319,11 +290,36 @@ void handle_get(http_request message) {
       return;
   } else if (paths[0] == get_update_data) {
       cout << "GetUpdateData was called and succeeded.\n";
+
+      // Read the user's DataTable entity while the token is made, and return
+      // it too, so that signing on need not ask BasicServer for it separately
+      pplx::task<table_result> entity_task {data_table.execute_async(table_operation::retrieve_entity(partition, row))};
       pair<status_code, string> result = do_get_token(data_table, partition, row, table_shared_access_policy::permissions::read |
           table_shared_access_policy::permissions::update);
+      table_result entity_result {};
+      try {
+          entity_result = entity_task.get();
+      }
+      catch (const storage_exception& e) {
+          // A missing entity is a NotFound result; anything thrown is a storage failure
+          cout << "Azure Table Storage error: " << e.what() << endl;
+          cout << e.result().extended_error().message() << endl;
+          message.reply(status_codes::InternalError);
+          return;
+      }
+
+      if (entity_result.http_status_code() == status_codes::NotFound) {
+          cout << "The user's entry in DataTable is not found.\n";
+          message.reply(status_codes::NotFound);
+          return;
+      }
+
       vector<pair<string, value>> token{ make_pair("token", value::string(result.second)),
                                          make_pair(auth_table_partition_prop, value::string(partition)),
-                                         make_pair(auth_table_row_prop, value::string(row))};
+                                         make_pair(auth_table_row_prop, value::string(row)),
+                                         make_pair(update_data_entity_prop,
+                                                   value::object(get_properties(entity_result.entity().properties()))),
+                                         make_pair(update_data_etag_prop, value::string(entity_result.etag()))};
       message.reply(result.first, value::object(token));
       return;
   }
@@ -10,7 +10,10 @@
  Basic Server code for CMPT 276, Spring 2016.
  */
   
+#include <cstdint>
+#include <cstdlib>
 #include <exception>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -28,6 +31,8 @@
 #include <was/storage_account.h>
 #include <was/table.h>
 
+#include "FollowerIndex.h"
+#include "StatusFeed.h"
 #include "TableCache.h"
 #include "make_unique.h"
 #include "ServerUtils.h"
@@ -43,6 +48,8 @@ using azure::storage::cloud_table_client;
 using azure::storage::edm_type;
 using azure::storage::entity_property;
 using azure::storage::table_entity;
+using azure::storage::query_comparison_operator;
+using azure::storage::query_logical_operator;
 using azure::storage::table_operation;
 using azure::storage::table_query;
 using azure::storage::table_query_iterator;
@@ -96,6 +103,10 @@ const string add_property {"AddPropertyAdmin"};
 const string read_entity {"ReadEntityAdmin"};
 const string update_entity_auth{"UpdateEntityAuth"};
 const string read_entity_auth{"ReadEntityAuth"};
+const string query_entities {"QueryEntitiesAdmin"};
+const string add_to_set {"AddToSetAdmin"};
+const string remove_from_set {"RemoveFromSetAdmin"};
+const string append_property {"AppendPropertyAdmin"};
 
 
 /*
@@ -103,37 +114,6 @@ const string read_entity_auth{"ReadEntityAuth"};
  */
 TableCache table_cache {};
 
-/*
-  Convert properties represented in Azure Storage type
-  to prop_vals_t type.
- */
-prop_vals_t get_properties (const table_entity::properties_type& properties, prop_vals_t values = prop_vals_t {}) {
-  for (const auto v : properties) {
-    if (v.second.property_type() == edm_type::string) {
-      values.push_back(make_pair(v.first, value::string(v.second.string_value())));
-    }
-    else if (v.second.property_type() == edm_type::datetime) {
-      values.push_back(make_pair(v.first, value::string(v.second.str())));
-    }
-    else if(v.second.property_type() == edm_type::int32) {
-      values.push_back(make_pair(v.first, value::number(v.second.int32_value())));      
-    }
-    else if(v.second.property_type() == edm_type::int64) {
-      values.push_back(make_pair(v.first, value::number(v.second.int64_value())));      
-    }
-    else if(v.second.property_type() == edm_type::double_floating_point) {
-      values.push_back(make_pair(v.first, value::number(v.second.double_value())));      
-    }
-    else if(v.second.property_type() == edm_type::boolean) {
-      values.push_back(make_pair(v.first, value::boolean(v.second.boolean_value())));      
-    }
-    else {
-      values.push_back(make_pair(v.first, value::string(v.second.str())));
-    }
-  }
-  return values;
-}
-
 /*
   Return true if an HTTP request has a JSON body
 
@@ -144,48 +124,102 @@ bool has_json_body (http_request message) {
 }
 
 /*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
-
-  If the message has no JSON body, return an empty map.
+  How many times update_conditionally () re-reads and retries when
+  another writer changed the entity first
+ */
+constexpr int conditional_update_attempts {8};
 
-  THIS ROUTINE CAN ONLY BE CALLED ONCE FOR A GIVEN MESSAGE
-  (see http://microsoft.github.io/cpprestsdk/classweb_1_1http_1_1http__request.html#ae6c3d7532fe943de75dcc0445456cbc7
-  for source of this limit).
+enum class conditional_update_t { written, unchanged, contended, failed };
 
-  Note that all types of JSON values are returned as strings.
-  Use C++ conversion utilities to convert to numbers or dates
-  as necessary.
+/*
+  Change one entity of table without losing concurrent changes.
+
+  The entity partition/row is read (or taken as empty if it does not
+  exist) and change is given its properties, to fill in update with
+  the properties to write; it returns false if there is nothing to
+  write. update is then merged into the entity only if its ETag is
+  unchanged, or inserted as a new entity only if there still is
+  none. If another writer got in first, the whole is retried from
+  the read, up to conditional_update_attempts times.
+
+  Returns written or unchanged, contended if every attempt lost
+  the race, and failed on any other storage error.
  */
-unordered_map<string,string> get_json_body(http_request message) {  
-  unordered_map<string,string> results {};
-  const http_headers& headers {message.headers()};
-  auto content_type (headers.find("Content-Type"));
-  if (content_type == headers.end() ||
-      content_type->second != "application/json")
-    return results;
-
-  value json{};
-  message.extract_json(true)
-    .then([&json](value v) -> bool
-    {
-            json = v;
-      return true;
-    })
-    .wait();
-
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-  results[v.first] = v.second.as_string();
+conditional_update_t update_conditionally (cloud_table& table, const string& partition, const string& row,
+                                           const std::function<bool(const table_entity::properties_type&,
+                                                                    table_entity::properties_type&)>& change) {
+  for (int attempt {0}; attempt < conditional_update_attempts; attempt++) {
+    try {
+      table_result retrieve_result {table.execute(table_operation::retrieve_entity(partition, row))};
+      bool exists {retrieve_result.http_status_code() != status_codes::NotFound};
+      table_entity current {exists ? retrieve_result.entity() : table_entity {partition, row}};
+
+      table_entity update {partition, row};
+      if (! change(current.properties(), update.properties()))
+        return conditional_update_t::unchanged;
+
+      if (exists) {
+        update.set_etag(current.etag());
+        table.execute(table_operation::merge_entity(update));
       }
       else {
-  results[v.first] = v.second.serialize();
+        table.execute(table_operation::insert_entity(update));
+      }
+      return conditional_update_t::written;
+    }
+    catch (const storage_exception& e) {
+      int code {e.result().http_status_code()};
+      if (code != status_codes::PreconditionFailed && code != status_codes::Conflict) {
+        cout << "Azure Table Storage error: " << e.what() << endl;
+        return conditional_update_t::failed;
       }
+      cout << "Entity changed under us, retrying\n";
     }
   }
+  return conditional_update_t::contended;
+}
 
-  return results;
+// The string value of property name in props, or empty if there is none
+string string_property (const table_entity::properties_type& props, const string& name) {
+  auto prop (props.find(name));
+  return prop == props.end() ? string {} : prop->second.string_value();
+}
+
+/*
+  Write pages spilled from the feed ring in property prop_name of
+  partition/row to archive_table, as page numbers first_page onwards
+  (see StatusFeed.h). The page numbers come from the entity the pages
+  were cut from, so a retried append rewrites the same pages.
+  Returns false if any page could not be written.
+ */
+bool archive_pages (const string& archive_table, const string& prop_name,
+                    const string& partition, const string& row, uint64_t first_page, const vector<string>& pages) {
+  try {
+    cloud_table archive {table_cache.lookup_table(archive_table)};
+    archive.create_if_not_exists();
+    for (std::size_t i {0}; i < pages.size(); i++) {
+      table_entity page {partition, archive_row(row, first_page + i)};
+      page.properties()[prop_name] = entity_property {pages[i]};
+      archive.execute(table_operation::insert_or_replace_entity(page));
+    }
+    return true;
+  }
+  catch (const storage_exception& e) {
+    cout << "Azure Table Storage error archiving " << row << ": " << e.what() << endl;
+    return false;
+  }
+}
+
+/*
+  The smallest string greater than every string starting with prefix,
+  or the empty string if there is none (prefix is all 0xff bytes)
+ */
+string prefix_upper_bound (string prefix) {
+  while (! prefix.empty() && static_cast<unsigned char>(prefix.back()) == 0xff)
+    prefix.pop_back();
+  if (! prefix.empty())
+    prefix.back() = static_cast<char>(static_cast<unsigned char>(prefix.back()) + 1);
+  return prefix;
 }
 
 /*
@@ -243,17 +277,27 @@ void handle_get(http_request message) {
 
     // get entity
     table_entity entity = read_entity.second;
+
+    // If the caller's cached copy is still current, don't resend it
+    const http_headers& headers {message.headers()};
+    auto if_none_match (headers.find("If-None-Match"));
+    if (if_none_match != headers.end() && ! entity.etag().empty() &&
+        if_none_match->second == entity.etag()) {
+      reply_with_etag(message, status_codes::NotModified, value {}, entity.etag());
+      return;
+    }
+
     // get properties
     table_entity::properties_type properties {entity.properties()};
   
     // If the entity has any properties, return them as JSON
     prop_vals_t values (get_properties(properties));
     if (values.size() > 0){
-      message.reply(status_codes::OK, value::object(values));
+      reply_with_etag(message, status_codes::OK, value::object(values), entity.etag());
       return;
     } else {
       cout << "No properties" << endl;
-      message.reply(status_codes::OK);
+      reply_with_etag(message, status_codes::OK, value {}, entity.etag());
       return;
     }
   }
@@ -265,6 +309,61 @@ void handle_get(http_request message) {
   //                                                             //
   /////////////////////////////////////////////////////////////////
 
+  /*
+    GET the first entities of a partition whose row keys start with
+    a prefix, in row key order:
+    QueryEntitiesAdmin/<table>/<partition>/<row prefix>/<top>[/<after row>]
+    Only rows after <after row>, if given, are returned, so the last
+    row of one reply continues the scan in the next.
+
+    The partition and row range go to table storage as the query
+    filter, so only the matching rows are read, not the whole table.
+   */
+  if (paths[0] == query_entities) {
+    if (paths.size() < 5) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    int top {std::atoi(paths[4].c_str())};
+    if (top <= 0) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+
+    string filter {table_query::generate_filter_condition("PartitionKey", query_comparison_operator::equal, paths[2])};
+    string lower {paths[3]};
+    string lower_op {query_comparison_operator::greater_than_or_equal};
+    if (paths.size() > 5 && paths[5] >= lower) {
+      lower = paths[5];
+      lower_op = query_comparison_operator::greater_than;
+    }
+    if (! lower.empty())
+      filter = table_query::combine_filter_conditions(filter, query_logical_operator::op_and,
+                 table_query::generate_filter_condition("RowKey", lower_op, lower));
+    string upper {prefix_upper_bound(paths[3])};
+    if (! upper.empty())
+      filter = table_query::combine_filter_conditions(filter, query_logical_operator::op_and,
+                 table_query::generate_filter_condition("RowKey", query_comparison_operator::less_than, upper));
+
+    table_query query {};
+    query.set_filter_string(filter);
+    query.set_take_count(top);
+    table_query_iterator end;
+    table_query_iterator it = table.execute_query(query);
+    vector<value> key_vec;
+    // take_count only sizes each page of results; stop the scan at top
+    while (it != end && static_cast<int>(key_vec.size()) < top) {
+      prop_vals_t keys {
+        make_pair("Partition", value::string(it->partition_key())),
+        make_pair("Row", value::string(it->row_key()))};
+      keys = get_properties(it->properties(), keys);
+      key_vec.push_back(value::object(keys));
+      ++it;
+    }
+    message.reply(status_codes::OK, value::array(key_vec));
+    return;
+  }
+
   /////////////////////////////////////////////////////////////////
   //                                                             //
   //                       ASSIGNMENT # 1                        //
@@ -422,9 +521,9 @@ void handle_get(http_request message) {
   // If the entity has any properties, return them as JSON
   prop_vals_t values (get_properties(properties));
   if (values.size() > 0)
-    message.reply(status_codes::OK, value::object(values));
+    reply_with_etag(message, status_codes::OK, value::object(values), entity.etag());
   else
-    message.reply(status_codes::OK);
+    reply_with_etag(message, status_codes::OK, value {}, entity.etag());
 }
 
 /*
@@ -503,40 +602,16 @@ void handle_put(http_request message) {
       }
 
       try {
-          web::http::status_code result = update_with_token(message, tables_endpoint, json_body);
-
-          /////////////////// Start of Josh's code ////////////////////
-
-          cout << "---Authorized PUT: All the entries in DataTable---\n";
-
-          // Set up your iterators
-          table_query query{};
-          table_query_iterator end;
-          table_query_iterator it = table.execute_query(query);
-          vector<pair<utility::string_t, utility::string_t>> partition_and_row_vector;
-
-          while (it != end) {
-            // Get a specific entry
-            table_operation retrieve_operation {table_operation::retrieve_entity(it->partition_key(), it->row_key())};
-            table_result retrieve_result {table.execute(retrieve_operation)};
-
-            // Get all the properties in that entry
-            table_entity entity {retrieve_result.entity()};
-            table_entity::properties_type& properties = entity.properties();
-
-            // Output all the properties of that entry
-            cout << "Key: " << it->partition_key() << " / " << it->row_key() << endl;
-            for ( auto it = properties.begin(); it != properties.end(); ++it ) {
-              cout << "\tProperty Name: " << it->first  << ", Property Value: " << value::string(it->second.string_value()) << endl;
-            }
-
-            ++it;
-          }
-
-          /////////////////// End of Josh's code ////////////////////
+          // With an If-Match header, only write if the entity is unchanged
+          const http_headers& headers {message.headers()};
+          auto if_match (headers.find("If-Match"));
+          string new_etag {};
+          web::http::status_code result = update_with_token(message, tables_endpoint, json_body,
+                                                            if_match == headers.end() ? string {} : if_match->second,
+                                                            new_etag);
 
           cout << "Authorized PUT succeeds " << endl;
-          message.reply(result);
+          reply_with_etag(message, result, value {}, new_etag);
           return;
       }
       catch (const storage_exception& e) {
@@ -694,6 +769,107 @@ void handle_put(http_request message) {
   //                                                             //
   /////////////////////////////////////////////////////////////////
 
+  /*
+    Add a key to, or remove it from, a sorted key list property
+    (see FollowerIndex.h), creating the entity if need be:
+    AddToSetAdmin/<table>/<partition>/<row> or
+    RemoveFromSetAdmin/<table>/<partition>/<row>, with the JSON body
+    {<property>: <key>}.
+
+    The entity is read, changed and written back only if its ETag is
+    unchanged (or inserted only if it still does not exist), and the
+    whole is retried if another writer got in first, so concurrent
+    changes to one list are never lost.
+   */
+  if (paths[0] == add_to_set || paths[0] == remove_from_set) {
+    if (paths.size() < 4 || json_body.size() != 1 || ! valid_sorted_key(json_body.begin()->second)) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    const string& prop_name {json_body.begin()->first};
+    const string& key {json_body.begin()->second};
+    bool adding {paths[0] == add_to_set};
+
+    conditional_update_t result {update_conditionally(table, paths[2], paths[3],
+      [&prop_name, &key, adding] (const table_entity::properties_type& current, table_entity::properties_type& update) {
+        string list {string_property(current, prop_name)};
+        if (! (adding ? sorted_keys_insert(list, key) : sorted_keys_erase(list, key)))
+          return false;
+        update[prop_name] = entity_property {list};
+        return true;
+      })};
+    if (result == conditional_update_t::failed)
+      message.reply(status_codes::InternalError);
+    else if (result == conditional_update_t::contended)
+      message.reply(status_codes::ServiceUnavailable);
+    else
+      message.reply(status_codes::OK);
+    return;
+  }
+
+  /*
+    Append entries to a feed ring property (see StatusFeed.h),
+    creating the entity if need be:
+    AppendPropertyAdmin/<table>/<partition>/<row>, with the JSON body
+    {<property>: <entries>}. <entries> is either a single entry with
+    no newline, or one or more entries each ended by a newline, as
+    in the ring itself, appended in order.
+
+    As in StatusFeed.h for Updates, once the ring grows past
+    feed_ring_entries its oldest pages move to the table named
+    <property>Archive, and the number of pages moved is kept in the
+    entity's <property>Archived property; for Updates these are
+    UpdatesArchive and UpdatesArchived. Pages are archived before
+    the write that drops them from the ring.
+
+    The append is one conditional merge, retried as AddToSetAdmin's
+    is, so a caller appends with a single request, and concurrent
+    appends to one entity all land.
+   */
+  if (paths[0] == append_property) {
+    if (paths.size() < 4 || json_body.size() != 1) {
+      message.reply(status_codes::BadRequest);
+      return;
+    }
+    const string& prop_name {json_body.begin()->first};
+    // append_status () ends the last entry itself
+    string entries {json_body.begin()->second};
+    string::size_type newline {entries.find('\n')};
+    if (newline != string::npos) {
+      if (entries.back() != '\n') {
+        message.reply(status_codes::BadRequest);
+        return;
+      }
+      entries.pop_back();
+    }
+    const string& partition {paths[2]};
+    const string& row {paths[3]};
+    string archived_prop {prop_name + "Archived"};
+    bool archive_failed {false};
+
+    conditional_update_t result {update_conditionally(table, partition, row,
+      [&] (const table_entity::properties_type& current, table_entity::properties_type& update) {
+        uint64_t archived {parse_archived(string_property(current, archived_prop))};
+        FeedAppend feed {append_status(string_property(current, prop_name), entries)};
+        if (! feed.pages.empty()) {
+          if (! archive_pages(prop_name + "Archive", prop_name, partition, row, archived, feed.pages)) {
+            archive_failed = true;
+            return false;
+          }
+          update[archived_prop] = entity_property {std::to_string(archived + feed.pages.size())};
+        }
+        update[prop_name] = entity_property {feed.updates};
+        return true;
+      })};
+    if (result == conditional_update_t::failed)
+      message.reply(status_codes::InternalError);
+    else if (result == conditional_update_t::contended || archive_failed)
+      message.reply(status_codes::ServiceUnavailable);
+    else
+      message.reply(status_codes::OK);
+    return;
+  }
+
   // Need at least an operation, table name, partition, and row
   if (paths.size() < 4) {
     cout << "Paths does not have an operation, table name, partition, and row.\n";
@@ -10,9 +10,14 @@
 
 #include <algorithm>
 #include <cassert>
+#include <stdexcept>
 #include <string>
 #include <utility>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <cpprest/http_client.h>
 #include <cpprest/json.h>
 
@@ -71,6 +76,27 @@ using web::json::value;
 pair<status_code,value> do_request (const method& http_method, const string& uri_string, const value& req_body) {
 
   std::cout << "\tCalling do_request with available JSON object.\n";
+
+  return do_request_async (http_method, uri_string, req_body).get();
+}
+
+// Version that defaults third argument
+pair<status_code,value> do_request (const method& http_method, const string& uri_string) {
+
+  std::cout << "\tCalling do_request with default JSON object.\n";
+
+  return do_request (http_method, uri_string, value {});
+}
+
+/*
+  do_request () without waiting: the result is a task that yields the
+  status code and body once the response arrives, so a caller can
+  have many requests in flight, or chain work onto the response,
+  without holding a thread. A failure to reach the server is thrown
+  from the task's get ().
+ */
+pplx::task<pair<status_code,value>> do_request_async (const method& http_method, const string& uri_string, const value& req_body) {
+
   std::cout << "\t\tHTTP Method: " << http_method << std::endl;
   std::cout << "\t\tHTTP URI: " << uri_string << std::endl;
 
@@ -82,14 +108,68 @@ pair<status_code,value> do_request (const method& http_method, const string& uri
     request.set_body(req_body);
   }
 
+  // The client goes with the continuation, so it lives until the response is read
+  http_client client {uri_string};
+  return client.request (request)
+    .then([client](http_response response)
+          {
+            status_code code {response.status_code()};
+            const http_headers& headers {response.headers()};
+            auto content_type (headers.find("Content-Type"));
+            if (content_type == headers.end() ||
+                content_type->second != "application/json")
+              return pplx::task_from_result(make_pair(code, value::object ()));
+            else
+              return response.extract_json()
+                .then([code](value v)
+                      {
+                        return make_pair(code, v);
+                      });
+          });
+}
+
+/*
+  do_request () with entity tags, for callers that cache what they read
+
+  if_match: [may be empty] sent as If-Match, so a write only succeeds
+    if the entity is unchanged since the caller read it (else 412)
+  if_none_match: [may be empty] sent as If-None-Match, so a read
+    returns 304 with no body if the caller's copy is still current
+  etag: set to the response's ETag header, or empty if it has none
+ */
+pair<status_code,value> do_conditional_request (const method& http_method, const string& uri_string,
+                                                const value& req_body,
+                                                const string& if_match, const string& if_none_match,
+                                                string& etag) {
+
+  std::cout << "\tCalling do_conditional_request.\n";
+  std::cout << "\t\tHTTP Method: " << http_method << std::endl;
+  std::cout << "\t\tHTTP URI: " << uri_string << std::endl;
+
+  http_request request {http_method};
+  http_headers& headers (request.headers());
+  if (! if_match.empty())
+    headers.add("If-Match", if_match);
+  if (! if_none_match.empty())
+    headers.add("If-None-Match", if_none_match);
+
+  if (req_body != value {}) {
+    headers.add("Content-Type", "application/json");
+    request.set_body(req_body);
+  }
+
   status_code code;
   value resp_body;
+  etag.clear();
   http_client client {uri_string};
   client.request (request)
-    .then([&code](http_response response)
+    .then([&code, &etag](http_response response)
           {
             code = response.status_code();
             const http_headers& headers {response.headers()};
+            auto etag_header (headers.find("ETag"));
+            if (etag_header != headers.end())
+              etag = etag_header->second;
             auto content_type (headers.find("Content-Type"));
             if (content_type == headers.end() ||
                 content_type->second != "application/json")
@@ -106,14 +186,6 @@ pair<status_code,value> do_request (const method& http_method, const string& uri
   return make_pair(code, resp_body);
 }
 
-// Version that defaults third argument
-pair<status_code,value> do_request (const method& http_method, const string& uri_string) {
-
-  std::cout << "\tCalling do_request with default JSON object.\n";
-
-  return do_request (http_method, uri_string, value {});
-}
-
 /*
  Return a JSON object value whose (0 or more) properties are specified as a 
  vector of <string,string> pairs
@@ -232,9 +304,68 @@ using pos_t = string::size_type;
 char pair_separator {'|'};
 char pair_delimiter {';'};
 
-static pos_t next_delim (const string& s, char delim, pos_t start) {
-  return s.find(delim, start);
-}
+/*
+  Yields, in order, the positions in a string of every character
+  that is either a or b, in a single pass over the string.
+
+  With SSE2 the string is compared sixteen bytes at a time against
+  both characters at once, giving a bit mask of the matches in each
+  block; positions are then read off the mask, so the characters in
+  between are never looked at one by one. The last partial block is
+  scanned a byte at a time, so nothing past the end is ever read.
+ */
+class DelimiterScanner {
+private:
+  static constexpr pos_t block {16};
+
+  const char* s;
+  pos_t n;
+  pos_t base;     // Start of the current block
+  unsigned mask;  // Matches in the current block not yet returned
+  char a;
+  char b;
+
+  void load () {
+    mask = 0;
+#ifdef __SSE2__
+    if (base + block <= n) {
+      __m128i bytes {_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + base))};
+      __m128i hits {_mm_or_si128(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(a)),
+                                 _mm_cmpeq_epi8(bytes, _mm_set1_epi8(b)))};
+      mask = static_cast<unsigned>(_mm_movemask_epi8(hits));
+      return;
+    }
+#endif
+    for (pos_t i {0}; i < block && base + i < n; i++)
+      if (s[base + i] == a || s[base + i] == b)
+        mask |= 1u << i;
+  }
+
+public:
+  DelimiterScanner (const string& str, char first, char second) :
+    s {str.data()},
+    n {str.size()},
+    base {0},
+    mask {0},
+    a {first},
+    b {second}
+  {
+    load();
+  }
+
+  // The next position, or string::npos when there are no more
+  pos_t next () {
+    while (mask == 0) {
+      base += block;
+      if (base >= n)
+        return string::npos;
+      load();
+    }
+    pos_t pos {base + static_cast<pos_t>(__builtin_ctz(mask))};
+    mask &= mask - 1;
+    return pos;
+  }
+};
 
 /*
  Return a vector of (country, name) pairs representing a list of friends
@@ -266,31 +397,60 @@ static pos_t next_delim (const string& s, char delim, pos_t start) {
 
    "USAMadonna|Canada" (no delimiter in opening "pair")
 
- Note: gcc 4.8.4's version of STL does not include full support for <regexp>,
- so this algorthm uses the more basic (and entirely adequate) string::find.
+ The pairs are returned as views into friends_list, which must outlive
+ them and not change while they are in use. The list is scanned once
+ for both characters with DelimiterScanner, and nothing is copied.
  */
-friends_list_t parse_friends_list (const string& friends_list) {
-  friends_list_t res {};
+friends_view_t parse_friends_view (const string& friends_list) {
+  friends_view_t res {};
+  const char* data {friends_list.data()};
+  DelimiterScanner scan {friends_list, pair_separator, pair_delimiter};
 
   pos_t start {0};
-  if (friends_list[start] == pair_separator)
-    start++; // Skip any initial separator
-  for (pos_t delim {next_delim (friends_list, pair_delimiter, start)};
-       delim != string::npos; 
-       delim = next_delim (friends_list, pair_delimiter, start)) {
-    pos_t end {next_delim (friends_list, pair_separator, start)};
-    if (end == string::npos)
-      end = friends_list.size();
+  pos_t next {scan.next()};
+  if (next == 0 && friends_list[0] == pair_separator) {
+    start = 1; // Skip any initial separator
+    next = scan.next();
+  }
+  while (next != string::npos) {
+    if (friends_list[next] == pair_separator) {
+      // A pair with no delimiter: malformed if a pair follows it, otherwise ignored
+      for (; next != string::npos; next = scan.next())
+        if (friends_list[next] == pair_delimiter)
+          throw std::invalid_argument(string("Misformed friends list: ") + friends_list);
+      break;
+    }
+
+    // The name runs from the first delimiter to the next separator, any further delimiters included
+    pos_t delim {next};
+    do
+      next = scan.next();
+    while (next != string::npos && friends_list[next] != pair_separator);
+    pos_t end {next == string::npos ? friends_list.size() : next};
     if (end <= delim+1)
       throw std::invalid_argument(string("Misformed friends list: ") + friends_list);
-    string country {friends_list.substr (start, delim-start)};
-    string name {friends_list.substr (delim+1, end-delim-1)};
-    res.push_back (make_pair (country, name));
+
+    res.push_back (make_pair (string_ref {data + start, delim-start}, string_ref {data + delim+1, end-delim-1}));
     start = end+1;
+    if (next != string::npos)
+      next = scan.next();
   }
   return res;
 }
 
+/*
+ Return a vector of (country, name) pairs representing a list of friends,
+ as parse_friends_view () does, but as strings of their own
+ */
+friends_list_t parse_friends_list (const string& friends_list) {
+  friends_view_t view {parse_friends_view(friends_list)};
+  friends_list_t res {};
+  res.reserve (view.size());
+  for (const auto& p : view)
+    res.push_back (make_pair (p.first.str(), p.second.str()));
+  return res;
+}
+
 /*
   Return the string representation of a friends list 
  */
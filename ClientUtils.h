@@ -1,6 +1,7 @@
 #ifndef CLIENT_UTILS_H
 #define CLIENT_UTILS_H
 
+#include <cstddef>
 #include <string>
 #include <unordered_map>
 #include <utility>
@@ -9,12 +10,32 @@
 #include <cpprest/http_client.h>
 #include <cpprest/json.h>
 
+#include <pplx/pplxtasks.h>
+
 // Alias for a type representing the result of do_request()
 using req_res_t = std::pair<web::http::status_code,web::json::value>;
 
 // Alias for a vector representing a friends list
 using friends_list_t = std::vector<std::pair<std::string,std::string>>;
 
+/*
+  A view of part of a string, without a copy. It is only valid while
+  the string it was taken from is alive and unchanged.
+ */
+struct string_ref {
+  const char* data;
+  std::size_t size;
+
+  std::string str () const { return std::string (data, size); }
+};
+
+inline bool operator== (const string_ref& a, const std::string& b) {
+  return b.compare(0, std::string::npos, a.data, a.size) == 0;
+}
+
+// Alias for a vector of (country, name) views into a stored friends list
+using friends_view_t = std::vector<std::pair<string_ref,string_ref>>;
+
 // Alias for an unordered_map representing a JSON object's property/value pairs
 using value_string_t = std::unordered_map<std::string,std::string>;
 
@@ -24,6 +45,15 @@ do_request (const web::http::method& http_method, const std::string& uri_string,
 req_res_t
 do_request (const web::http::method& http_method, const std::string& uri_string);
 
+pplx::task<req_res_t>
+do_request_async (const web::http::method& http_method, const std::string& uri_string, const web::json::value& req_body);
+
+req_res_t
+do_conditional_request (const web::http::method& http_method, const std::string& uri_string,
+                        const web::json::value& req_body,
+                        const std::string& if_match, const std::string& if_none_match,
+                        std::string& etag);
+
 web::json::value
 build_json_value (const std::vector<std::pair<std::string,std::string>>& props);
 
@@ -52,6 +82,9 @@ extern char pair_delimiter;
 friends_list_t
 parse_friends_list (const std::string& friends_list);
 
+friends_view_t
+parse_friends_view (const std::string& friends_list);
+
 std::string friends_list_to_string(const friends_list_t& list);
 
 #endif
@@ -0,0 +1,99 @@
+#ifndef FanOut_h
+#define FanOut_h
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+/*
+  The outcome of a bounded_fan_out (): how many operations succeeded
+  and failed, and how long the whole fan-out took
+ */
+struct FanOutResult {
+  std::size_t succeeded;
+  std::size_t failed;
+  std::chrono::microseconds elapsed;
+};
+
+// Shared by the lanes of one fan-out
+struct FanOutState {
+  std::size_t count;
+  std::atomic<std::size_t> next;
+  std::atomic<std::size_t> succeeded;
+  std::atomic<std::size_t> failed;
+  std::chrono::steady_clock::time_point start;
+
+  explicit FanOutState (std::size_t count) :
+    count {count}, next {0}, succeeded {0}, failed {0}, start {std::chrono::steady_clock::now()} {}
+};
+
+/*
+  One lane of a fan-out: take the next unstarted operation, and when
+  it completes, start the one after, until none are left
+ */
+template <typename Op>
+pplx::task<void> fan_out_lane (std::shared_ptr<FanOutState> state, std::shared_ptr<Op> op) {
+  std::size_t i {state->next++};
+  if (i >= state->count)
+    return pplx::task_from_result();
+
+  pplx::task<bool> started {pplx::task_from_result(false)};
+  try {
+    started = (*op)(i);
+  }
+  catch (const std::exception&) {
+    // Counted as failed below
+  }
+  return started.then([state, op] (pplx::task<bool> done) {
+      bool ok {false};
+      try {
+        ok = done.get();
+      }
+      catch (const std::exception&) {
+        ok = false;
+      }
+      if (ok)
+        state->succeeded++;
+      else
+        state->failed++;
+      return fan_out_lane(state, op);
+    });
+}
+
+/*
+  Run op (i) for each i in 0 .. count - 1, no more than limit at a
+  time. op starts an operation and returns a task yielding whether it
+  succeeded; an op that throws, or whose task does, has failed.
+
+  Returns a task that completes with the counts once every operation
+  has. Nothing waits in the meantime: each of the limit lanes starts
+  its next operation from the continuation of its last, so a fan-out
+  holds no thread while its requests are in flight.
+ */
+template <typename Op>
+pplx::task<FanOutResult> bounded_fan_out (std::size_t count, std::size_t limit, Op op) {
+  std::shared_ptr<FanOutState> state {std::make_shared<FanOutState>(count)};
+  std::shared_ptr<Op> shared_op {std::make_shared<Op>(std::move(op))};
+
+  std::vector<pplx::task<void>> lanes {};
+  std::size_t lane_count {std::min(count, std::max(limit, std::size_t {1}))};
+  for (std::size_t l {0}; l < lane_count; l++)
+    lanes.push_back(fan_out_lane(state, shared_op));
+
+  auto finish = [state] () {
+    return FanOutResult {state->succeeded.load(), state->failed.load(),
+                         std::chrono::duration_cast<std::chrono::microseconds>(
+                             std::chrono::steady_clock::now() - state->start)};
+  };
+  if (lanes.empty())
+    return pplx::task_from_result(finish());
+  return pplx::when_all(lanes.begin(), lanes.end()).then(finish);
+}
+
+#endif
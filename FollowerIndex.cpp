@@ -0,0 +1,90 @@
+#include "FollowerIndex.h"
+
+#include <cstddef>
+#include <string>
+
+using std::string;
+
+const string followers_table {"FollowersTable"};
+const string followers_prop {"Followers"};
+
+// The same separator as between the pairs of a friends list
+constexpr char key_separator {'|'};
+
+/*
+  Binary search of the sorted key list for key. The search is over
+  byte offsets: each probe finds the key around the middle byte by
+  scanning back to the separator before it, so no index of the keys
+  is ever built.
+
+  Returns true if key is present, with pos its offset. Otherwise pos
+  is the offset of the first key after it, or list.size () + 1 if
+  there is none.
+ */
+static bool find_key (const string& list, const string& key, std::size_t& pos) {
+  // lo and hi are always the offsets of key starts, hi possibly one past the end
+  std::size_t lo {0};
+  std::size_t hi {list.size() + 1};
+  while (lo < hi) {
+    std::size_t mid {lo + (hi - lo) / 2};
+    std::size_t start {mid == 0 ? string::npos : list.rfind(key_separator, mid - 1)};
+    start = start == string::npos || start + 1 < lo ? lo : start + 1;
+    std::size_t end {list.find(key_separator, start)};
+    if (end == string::npos)
+      end = list.size();
+
+    int c {list.compare(start, end - start, key)};
+    if (c == 0) {
+      pos = start;
+      return true;
+    }
+    if (c < 0)
+      lo = end + 1;
+    else
+      hi = start;
+  }
+  pos = lo;
+  return false;
+}
+
+bool sorted_keys_contains (const string& list, const string& key) {
+  std::size_t pos {0};
+  return ! list.empty() && find_key(list, key, pos);
+}
+
+bool sorted_keys_insert (string& list, const string& key) {
+  if (list.empty()) {
+    list = key;
+    return true;
+  }
+  std::size_t pos {0};
+  if (find_key(list, key, pos))
+    return false;
+  if (pos > list.size()) {
+    list.push_back(key_separator);
+    list.append(key);
+  }
+  else {
+    list.insert(pos, 1, key_separator);
+    list.insert(pos, key);
+  }
+  return true;
+}
+
+bool sorted_keys_erase (string& list, const string& key) {
+  std::size_t pos {0};
+  if (list.empty() || ! find_key(list, key, pos))
+    return false;
+  std::size_t end {pos + key.size()};
+  if (end < list.size())
+    list.erase(pos, end + 1 - pos);   // The key and the separator after it
+  else if (pos > 0)
+    list.erase(pos - 1);              // The last key and the separator before it
+  else
+    list.clear();                     // The only key
+  return true;
+}
+
+bool valid_sorted_key (const string& key) {
+  return ! key.empty() && key.find(key_separator) == string::npos;
+}
@@ -0,0 +1,37 @@
+#ifndef FollowerIndex_h
+#define FollowerIndex_h
+
+#include <string>
+
+/*
+  The reverse friend index: for each user, everyone who has that
+  user on their friends list.
+
+  A user's followers are kept in FollowersTable, in the entity with
+  the user's data partition and row, as the Followers property. It
+  is a list in the same "Country;Name|Country;Name" form as a friends
+  list (so parse_friends_list () reads it), but sorted and without
+  duplicates, so membership is a binary search of the string itself
+  and adding or removing a follower is a single splice, with no
+  parsing and no per-follower allocation.
+
+  BasicServer's AddToSetAdmin and RemoveFromSetAdmin update a sorted
+  key list like this one with a conditional write, so concurrent
+  AddFriend and UnFriend calls for the same user never lose updates.
+ */
+extern const std::string followers_table;
+extern const std::string followers_prop;
+
+// True if key is in the sorted key list list
+bool sorted_keys_contains (const std::string& list, const std::string& key);
+
+// Add key to the sorted key list list. Returns false if it was already there.
+bool sorted_keys_insert (std::string& list, const std::string& key);
+
+// Remove key from the sorted key list list. Returns false if it was not there.
+bool sorted_keys_erase (std::string& list, const std::string& key);
+
+// True if key can go in a sorted key list: nonempty and without a separator
+bool valid_sorted_key (const std::string& key);
+
+#endif
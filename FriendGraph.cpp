@@ -0,0 +1,216 @@
+#include "FriendGraph.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::vector;
+
+using lock_t = std::lock_guard<std::mutex>;
+
+// Heap bytes held by a string beyond the string object itself
+static std::size_t string_heap_bytes (const string& s) {
+  // Short strings live inside the object
+  return s.capacity() > 15 ? s.capacity() + 1 : 0;
+}
+
+std::size_t FriendGraphSnapshot::adjacency_bytes () const {
+  return (offsets.capacity() + targets.capacity()) * sizeof(uint32_t);
+}
+
+FriendGraph::FriendGraph () :
+  mutex {},
+  ids {},
+  keys {},
+  current {std::make_shared<const FriendGraphSnapshot>()},
+  pending {},
+  changed_at {},
+  generation_count {0},
+  loaded {false}
+  {}
+
+// Requires mutex held
+uint32_t FriendGraph::intern (const string& partition, const string& row) {
+  string key {partition};
+  key.push_back(pair_delimiter);
+  key.append(row);
+  return intern_key(std::move(key));
+}
+
+// Requires mutex held
+uint32_t FriendGraph::intern_key (string key) {
+  auto it (ids.find(key));
+  if (it != ids.end())
+    return it->second;
+  uint32_t id {static_cast<uint32_t>(keys.size())};
+  ids.emplace(key, id);
+  keys.push_back(std::move(key));
+  changed_at.push_back(0);
+  return id;
+}
+
+// Requires mutex held
+vector<uint32_t> FriendGraph::to_row (const friends_list_t& friends_list) {
+  vector<uint32_t> row {};
+  row.reserve(friends_list.size());
+  for (const auto& f : friends_list)
+    row.push_back(intern(f.first, f.second));
+  std::sort(row.begin(), row.end());
+  row.erase(std::unique(row.begin(), row.end()), row.end());
+  return row;
+}
+
+// Requires mutex held
+vector<uint32_t> FriendGraph::to_row (const friends_view_t& friends_view) {
+  vector<uint32_t> row {};
+  row.reserve(friends_view.size());
+  // A friend's country, delimiter and name lie together in the stored list, which is just the key
+  for (const auto& f : friends_view)
+    row.push_back(intern_key(string (f.first.data, f.second.data + f.second.size - f.first.data)));
+  std::sort(row.begin(), row.end());
+  row.erase(std::unique(row.begin(), row.end()), row.end());
+  return row;
+}
+
+void FriendGraph::load (const vector<pair<pair<string,string>,friends_list_t>>& users, uint64_t since) {
+  lock_t lock {mutex};
+  // Rows set after the lists were read stay as set, pending or already in current
+  for (auto it (pending.begin()); it != pending.end(); ) {
+    if (changed_at[it->first] > since)
+      ++it;
+    else
+      it = pending.erase(it);
+  }
+  for (const auto& u : users) {
+    uint32_t id {intern(u.first.first, u.first.second)};
+    if (changed_at[id] <= since)
+      pending[id] = to_row(u.second);
+  }
+
+  // Every other user not in users now has no friends
+  for (uint32_t id {0}; id < keys.size(); id++) {
+    if (changed_at[id] <= since)
+      pending.emplace(id, vector<uint32_t> {});
+  }
+  loaded = true;
+}
+
+uint64_t FriendGraph::generation () const {
+  lock_t lock {mutex};
+  return generation_count;
+}
+
+bool FriendGraph::is_loaded () const {
+  lock_t lock {mutex};
+  return loaded;
+}
+
+void FriendGraph::set_friends (const string& partition, const string& row, const friends_list_t& friends_list) {
+  lock_t lock {mutex};
+  uint32_t id {intern(partition, row)};
+  changed_at[id] = ++generation_count;
+  pending[id] = to_row(friends_list);
+}
+
+void FriendGraph::set_friends (const string& partition, const string& row, const friends_view_t& friends_view) {
+  lock_t lock {mutex};
+  uint32_t id {intern(partition, row)};
+  changed_at[id] = ++generation_count;
+  pending[id] = to_row(friends_view);
+}
+
+std::shared_ptr<const FriendGraphSnapshot> FriendGraph::snapshot () {
+  lock_t lock {mutex};
+  uint32_t users {static_cast<uint32_t>(keys.size())};
+  if (pending.empty() && current->users() == users)
+    return current;
+
+  const FriendGraphSnapshot& old (*current);
+  uint32_t old_users {old.users()};
+  std::size_t changed_edges {0};
+  vector<uint32_t> changed {};
+  changed.reserve(pending.size());
+  for (const auto& p : pending) {
+    changed.push_back(p.first);
+    changed_edges += p.second.size();
+  }
+  std::sort(changed.begin(), changed.end());
+
+  std::shared_ptr<FriendGraphSnapshot> next {std::make_shared<FriendGraphSnapshot>()};
+  next->offsets.reserve(users + 1);
+  next->targets.reserve(old.edges() + changed_edges);
+  next->offsets.push_back(0);
+
+  // Users before end that did not change: one block copy of their old rows, then their offsets shifted
+  uint32_t u {0};
+  auto copy_unchanged = [&] (uint32_t end) {
+    uint32_t old_end {std::min(end, old_users)};
+    if (u < old_end) {
+      uint32_t from {old.offsets[u]};
+      uint32_t shift {static_cast<uint32_t>(next->targets.size()) - from};
+      next->targets.insert(next->targets.end(), old.targets.begin() + from, old.targets.begin() + old.offsets[old_end]);
+      for (uint32_t v {u + 1}; v <= old_end; v++)
+        next->offsets.push_back(old.offsets[v] + shift);
+      u = old_end;
+    }
+    // Users first seen as someone's friend, with no list of their own yet
+    for (; u < end; u++)
+      next->offsets.push_back(static_cast<uint32_t>(next->targets.size()));
+  };
+
+  for (uint32_t c : changed) {
+    copy_unchanged(c);
+    const vector<uint32_t>& row (pending[c]);
+    next->targets.insert(next->targets.end(), row.begin(), row.end());
+    next->offsets.push_back(static_cast<uint32_t>(next->targets.size()));
+    u = c + 1;
+  }
+  copy_unchanged(users);
+
+  pending.clear();
+  current = next;
+  return current;
+}
+
+bool FriendGraph::find_id (const string& partition, const string& row, uint32_t& id) const {
+  string key {partition};
+  key.push_back(pair_delimiter);
+  key.append(row);
+  lock_t lock {mutex};
+  auto it (ids.find(key));
+  if (it == ids.end())
+    return false;
+  id = it->second;
+  return true;
+}
+
+pair<string,string> FriendGraph::user_of (uint32_t id) const {
+  lock_t lock {mutex};
+  const string& key (keys.at(id));
+  string::size_type delim {key.find(pair_delimiter)};
+  return make_pair(key.substr(0, delim), key.substr(delim + 1));
+}
+
+std::size_t FriendGraph::pending_users () const {
+  lock_t lock {mutex};
+  return pending.size();
+}
+
+std::size_t FriendGraph::id_bytes () const {
+  lock_t lock {mutex};
+  // Each hash node holds a copy of the key, its id, a next pointer and the cached hash
+  constexpr std::size_t node_bytes {sizeof(pair<const string,uint32_t>) + sizeof(void*) + sizeof(std::size_t)};
+  std::size_t bytes {keys.capacity() * sizeof(string) + ids.bucket_count() * sizeof(void*)};
+  for (const string& key : keys)
+    bytes += 2 * string_heap_bytes(key) + node_bytes;
+  return bytes;
+}
@@ -0,0 +1,117 @@
+#ifndef FriendGraph_h
+#define FriendGraph_h
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ClientUtils.h"
+
+/*
+  An immutable snapshot of the friend graph in compressed sparse row
+  form. Users are dense ids 0 .. users () - 1; the friends of user u
+  are targets[offsets[u]] .. targets[offsets[u + 1] - 1], sorted
+  ascending and without duplicates, so a traversal touches two flat
+  arrays and never a string.
+
+  A friend is an edge from the user whose list it is on, so the graph
+  is directed: it holds exactly what the friends lists say.
+ */
+struct FriendGraphSnapshot {
+  std::vector<uint32_t> offsets;  // users () + 1 entries
+  std::vector<uint32_t> targets;
+
+  uint32_t users () const {
+    return offsets.empty() ? 0 : static_cast<uint32_t>(offsets.size() - 1);
+  }
+  std::size_t edges () const { return targets.size(); }
+
+  const uint32_t* friends_begin (uint32_t user) const { return targets.data() + offsets[user]; }
+  const uint32_t* friends_end (uint32_t user) const { return targets.data() + offsets[user + 1]; }
+  std::size_t degree (uint32_t user) const { return offsets[user + 1] - offsets[user]; }
+
+  // Bytes held by the two arrays
+  std::size_t adjacency_bytes () const;
+};
+
+/*
+  Dense integer ids for users, and the friend graph over them.
+
+  Ids are handed out in the order users are first seen, for the
+  user's data partition and row, and are never reused or changed, so
+  an id stays valid across snapshots.
+
+  The graph is built in full by load () from every user's friends
+  list, and afterwards kept up to date by set_friends () for each
+  user whose list changes. Each set_friends () bumps generation (),
+  and a load () given the generation from before its lists were read
+  keeps any row set since, so a slow reload never undoes a change
+  that raced with it. Changed lists are held aside until the
+  next snapshot (), which then copies every unchanged row of the old
+  arrays as it is and only parses and sorts the changed ones.
+  Snapshots are shared and immutable, so readers traverse one with no
+  lock while the next is built.
+
+  All members may be called from any thread.
+ */
+class FriendGraph {
+private:
+  mutable std::mutex mutex;
+  std::unordered_map<std::string,uint32_t> ids;   // "Partition;Row" -> id
+  std::vector<std::string> keys;                  // id -> "Partition;Row"
+  std::shared_ptr<const FriendGraphSnapshot> current;
+  std::unordered_map<uint32_t,std::vector<uint32_t>> pending;  // Rows changed since current
+  std::vector<uint64_t> changed_at;               // id -> generation of its last set_friends (), 0 if none
+  uint64_t generation_count;
+  bool loaded;
+
+  uint32_t intern (const std::string& partition, const std::string& row);
+  uint32_t intern_key (std::string key);
+  std::vector<uint32_t> to_row (const friends_list_t& friends_list);
+  std::vector<uint32_t> to_row (const friends_view_t& friends_view);
+
+public:
+  FriendGraph ();
+
+  /*
+    Replace the whole graph by users, given as ((partition, row),
+    friends list) pairs, as read after generation () returned since.
+    Rows set by set_friends () after that are left as they are. Ids
+    already handed out are kept.
+   */
+  void load (const std::vector<std::pair<std::pair<std::string,std::string>,friends_list_t>>& users, uint64_t since);
+
+  // The number of set_friends () calls so far
+  uint64_t generation () const;
+
+  // True once load () has been called
+  bool is_loaded () const;
+
+  // Record the current friends list of the user in partition/row
+  void set_friends (const std::string& partition, const std::string& row, const friends_list_t& friends_list);
+
+  // The same, from views into a stored friends list (see parse_friends_view ())
+  void set_friends (const std::string& partition, const std::string& row, const friends_view_t& friends_view);
+
+  // The graph as of the latest load () and set_friends ()
+  std::shared_ptr<const FriendGraphSnapshot> snapshot ();
+
+  // The id of the user in partition/row; false if the graph has never seen them
+  bool find_id (const std::string& partition, const std::string& row, uint32_t& id) const;
+
+  // The (partition, row) of a user by id
+  std::pair<std::string,std::string> user_of (uint32_t id) const;
+
+  // Users whose changed lists are not yet in a snapshot
+  std::size_t pending_users () const;
+
+  // Bytes held by the id table, approximately (hash nodes are estimated)
+  std::size_t id_bytes () const;
+};
+
+#endif
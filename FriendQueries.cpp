@@ -0,0 +1,62 @@
+#include "FriendQueries.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <queue>
+#include <vector>
+
+#include "SortedIntersect.h"
+
+using std::vector;
+
+vector<uint32_t> mutual_friends (const FriendGraphSnapshot& graph, uint32_t user, uint32_t other) {
+  vector<uint32_t> mutual (std::min(graph.degree(user), graph.degree(other)));
+  mutual.resize(intersect_sorted(graph.friends_begin(user), graph.degree(user),
+                                 graph.friends_begin(other), graph.degree(other), mutual.data()));
+  return mutual;
+}
+
+// True if a ranks above b
+static bool better (const FriendSuggestion& a, const FriendSuggestion& b) {
+  return a.mutual > b.mutual || (a.mutual == b.mutual && a.user < b.user);
+}
+
+vector<FriendSuggestion> suggest_friends (const FriendGraphSnapshot& graph, uint32_t user, std::size_t k) {
+  // Per-thread counters, kept zeroed between calls, so a query allocates nothing once they have grown
+  static thread_local vector<uint32_t> counts {};
+  static thread_local vector<uint32_t> touched {};
+  if (counts.size() < graph.users())
+    counts.resize(graph.users(), 0);
+  touched.clear();
+
+  const uint32_t* mine_begin {graph.friends_begin(user)};
+  const uint32_t* mine_end {graph.friends_end(user)};
+  for (const uint32_t* f {mine_begin}; f != mine_end; ++f)
+    for (const uint32_t* ff {graph.friends_begin(*f)}; ff != graph.friends_end(*f); ++ff)
+      if (counts[*ff]++ == 0)
+        touched.push_back(*ff);
+
+  // A min-heap under "better", so its top is the worst of the best k so far
+  auto worse_on_top = [] (const FriendSuggestion& a, const FriendSuggestion& b) { return better(a, b); };
+  std::priority_queue<FriendSuggestion, vector<FriendSuggestion>, decltype(worse_on_top)> best {worse_on_top};
+  for (uint32_t candidate : touched) {
+    FriendSuggestion s {candidate, counts[candidate]};
+    counts[candidate] = 0;
+    if (k == 0 || candidate == user || std::binary_search(mine_begin, mine_end, candidate))
+      continue;
+    if (best.size() < k)
+      best.push(s);
+    else if (better(s, best.top())) {
+      best.pop();
+      best.push(s);
+    }
+  }
+
+  vector<FriendSuggestion> ranked {};
+  ranked.reserve(best.size());
+  for (; ! best.empty(); best.pop())
+    ranked.push_back(best.top());
+  std::reverse(ranked.begin(), ranked.end());
+  return ranked;
+}
@@ -0,0 +1,33 @@
+#ifndef FriendQueries_h
+#define FriendQueries_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "FriendGraph.h"
+
+/*
+  Queries over a FriendGraph snapshot, in dense user ids
+ */
+
+// The friends user and other have in common, ascending
+std::vector<uint32_t> mutual_friends (const FriendGraphSnapshot& graph, uint32_t user, uint32_t other);
+
+struct FriendSuggestion {
+  uint32_t user;
+  uint32_t mutual;  // Friends of the user asked about who have this user as a friend
+};
+
+/*
+  The people user may know: the at most k friends of user's friends
+  who are neither user nor already user's friends, most mutual
+  friends first (ties in id order).
+
+  Candidates are counted in one pass over the friends' rows, and only
+  the best k are kept, in a bounded heap, so the cost is the number
+  of friends of friends plus log k for each candidate.
+ */
+std::vector<FriendSuggestion> suggest_friends (const FriendGraphSnapshot& graph, uint32_t user, std::size_t k);
+
+#endif
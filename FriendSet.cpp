@@ -0,0 +1,233 @@
+#include "FriendSet.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ClientUtils.h"
+
+using std::make_pair;
+using std::string;
+
+constexpr int FriendSet::index_after_ops;
+
+/*
+  True if s is in standard form: no leading or trailing separator,
+  and every pair has a delimiter followed by a nonempty name. Such a
+  string parses to exactly its own pairs, so it can be used as is.
+ */
+static bool is_standard_form (const string& s) {
+  string::size_type start {0};
+  while (start < s.size()) {
+    string::size_type end {s.find(pair_separator, start)};
+    if (end == string::npos)
+      end = s.size();
+    string::size_type delim {s.find(pair_delimiter, start)};
+    if (delim == string::npos || delim + 1 >= end)
+      return false;
+    if (end == s.size())
+      return true;
+    start = end + 1;
+  }
+  // Empty, or ends with a separator
+  return s.empty();
+}
+
+string FriendSet::key (const string& country, const string& name) {
+  // Countries never contain pair_delimiter, so this is unambiguous
+  string k {};
+  k.reserve(country.size() + 1 + name.size());
+  k.append(country);
+  k.push_back(pair_delimiter);
+  k.append(name);
+  return k;
+}
+
+FriendSet::FriendSet () :
+  serialized {},
+  serialized_valid {true},
+  scanned_ops {0},
+  indexed {false},
+  entries {},
+  live {},
+  index {},
+  removed {0}
+  {}
+
+FriendSet::FriendSet (const string& friends_list) :
+  FriendSet {}
+{
+  if (is_standard_form(friends_list))
+    serialized = friends_list;
+  else
+    serialized = friends_list_to_string(parse_friends_list(friends_list));
+}
+
+/*
+  Position of the pair k in the (valid, unindexed) string, or npos.
+  A match must be a whole pair: k holds no separator, so checking
+  for a separator (or the end) on either side is enough.
+ */
+std::size_t FriendSet::find_in_string (const string& k) const {
+  std::size_t pos {serialized.find(k)};
+  while (pos != string::npos) {
+    bool starts_pair {pos == 0 || serialized[pos - 1] == pair_separator};
+    bool ends_pair {pos + k.size() == serialized.size() || serialized[pos + k.size()] == pair_separator};
+    if (starts_pair && ends_pair)
+      return pos;
+    pos = serialized.find(k, pos + 1);
+  }
+  return string::npos;
+}
+
+void FriendSet::note_scan () {
+  if (++scanned_ops >= index_after_ops)
+    build_index();
+}
+
+void FriendSet::build_index () {
+  friends_view_t parsed {parse_friends_view(serialized)};
+  entries.reserve(parsed.size());
+  live.reserve(parsed.size());
+  index.reserve(parsed.size());
+  bool duplicates {false};
+  for (const auto& p : parsed) {
+    // A pair's country, delimiter and name are contiguous in the string, so its key is copied straight out
+    string k (p.first.data, p.second.data + p.second.size - p.first.data);
+    if (! index.insert(make_pair(std::move(k), entries.size())).second) {
+      duplicates = true;
+      continue;
+    }
+    entries.push_back(make_pair(p.first.str(), p.second.str()));
+    live.push_back(true);
+  }
+  if (duplicates)
+    serialized_valid = false;
+  indexed = true;
+}
+
+bool FriendSet::contains (const string& country, const string& name) {
+  if (indexed)
+    return index.find(key(country, name)) != index.end();
+  bool found {find_in_string(key(country, name)) != string::npos};
+  note_scan();
+  return found;
+}
+
+bool FriendSet::add (const string& country, const string& name) {
+  string k {key(country, name)};
+  if (indexed) {
+    if (! index.insert(make_pair(k, entries.size())).second)
+      return false;
+    entries.push_back(make_pair(country, name));
+    live.push_back(true);
+  }
+  else {
+    if (find_in_string(k) != string::npos) {
+      note_scan();
+      return false;
+    }
+  }
+
+  // Appending keeps a valid string valid
+  if (serialized_valid) {
+    if (! serialized.empty())
+      serialized.push_back(pair_separator);
+    serialized.append(k);
+  }
+  if (! indexed)
+    note_scan();
+  return true;
+}
+
+bool FriendSet::remove (const string& country, const string& name) {
+  string k {key(country, name)};
+  if (! indexed) {
+    std::size_t pos {find_in_string(k)};
+    if (pos == string::npos) {
+      note_scan();
+      return false;
+    }
+    // Erase the pair and one separator next to it
+    if (pos + k.size() < serialized.size())
+      serialized.erase(pos, k.size() + 1);
+    else if (pos > 0)
+      serialized.erase(pos - 1, k.size() + 1);
+    else
+      serialized.clear();
+    note_scan();
+    return true;
+  }
+
+  auto it (index.find(k));
+  if (it == index.end())
+    return false;
+  live[it->second] = false;
+  index.erase(it);
+  removed++;
+  serialized_valid = false;
+  if (removed > entries.size() - removed)
+    compact();
+  return true;
+}
+
+/*
+  Drop the tombstones, renumbering the index
+ */
+void FriendSet::compact () {
+  std::size_t out {0};
+  for (std::size_t i {0}; i < entries.size(); i++) {
+    if (! live[i])
+      continue;
+    if (out != i) {
+      entries[out] = std::move(entries[i]);
+      index[key(entries[out].first, entries[out].second)] = out;
+    }
+    out++;
+  }
+  entries.resize(out);
+  live.assign(out, true);
+  removed = 0;
+}
+
+std::size_t FriendSet::size () const {
+  if (indexed)
+    return entries.size() - removed;
+  if (serialized.empty())
+    return 0;
+  return std::count(serialized.begin(), serialized.end(), pair_separator) + 1;
+}
+
+const string& FriendSet::to_string () const {
+  if (! serialized_valid) {
+    serialized.clear();
+    bool started {false};
+    for (std::size_t i {0}; i < entries.size(); i++) {
+      if (! live[i])
+        continue;
+      if (started)
+        serialized.push_back(pair_separator);
+      serialized.append(entries[i].first);
+      serialized.push_back(pair_delimiter);
+      serialized.append(entries[i].second);
+      started = true;
+    }
+    serialized_valid = true;
+  }
+  return serialized;
+}
+
+friends_list_t FriendSet::to_list () const {
+  if (! indexed)
+    return parse_friends_list(serialized);
+  friends_list_t list {};
+  list.reserve(size());
+  for (std::size_t i {0}; i < entries.size(); i++) {
+    if (live[i])
+      list.push_back(entries[i]);
+  }
+  return list;
+}
@@ -0,0 +1,74 @@
+#ifndef FriendSet_h
+#define FriendSet_h
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ClientUtils.h"
+
+/*
+  A user's friends, kept in the stored "Country;Name|Country;Name"
+  form with a hashed index built when it pays for itself.
+
+  A FriendSet starts as just the stored string. The first few
+  operations scan and edit the string in place: finding a friend is
+  a substring search, adding one is an append and removing one
+  erases its bytes, with no parsing and no allocation per friend.
+  This is all a single AddFriend or UnFriend needs. After
+  index_after_ops operations the friends are indexed by hash, so a
+  long run of changes (a bulk import, say) costs O(1) per change;
+  the string is then rebuilt only when asked for after a removal.
+
+  Friends stay in the order they were added, so to_string () gives
+  the same string friends_list_to_string () would for the same list.
+  Until the set is indexed, duplicate entries in the stored list are
+  kept and remove () takes out only the first, as the original
+  vector code did; indexing keeps only the first of each.
+ */
+class FriendSet {
+private:
+  static constexpr int index_after_ops {8};
+
+  mutable std::string serialized;
+  mutable bool serialized_valid;
+  int scanned_ops;
+
+  // Only used once indexed
+  bool indexed;
+  friends_list_t entries;                             // In insertion order
+  std::vector<bool> live;                             // False for removed entries
+  std::unordered_map<std::string,std::size_t> index;  // "Country;Name" -> entries position
+  std::size_t removed;
+
+  static std::string key (const std::string& country, const std::string& name);
+  std::size_t find_in_string (const std::string& k) const;
+  void note_scan ();
+  void build_index ();
+  void compact ();
+
+public:
+  FriendSet ();
+
+  // Parse a stored friends list; throws std::invalid_argument as parse_friends_list () does
+  explicit FriendSet (const std::string& friends_list);
+
+  bool contains (const std::string& country, const std::string& name);
+
+  // Add a friend. Returns false if already present.
+  bool add (const std::string& country, const std::string& name);
+
+  // Remove a friend. Returns false if not present.
+  bool remove (const std::string& country, const std::string& name);
+
+  std::size_t size () const;
+
+  // The friends in stored form, in the order they were added
+  const std::string& to_string () const;
+
+  friends_list_t to_list () const;
+};
+
+#endif
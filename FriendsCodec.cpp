@@ -0,0 +1,206 @@
+#include "FriendsCodec.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using std::make_pair;
+using std::string;
+using std::vector;
+
+static const char base64_digits[] {"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"};
+
+constexpr unsigned digit_bits {5};
+constexpr unsigned more_digits {1u << digit_bits};   // Set on every digit of a number but the last
+
+// No number in a list needs more digits than this; more means the list is corrupt
+constexpr int max_digits {6};
+
+// Digit values by character, -1 for characters not in the alphabet
+static std::array<int8_t,256> make_digit_values () {
+  std::array<int8_t,256> values;
+  values.fill(-1);
+  for (int d {0}; d < 64; d++)
+    values[static_cast<unsigned char>(base64_digits[d])] = static_cast<int8_t>(d);
+  return values;
+}
+
+static const std::array<int8_t,256> digit_values {make_digit_values()};
+
+static void put_number (string& out, std::size_t n) {
+  while (n >= more_digits) {
+    out.push_back(base64_digits[(n & (more_digits - 1)) | more_digits]);
+    n >>= digit_bits;
+  }
+  out.push_back(base64_digits[n]);
+}
+
+static void put_bytes (string& out, const string_ref& bytes) {
+  put_number(out, bytes.size);
+  out.append(bytes.data, bytes.size);
+}
+
+/*
+  Encode friends, given as (country, name) views. Countries are
+  numbered in order of first use; a run of friends from one country
+  skips the hash lookup.
+ */
+static string encode (const friends_view_t& friends) {
+  if (friends.empty())
+    return string {};
+
+  std::unordered_map<string,std::size_t> index {};
+  vector<string_ref> countries {};
+  vector<std::size_t> country_of {};
+  country_of.reserve(friends.size());
+  std::size_t names_size {0};
+  for (const auto& f : friends) {
+    if (! countries.empty() && f.first.size == countries[country_of.back()].size &&
+        string::traits_type::compare(f.first.data, countries[country_of.back()].data, f.first.size) == 0) {
+      country_of.push_back(country_of.back());
+    }
+    else {
+      auto it (index.emplace(f.first.str(), countries.size()).first);
+      if (it->second == countries.size())
+        countries.push_back(f.first);
+      country_of.push_back(it->second);
+    }
+    names_size += f.second.size;
+  }
+
+  string out {};
+  out.reserve(names_size + 3 * friends.size() + 16 * countries.size() + 8);
+  out.push_back(compact_friends_marker);
+  put_number(out, countries.size());
+  for (const string_ref& c : countries)
+    put_bytes(out, c);
+  for (std::size_t i {0}; i < friends.size(); i++) {
+    put_number(out, country_of[i]);
+    put_bytes(out, friends[i].second);
+  }
+  return out;
+}
+
+/*
+  Reads the numbers and byte strings of a compact list in order,
+  throwing std::invalid_argument at anything out of place
+ */
+class CompactReader {
+private:
+  const string& compact;
+  std::size_t pos;
+
+  [[noreturn]] void malformed () const {
+    throw std::invalid_argument(string("Misformed compact friends list: ") + compact);
+  }
+
+public:
+  explicit CompactReader (const string& compact) : compact (compact), pos {1} {}
+
+  bool done () const { return pos == compact.size(); }
+
+  std::size_t number () {
+    std::size_t n {0};
+    for (int i {0}; i < max_digits && pos < compact.size(); i++) {
+      int d {digit_values[static_cast<unsigned char>(compact[pos++])]};
+      if (d < 0)
+        break;
+      n |= static_cast<std::size_t>(d & (more_digits - 1)) << (i * digit_bits);
+      if ((d & more_digits) == 0)
+        return n;
+    }
+    malformed();
+  }
+
+  // A number at most limit
+  std::size_t number (std::size_t limit) {
+    std::size_t n {number()};
+    if (n > limit)
+      malformed();
+    return n;
+  }
+
+  // A number below count
+  std::size_t index (std::size_t count) {
+    std::size_t n {number()};
+    if (n >= count)
+      malformed();
+    return n;
+  }
+
+  string_ref bytes () {
+    std::size_t size {number(compact.size() - pos)};
+    string_ref b {compact.data() + pos, size};
+    pos += size;
+    return b;
+  }
+};
+
+/*
+  Call f (country, name) for each friend of a compact list, in order,
+  with views into compact
+ */
+template <typename F>
+static void for_each_compact (const string& compact, F f) {
+  CompactReader in {compact};
+  // Every country takes at least a character, which bounds the count before anything is allocated
+  vector<string_ref> countries (in.number(compact.size()));
+  for (string_ref& c : countries)
+    c = in.bytes();
+  while (! in.done()) {
+    const string_ref& country (countries[in.index(countries.size())]);
+    f(country, in.bytes());
+  }
+}
+
+bool is_compact_friends (const string& stored) {
+  return ! stored.empty() && stored[0] == compact_friends_marker;
+}
+
+string encode_friends_compact (const friends_list_t& friends_list) {
+  friends_view_t friends {};
+  friends.reserve(friends_list.size());
+  for (const auto& f : friends_list)
+    friends.push_back(make_pair(string_ref {f.first.data(), f.first.size()},
+                                string_ref {f.second.data(), f.second.size()}));
+  return encode(friends);
+}
+
+string compact_friends (const string& text) {
+  return encode(parse_friends_view(text));
+}
+
+friends_list_t decode_friends_compact (const string& compact) {
+  friends_list_t friends_list {};
+  // An empty list is the same in either form
+  if (compact.empty())
+    return friends_list;
+  if (! is_compact_friends(compact))
+    throw std::invalid_argument(string("Misformed compact friends list: ") + compact);
+  for_each_compact(compact, [&friends_list] (const string_ref& country, const string_ref& name) {
+      friends_list.push_back(make_pair(country.str(), name.str()));
+    });
+  return friends_list;
+}
+
+string friends_to_text (const string& stored) {
+  if (! is_compact_friends(stored))
+    return stored;
+
+  // The text form is longer than the compact form, but rarely by more than double
+  string text {};
+  text.reserve(2 * stored.size());
+  for_each_compact(stored, [&text] (const string_ref& country, const string_ref& name) {
+      if (! text.empty())
+        text.push_back(pair_separator);
+      text.append(country.data, country.size);
+      text.push_back(pair_delimiter);
+      text.append(name.data, name.size);
+    });
+  return text;
+}
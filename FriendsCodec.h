@@ -0,0 +1,65 @@
+#ifndef FriendsCodec_h
+#define FriendsCodec_h
+
+#include <string>
+
+#include "ClientUtils.h"
+
+/*
+  A compact stored form for friends lists.
+
+  The text form, "Country;Name|Country;Name", spells out the country
+  of every friend, so a list of a thousand friends in a few countries
+  is mostly country names. The compact form names each country once:
+
+    '#'                         compact_friends_marker
+    count                       how many distinct countries
+    length bytes  (count times) each country, in order of first use
+    index length bytes  ...     each friend in list order: the index
+                                of their country, then their name
+
+  Numbers are variable-length, five bits to a character, low bits
+  first, in the base64 alphabet with the sixth bit set on every
+  character but the last (as in source map VLQs). Every byte of the
+  encoding is then printable ASCII, which JSON carries unescaped and
+  table storage accepts, and a number under 32 (any usual name
+  length or country index) is one character.
+
+  Names are read by length rather than scanned for separators, so
+  decoding touches each name once, with no search.
+
+  A text list can never begin with the marker: it begins with a
+  country, which is a data partition, and '#' is not allowed in a
+  partition key, or with pair_separator. Anything read from DataTable
+  can therefore be given to friends_to_text (), whichever form it is
+  in.
+ */
+constexpr char compact_friends_marker {'#'};
+
+// True if stored is a friends list in the compact form
+bool is_compact_friends (const std::string& stored);
+
+// The compact form of a friends list. An empty list is empty in both forms.
+std::string encode_friends_compact (const friends_list_t& friends_list);
+
+/*
+  The compact form of a friends list in the text form. Throws
+  std::invalid_argument if text is malformed, as parse_friends_list ()
+  does.
+ */
+std::string compact_friends (const std::string& text);
+
+/*
+  The friends list in a compact form. Throws std::invalid_argument if
+  compact is malformed.
+ */
+friends_list_t decode_friends_compact (const std::string& compact);
+
+/*
+  A stored friends list in the text form: decoded if it is compact,
+  otherwise as it is. Throws std::invalid_argument if it is compact
+  but malformed.
+ */
+std::string friends_to_text (const std::string& stored);
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef KWayMerge_h
+#define KWayMerge_h
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <queue>
+#include <vector>
+
+/*
+  A k-way merge of sources that are read a batch at a time, for
+  sources too costly to read in full up front (a storage query per
+  batch, say).
+
+  Each source is a refill function that appends its next batch,
+  already sorted by less, to the vector it is given, and returns
+  false once the source has nothing more after that batch. A source
+  is refilled only when the merge has used up its last batch, so
+  taking n items reads little more than n items plus a batch from
+  each source, whatever the sources' total size.
+
+  Equal items come out in the order their sources were added.
+ */
+template <typename T, typename Less>
+class KWayStream {
+public:
+  using refill_t = std::function<bool(std::vector<T>&)>;
+
+private:
+  struct Source {
+    refill_t refill;
+    std::vector<T> items;
+    std::size_t next;
+    bool more;
+  };
+
+  std::vector<Source> sources;
+  std::vector<std::size_t> heap;  // Sources with an item ready, by that item
+  Less less;
+  bool started;
+
+  // Heap order: true if source a's next item comes after source b's
+  bool after (std::size_t a, std::size_t b) const {
+    const T& x (sources[a].items[sources[a].next]);
+    const T& y (sources[b].items[sources[b].next]);
+    if (less(y, x))
+      return true;
+    if (less(x, y))
+      return false;
+    return a > b;
+  }
+
+  // Make sure source s has an item ready, refilling it if need be
+  bool ready (std::size_t s) {
+    Source& source (sources[s]);
+    while (source.next >= source.items.size() && source.more) {
+      source.items.clear();
+      source.next = 0;
+      source.more = source.refill(source.items);
+    }
+    return source.next < source.items.size();
+  }
+
+  void push (std::size_t s) {
+    heap.push_back(s);
+    std::push_heap(heap.begin(), heap.end(), [this] (std::size_t a, std::size_t b) { return after(a, b); });
+  }
+
+public:
+  explicit KWayStream (Less l = Less {}) :
+    sources {},
+    heap {},
+    less (l),
+    started {false}
+    {}
+
+  // Add a source; all sources must be added before the first next ()
+  void add_source (refill_t refill) {
+    sources.push_back(Source {std::move(refill), std::vector<T> {}, 0, true});
+  }
+
+  /*
+    Move the next item in merged order into item and set source to
+    the index of the source it came from. Returns false once every
+    source is exhausted.
+   */
+  bool next (T& item, std::size_t& source) {
+    if (! started) {
+      started = true;
+      for (std::size_t s {0}; s < sources.size(); s++) {
+        if (ready(s))
+          push(s);
+      }
+    }
+    if (heap.empty())
+      return false;
+
+    std::pop_heap(heap.begin(), heap.end(), [this] (std::size_t a, std::size_t b) { return after(a, b); });
+    source = heap.back();
+    heap.pop_back();
+    Source& s (sources[source]);
+    item = std::move(s.items[s.next]);
+    s.next++;
+    if (ready(source))
+      push(source);
+    return true;
+  }
+};
+
+#endif
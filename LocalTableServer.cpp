@@ -0,0 +1,1171 @@
+/*
+  Local stand-in for the Azure Table service.
+
+  Implements, in memory, the subset of the Table REST API that the
+  Azure Storage client library issues on behalf of BasicServer,
+  AuthServer and ServerUtils:
+
+    Tables:    create (POST /Tables), exists (GET /Tables('t')),
+               delete (DELETE /Tables('t'))
+    Entities:  retrieve (GET), insert (POST), insert-or-merge and
+               merge (MERGE), insert-or-replace and replace (PUT),
+               delete (DELETE), with If-Match/ETag concurrency
+    Queries:   GET /t() with $filter, $top, $select and continuation
+               (NextPartitionKey/NextRowKey)
+
+  Requests authenticated with a shared key are accepted as long as
+  they name the configured account; the key signature itself is not
+  checked. Requests carrying a shared access signature (the tokens
+  AuthServer mints for read_with_token/update_with_token) are fully
+  validated: table name, permissions, expiry, partition/row range and
+  the HMAC-SHA256 signature over the account key.
+
+  Every response can be delayed by a configurable latency (plus
+  uniform jitter) to mimic a remote storage account, without tying
+  up listener threads while the delay elapses.
+
+  Usage:
+    LocalTableServer [--url URL] [--account NAME] [--key BASE64KEY]
+                     [--latency-ms MS] [--jitter-ms MS] [--no-sig-check]
+
+  To point the servers at it, copy azure_keys_local.h to azure_keys.h.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <cpprest/asyncrt_utils.h>
+#include <cpprest/http_listener.h>
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+
+using pplx::extensibility::critical_section_t;
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::getline;
+using std::make_pair;
+using std::map;
+using std::pair;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+using web::http::http_headers;
+using web::http::http_request;
+using web::http::http_response;
+using web::http::methods;
+using web::http::status_code;
+using web::http::status_codes;
+using web::http::uri;
+
+using web::json::value;
+
+using web::http::experimental::listener::http_listener;
+
+using steady_clock = std::chrono::steady_clock;
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                  Configuration                  //
+//                                                 //
+/////////////////////////////////////////////////////
+
+string def_url {"http://127.0.0.1:10002/devstoreaccount1"};
+string account_name {"devstoreaccount1"};
+string account_key {"Eby8vdM02xNOcqFlqUwJPLlmEtlCDXJ1OUzFT50uSRZ6IFsuFq2UVErCz4I6tq/K1SZFPTOtr/KBHBeksoGMGw=="};
+int latency_ms {0};
+int jitter_ms {0};
+bool check_signatures {true};
+
+const string json_content_type {"application/json;odata=minimalmetadata;streaming=true;charset=utf-8"};
+const string type_suffix {"@odata.type"};
+
+// Largest page a query returns, as in the real service
+constexpr int max_page_size {1000};
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                  Stored data                    //
+//                                                 //
+/////////////////////////////////////////////////////
+
+/*
+  An entity's properties are kept as JSON values exactly as the client
+  sent them, including any "Name@odata.type" annotations, so they can
+  be echoed back without a round trip through the EDM type system.
+ */
+struct stored_entity {
+  map<string,value> props;
+  string etag;
+  string timestamp;
+};
+
+using entity_key_t = pair<string,string>;
+
+/*
+  Entities are kept ordered by (PartitionKey, RowKey), the order in
+  which the real service returns query results.
+ */
+struct stored_table {
+  string name;
+  map<entity_key_t,stored_entity> entities;
+};
+
+// Table names are case-insensitive, so the map is keyed by lower case name
+unordered_map<string,stored_table> tables {};
+critical_section_t tables_lock {};
+
+std::atomic<unsigned long long> etag_sequence {0};
+
+string lower (string s) {
+  std::transform(s.begin(), s.end(), s.begin(), [] (unsigned char c) { return std::tolower(c); });
+  return s;
+}
+
+string now_iso () {
+  return utility::datetime::utc_now().to_string(utility::datetime::ISO_8601);
+}
+
+string next_etag (const string& timestamp) {
+  return "W/\"datetime'" + uri::encode_data_string(timestamp) + "'-" +
+    std::to_string(++etag_sequence) + "\"";
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                 Delayed replies                 //
+//                                                 //
+/////////////////////////////////////////////////////
+
+/*
+  Fires callbacks at their deadlines from a single thread, so that
+  injected latency does not occupy a listener thread per request.
+ */
+class DelayQueue {
+private:
+  using entry_t = std::tuple<steady_clock::time_point,unsigned long long,std::function<void()>>;
+  struct later {
+    bool operator() (const entry_t& a, const entry_t& b) const {
+      return std::get<0>(a) != std::get<0>(b) ? std::get<0>(a) > std::get<0>(b)
+                                              : std::get<1>(a) > std::get<1>(b);
+    }
+  };
+  std::priority_queue<entry_t,vector<entry_t>,later> pending;
+  std::mutex lock;
+  std::condition_variable wake;
+  unsigned long long sequence;
+  bool stopping;
+  std::thread runner;
+
+  void run () {
+    std::unique_lock<std::mutex> guard {lock};
+    while (! stopping || ! pending.empty()) {
+      if (pending.empty()) {
+        wake.wait(guard);
+        continue;
+      }
+      steady_clock::time_point due {std::get<0>(pending.top())};
+      if (! stopping && steady_clock::now() < due) {
+        wake.wait_until(guard, due);
+        continue;
+      }
+      std::function<void()> fn {std::get<2>(pending.top())};
+      pending.pop();
+      guard.unlock();
+      fn();
+      guard.lock();
+    }
+  }
+
+public:
+  DelayQueue () :
+    pending {},
+    lock {},
+    wake {},
+    sequence {0},
+    stopping {false},
+    runner {&DelayQueue::run, this}
+    {};
+
+  ~DelayQueue () {
+    {
+      std::lock_guard<std::mutex> guard {lock};
+      stopping = true;
+    }
+    wake.notify_one();
+    runner.join();
+  }
+
+  void schedule (steady_clock::time_point due, std::function<void()> fn) {
+    {
+      std::lock_guard<std::mutex> guard {lock};
+      pending.push(std::make_tuple(due, sequence++, fn));
+    }
+    wake.notify_one();
+  }
+};
+
+DelayQueue* delay_queue {nullptr};
+std::mt19937 jitter_rng {12345};
+std::mutex jitter_lock {};
+
+/*
+  Send a response, after the configured injected latency
+ */
+void respond (http_request message, http_response response) {
+  if (latency_ms == 0 && jitter_ms == 0) {
+    message.reply(response);
+    return;
+  }
+  int delay {latency_ms};
+  if (jitter_ms > 0) {
+    std::lock_guard<std::mutex> guard {jitter_lock};
+    delay += std::uniform_int_distribution<int>(0, jitter_ms)(jitter_rng);
+  }
+  delay_queue->schedule(steady_clock::now() + std::chrono::milliseconds(delay),
+                        [message, response] () mutable { message.reply(response); });
+}
+
+void respond (http_request message, status_code code) {
+  respond(message, http_response {code});
+}
+
+void respond (http_request message, status_code code, const value& body,
+              const string& etag = string {}) {
+  http_response response {code};
+  response.set_body(body.serialize(), json_content_type);
+  if (! etag.empty())
+    response.headers().add("ETag", etag);
+  respond(message, response);
+}
+
+/*
+  Reply with a Table service error in the JSON format the client
+  library parses into storage_exception::result().extended_error()
+ */
+void respond_error (http_request message, status_code code, const string& error_code, const string& text) {
+  value msg {value::object(vector<pair<string,value>> {
+        make_pair("lang", value::string("en-US")),
+        make_pair("value", value::string(text))})};
+  value err {value::object(vector<pair<string,value>> {
+        make_pair("code", value::string(error_code)),
+        make_pair("message", msg)})};
+  respond(message, code, value::object(vector<pair<string,value>> {make_pair("odata.error", err)}));
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//              Request URI parsing                //
+//                                                 //
+/////////////////////////////////////////////////////
+
+/*
+  The resource a request addresses, parsed from paths of the form
+
+    /Tables              /Tables('name')
+    /name                /name()
+    /name(PartitionKey='p',RowKey='r')
+ */
+struct resource_t {
+  bool tables {false};     // The Tables collection or one of its members
+  string table {};         // Empty for the bare Tables collection
+  bool has_key {false};
+  string partition {};
+  string row {};
+};
+
+/*
+  Parse an OData quoted string starting at s[pos], where embedded
+  quotes are doubled. Leaves pos just past the closing quote.
+ */
+bool parse_quoted (const string& s, string::size_type& pos, string& out) {
+  if (pos >= s.size() || s[pos] != '\'')
+    return false;
+  out.clear();
+  for (pos++; pos < s.size(); pos++) {
+    if (s[pos] == '\'') {
+      if (pos + 1 < s.size() && s[pos + 1] == '\'') {
+        out += '\'';
+        pos++;
+      }
+      else {
+        pos++;
+        return true;
+      }
+    }
+    else
+      out += s[pos];
+  }
+  return false;
+}
+
+bool parse_resource (const string& raw_path, resource_t& res) {
+  string path {uri::decode(raw_path)};
+  string::size_type pos {0};
+  while (pos < path.size() && path[pos] == '/')
+    pos++;
+  string::size_type paren {path.find('(', pos)};
+  string name {path.substr(pos, paren == string::npos ? string::npos : paren - pos)};
+  if (name.empty())
+    return false;
+
+  if (name == "Tables") {
+    res.tables = true;
+    if (paren == string::npos)
+      return true;
+    pos = paren + 1;
+    return parse_quoted(path, pos, res.table) && pos < path.size() && path[pos] == ')';
+  }
+
+  res.table = name;
+  if (paren == string::npos || path.compare(paren, string::npos, "()") == 0)
+    return true;
+
+  pos = paren + 1;
+  const string pk_prefix {"PartitionKey="};
+  const string rk_prefix {",RowKey="};
+  if (path.compare(pos, pk_prefix.size(), pk_prefix) != 0)
+    return false;
+  pos += pk_prefix.size();
+  if (! parse_quoted(path, pos, res.partition))
+    return false;
+  if (path.compare(pos, rk_prefix.size(), rk_prefix) != 0)
+    return false;
+  pos += rk_prefix.size();
+  if (! parse_quoted(path, pos, res.row))
+    return false;
+  res.has_key = true;
+  return pos < path.size() && path[pos] == ')';
+}
+
+map<string,string> query_params (const http_request& message) {
+  map<string,string> params {};
+  for (const auto& p : uri::split_query(message.relative_uri().query()))
+    params[uri::decode(p.first)] = uri::decode(p.second);
+  return params;
+}
+
+string param_or_empty (const map<string,string>& params, const string& name) {
+  auto it (params.find(name));
+  return it == params.end() ? string {} : it->second;
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//           Shared access signatures              //
+//                                                 //
+/////////////////////////////////////////////////////
+
+string hmac_sha256_base64 (const string& message) {
+  vector<unsigned char> key {utility::conversions::from_base64(account_key)};
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len {0};
+  HMAC(EVP_sha256(), key.data(), static_cast<int>(key.size()),
+       reinterpret_cast<const unsigned char*>(message.data()), message.size(),
+       digest, &digest_len);
+  return utility::conversions::to_base64(vector<unsigned char>(digest, digest + digest_len));
+}
+
+/*
+  The string the client library signs for a table SAS. Versions
+  from 2015-04-05 onwards use the "/table/" resource prefix and sign
+  the IP and protocol restrictions as well.
+ */
+string sas_string_to_sign (const map<string,string>& p) {
+  string sv {param_or_empty(p, "sv")};
+  string resource {lower(param_or_empty(p, "tn"))};
+  string s {param_or_empty(p, "sp") + "\n" +
+            param_or_empty(p, "st") + "\n" +
+            param_or_empty(p, "se") + "\n"};
+  if (sv >= "2015-04-05")
+    s += "/table/" + account_name + "/" + resource + "\n" +
+      param_or_empty(p, "si") + "\n" +
+      param_or_empty(p, "sip") + "\n" +
+      param_or_empty(p, "spr") + "\n";
+  else
+    s += "/" + account_name + "/" + resource + "\n" +
+      param_or_empty(p, "si") + "\n";
+  s += sv + "\n" +
+    param_or_empty(p, "spk") + "\n" +
+    param_or_empty(p, "srk") + "\n" +
+    param_or_empty(p, "epk") + "\n" +
+    param_or_empty(p, "erk");
+  return s;
+}
+
+/*
+  Return true if the key (partition, row) lies in the range a SAS grants
+ */
+bool sas_key_in_range (const map<string,string>& p, const string& partition, const string& row) {
+  string spk {param_or_empty(p, "spk")};
+  string srk {param_or_empty(p, "srk")};
+  string epk {param_or_empty(p, "epk")};
+  string erk {param_or_empty(p, "erk")};
+  if (! spk.empty() && (partition < spk || (partition == spk && ! srk.empty() && row < srk)))
+    return false;
+  if (! epk.empty() && (partition > epk || (partition == epk && ! erk.empty() && row > erk)))
+    return false;
+  return true;
+}
+
+/*
+  Check a SAS against a request for the given table and permission
+  ('r', 'a', 'u' or 'd'). Returns an empty string if the SAS allows
+  the request, otherwise the reason it does not.
+ */
+string sas_rejection (const map<string,string>& p, const string& table, const string& perms) {
+  if (lower(param_or_empty(p, "tn")) != lower(table))
+    return "Signature is not valid for this table";
+  string sp {param_or_empty(p, "sp")};
+  for (char c : perms)
+    if (sp.find(c) == string::npos)
+      return "Signature does not grant the required permission";
+
+  utility::datetime now {utility::datetime::utc_now()};
+  string se {param_or_empty(p, "se")};
+  if (se.empty() || utility::datetime::from_string(se, utility::datetime::ISO_8601).to_interval() < now.to_interval())
+    return "Signature has expired";
+  string st {param_or_empty(p, "st")};
+  if (! st.empty() && utility::datetime::from_string(st, utility::datetime::ISO_8601).to_interval() > now.to_interval())
+    return "Signature is not yet valid";
+
+  if (check_signatures && hmac_sha256_base64(sas_string_to_sign(p)) != param_or_empty(p, "sig"))
+    return "Signature did not match";
+  return string {};
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//               $filter evaluation                //
+//                                                 //
+/////////////////////////////////////////////////////
+
+/*
+  Recursive-descent evaluator for the OData filter subset:
+
+    expr       := and_expr ('or' and_expr)*
+    and_expr   := unary ('and' unary)*
+    unary      := 'not' unary | '(' expr ')' | comparison
+    comparison := Property op literal
+    op         := eq | ne | gt | ge | lt | le
+    literal    := 'string' | number[L] | true | false
+                | datetime'...' | guid'...'
+
+  Comparisons between mismatched types are false, as in the service.
+ */
+class FilterEvaluator {
+private:
+  const string& text;
+  string::size_type pos;
+  const string& partition;
+  const string& row;
+  const stored_entity& entity;
+
+  enum lit_kind { lit_string, lit_number, lit_bool, lit_datetime, lit_guid };
+
+  void skip_space () {
+    while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+      pos++;
+  }
+
+  string word () {
+    skip_space();
+    string::size_type start {pos};
+    while (pos < text.size() &&
+           (std::isalnum(static_cast<unsigned char>(text[pos])) || text[pos] == '_' ||
+            text[pos] == '.' || text[pos] == '-' || text[pos] == '+'))
+      pos++;
+    return text.substr(start, pos - start);
+  }
+
+  bool accept (const string& kw) {
+    skip_space();
+    string::size_type save {pos};
+    if (word() == kw)
+      return true;
+    pos = save;
+    return false;
+  }
+
+  void expect_char (char c) {
+    skip_space();
+    if (pos >= text.size() || text[pos] != c)
+      throw std::invalid_argument("Malformed $filter");
+    pos++;
+  }
+
+  /*
+    Return the property's value and its EDM type name
+   */
+  bool lookup (const string& name, value& v, string& type) const {
+    if (name == "PartitionKey" || name == "RowKey") {
+      v = value::string(name == "PartitionKey" ? partition : row);
+      type = "Edm.String";
+      return true;
+    }
+    if (name == "Timestamp") {
+      v = value::string(entity.timestamp);
+      type = "Edm.DateTime";
+      return true;
+    }
+    auto it (entity.props.find(name));
+    if (it == entity.props.end())
+      return false;
+    v = it->second;
+    auto t (entity.props.find(name + type_suffix));
+    if (t != entity.props.end())
+      type = t->second.as_string();
+    else if (v.is_string())
+      type = "Edm.String";
+    else if (v.is_boolean())
+      type = "Edm.Boolean";
+    else
+      type = "Edm.Double";
+    return true;
+  }
+
+  template<typename T>
+  static bool compare (const string& op, const T& a, const T& b) {
+    if (op == "eq") return a == b;
+    if (op == "ne") return ! (a == b);
+    if (op == "gt") return b < a;
+    if (op == "ge") return ! (a < b);
+    if (op == "lt") return a < b;
+    if (op == "le") return ! (b < a);
+    throw std::invalid_argument("Unknown operator " + op);
+  }
+
+  bool comparison () {
+    string name {word()};
+    string op {word()};
+    skip_space();
+
+    lit_kind kind {lit_number};
+    string lit {};
+    if (pos < text.size() && text[pos] == '\'') {
+      kind = lit_string;
+    }
+    else {
+      string prefix {word()};
+      if (prefix == "datetime")
+        kind = lit_datetime;
+      else if (prefix == "guid")
+        kind = lit_guid;
+      else if (prefix == "true" || prefix == "false") {
+        kind = lit_bool;
+        lit = prefix;
+      }
+      else {
+        kind = lit_number;
+        lit = prefix;
+        if (! lit.empty() && (lit.back() == 'L' || lit.back() == 'l'))
+          lit.pop_back();
+      }
+    }
+    if (kind == lit_string || kind == lit_datetime || kind == lit_guid)
+      if (! parse_quoted(text, pos, lit))
+        throw std::invalid_argument("Malformed $filter literal");
+
+    value v {};
+    string type {};
+    if (! lookup(name, v, type))
+      return false;
+
+    switch (kind) {
+    case lit_string:
+      return type == "Edm.String" && v.is_string() && compare(op, v.as_string(), lit);
+    case lit_datetime:
+      return type == "Edm.DateTime" && v.is_string() &&
+        compare(op, utility::datetime::from_string(v.as_string(), utility::datetime::ISO_8601).to_interval(),
+                utility::datetime::from_string(lit, utility::datetime::ISO_8601).to_interval());
+    case lit_guid:
+      return type == "Edm.Guid" && v.is_string() && compare(op, lower(v.as_string()), lower(lit));
+    case lit_bool:
+      return v.is_boolean() && compare(op, v.as_bool(), lit == "true");
+    case lit_number:
+      if (v.is_number())
+        return compare(op, v.as_double(), std::stod(lit));
+      if (type == "Edm.Int64" && v.is_string())
+        return compare(op, std::stoll(v.as_string()), std::stoll(lit));
+      return false;
+    }
+    return false;
+  }
+
+  bool unary () {
+    if (accept("not"))
+      return ! unary();
+    skip_space();
+    if (pos < text.size() && text[pos] == '(') {
+      pos++;
+      bool r {expr()};
+      expect_char(')');
+      return r;
+    }
+    return comparison();
+  }
+
+  bool and_expr () {
+    bool r {unary()};
+    while (accept("and")) {
+      bool rhs {unary()};
+      r = r && rhs;
+    }
+    return r;
+  }
+
+  bool expr () {
+    bool r {and_expr()};
+    while (accept("or")) {
+      bool rhs {and_expr()};
+      r = r || rhs;
+    }
+    return r;
+  }
+
+public:
+  FilterEvaluator (const string& filter, const string& p, const string& r, const stored_entity& e) :
+    text (filter),
+    pos {0},
+    partition (p),
+    row (r),
+    entity (e)
+    {};
+
+  bool matches () {
+    if (text.empty())
+      return true;
+    bool r {expr()};
+    skip_space();
+    if (pos != text.size())
+      throw std::invalid_argument("Trailing text in $filter");
+    return r;
+  }
+};
+
+/////////////////////////////////////////////////////
+//                                                 //
+//              Entity serialization               //
+//                                                 //
+/////////////////////////////////////////////////////
+
+/*
+  The property entries of a request body, without the system
+  properties and OData metadata that are not stored
+ */
+map<string,value> body_properties (const value& body) {
+  map<string,value> props {};
+  if (! body.is_object())
+    return props;
+  for (const auto& p : body.as_object()) {
+    const string& name {p.first};
+    if (name == "PartitionKey" || name == "RowKey" || name == "Timestamp" ||
+        name.compare(0, 6, "odata.") == 0 ||
+        name.compare(0, 9, "Timestamp") == 0)
+      continue;
+    props[name] = p.second;
+  }
+  return props;
+}
+
+value entity_json (const string& table, const entity_key_t& key, const stored_entity& e,
+                   const vector<string>& select, bool with_metadata) {
+  vector<pair<string,value>> fields {};
+  if (with_metadata)
+    fields.push_back(make_pair("odata.metadata",
+                               value::string(def_url + "/$metadata#" + table + "/@Element")));
+  fields.push_back(make_pair("odata.etag", value::string(e.etag)));
+  fields.push_back(make_pair("PartitionKey", value::string(key.first)));
+  fields.push_back(make_pair("RowKey", value::string(key.second)));
+  fields.push_back(make_pair("Timestamp", value::string(e.timestamp)));
+  for (const auto& p : e.props) {
+    if (! select.empty()) {
+      string base {p.first.substr(0, p.first.find('@'))};
+      if (std::find(select.begin(), select.end(), base) == select.end())
+        continue;
+    }
+    fields.push_back(p);
+  }
+  return value::object(fields);
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                Table operations                 //
+//                                                 //
+/////////////////////////////////////////////////////
+
+void create_table (http_request message) {
+  value body {message.extract_json(true).get()};
+  string name {body.is_object() && body.has_field("TableName") ? body.at("TableName").as_string() : string {}};
+  if (name.empty()) {
+    respond_error(message, status_codes::BadRequest, "InvalidInput", "Missing TableName");
+    return;
+  }
+  bool created {false};
+  {
+    scoped_critical_section_t guard {tables_lock};
+    if (tables.find(lower(name)) == tables.end()) {
+      tables[lower(name)] = stored_table {name, map<entity_key_t,stored_entity> {}};
+      created = true;
+    }
+  }
+  if (! created) {
+    respond_error(message, status_codes::Conflict, "TableAlreadyExists", "The table specified already exists.");
+    return;
+  }
+  const http_headers& headers {message.headers()};
+  auto prefer (headers.find("Prefer"));
+  if (prefer != headers.end() && prefer->second == "return-no-content") {
+    respond(message, status_codes::NoContent);
+    return;
+  }
+  respond(message, status_codes::Created,
+          value::object(vector<pair<string,value>> {
+              make_pair("odata.metadata", value::string(def_url + "/$metadata#Tables/@Element")),
+              make_pair("TableName", value::string(name))}));
+}
+
+void table_exists (http_request message, const string& name) {
+  bool found {false};
+  {
+    scoped_critical_section_t guard {tables_lock};
+    found = tables.find(lower(name)) != tables.end();
+  }
+  if (! found) {
+    respond_error(message, status_codes::NotFound, "ResourceNotFound", "The specified resource does not exist.");
+    return;
+  }
+  respond(message, status_codes::OK,
+          value::object(vector<pair<string,value>> {
+              make_pair("odata.metadata", value::string(def_url + "/$metadata#Tables/@Element")),
+              make_pair("TableName", value::string(name))}));
+}
+
+void delete_table (http_request message, const string& name) {
+  size_t erased {0};
+  {
+    scoped_critical_section_t guard {tables_lock};
+    erased = tables.erase(lower(name));
+  }
+  if (erased == 0)
+    respond_error(message, status_codes::NotFound, "ResourceNotFound", "The specified resource does not exist.");
+  else
+    respond(message, status_codes::NoContent);
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                Entity operations                //
+//                                                 //
+/////////////////////////////////////////////////////
+
+void retrieve_entity (http_request message, const resource_t& res) {
+  value result {};
+  string etag {};
+  bool table_found {false};
+  {
+    scoped_critical_section_t guard {tables_lock};
+    auto t (tables.find(lower(res.table)));
+    if (t != tables.end()) {
+      table_found = true;
+      entity_key_t key {res.partition, res.row};
+      auto e (t->second.entities.find(key));
+      if (e != t->second.entities.end()) {
+        result = entity_json(t->second.name, key, e->second, vector<string> {}, true);
+        etag = e->second.etag;
+      }
+    }
+  }
+  if (! table_found)
+    respond_error(message, status_codes::NotFound, "TableNotFound", "The table specified does not exist.");
+  else if (etag.empty())
+    respond_error(message, status_codes::NotFound, "ResourceNotFound", "The specified resource does not exist.");
+  else
+    respond(message, status_codes::OK, result, etag);
+}
+
+/*
+  Shared implementation of insert, merge and replace.
+
+  body: the JSON entity sent by the client
+  merge: properties in the body are merged into the existing entity,
+    rather than replacing all of them
+  if_match: the If-Match header, empty for an upsert
+  insert_only: fail if the entity already exists
+ */
+void write_entity (http_request message, const string& table, const entity_key_t& key,
+                   const value& body, bool merge, const string& if_match, bool insert_only,
+                   const map<string,string>& sas) {
+  map<string,value> props {body_properties(body)};
+
+  // Upserts need both add and update permission; conditional writes only update
+  if (! sas.empty()) {
+    string reason {sas_rejection(sas, table, insert_only ? "a" : if_match.empty() ? "au" : "u")};
+    if (reason.empty() && ! sas_key_in_range(sas, key.first, key.second))
+      reason = "Signature does not cover this entity";
+    if (! reason.empty()) {
+      respond_error(message, status_codes::Forbidden, "AuthorizationFailure", reason);
+      return;
+    }
+  }
+
+  status_code code {status_codes::NoContent};
+  string error_code {};
+  string etag {};
+  value created {};
+  {
+    scoped_critical_section_t guard {tables_lock};
+    auto t (tables.find(lower(table)));
+    if (t == tables.end()) {
+      code = status_codes::NotFound;
+      error_code = "TableNotFound";
+    }
+    else {
+      auto e (t->second.entities.find(key));
+      bool exists {e != t->second.entities.end()};
+      if (insert_only && exists) {
+        code = status_codes::Conflict;
+        error_code = "EntityAlreadyExists";
+      }
+      else if (! if_match.empty() && ! exists) {
+        code = status_codes::NotFound;
+        error_code = "ResourceNotFound";
+      }
+      else if (! if_match.empty() && if_match != "*" && if_match != e->second.etag) {
+        code = status_codes::PreconditionFailed;
+        error_code = "UpdateConditionNotSatisfied";
+      }
+      else {
+        stored_entity& target (t->second.entities[key]);
+        if (merge && exists) {
+          for (const auto& p : props) {
+            target.props[p.first] = p.second;
+            // A merged value without a type annotation resets the type
+            if (p.first.find('@') == string::npos && props.find(p.first + type_suffix) == props.end())
+              target.props.erase(p.first + type_suffix);
+          }
+        }
+        else
+          target.props = props;
+        target.timestamp = now_iso();
+        target.etag = next_etag(target.timestamp);
+        etag = target.etag;
+        if (insert_only) {
+          code = status_codes::Created;
+          created = entity_json(t->second.name, key, target, vector<string> {}, true);
+        }
+      }
+    }
+  }
+
+  if (! error_code.empty()) {
+    respond_error(message, code, error_code, "The entity write could not be performed.");
+    return;
+  }
+  if (code == status_codes::Created) {
+    const http_headers& headers {message.headers()};
+    auto prefer (headers.find("Prefer"));
+    if (prefer == headers.end() || prefer->second != "return-no-content") {
+      respond(message, status_codes::Created, created, etag);
+      return;
+    }
+  }
+  http_response response {status_codes::NoContent};
+  response.headers().add("ETag", etag);
+  respond(message, response);
+}
+
+void delete_entity (http_request message, const resource_t& res, const string& if_match,
+                    const map<string,string>& sas) {
+  if (! sas.empty()) {
+    string reason {sas_rejection(sas, res.table, "d")};
+    if (reason.empty() && ! sas_key_in_range(sas, res.partition, res.row))
+      reason = "Signature does not cover this entity";
+    if (! reason.empty()) {
+      respond_error(message, status_codes::Forbidden, "AuthorizationFailure", reason);
+      return;
+    }
+  }
+
+  status_code code {status_codes::NoContent};
+  string error_code {};
+  {
+    scoped_critical_section_t guard {tables_lock};
+    auto t (tables.find(lower(res.table)));
+    if (t == tables.end()) {
+      code = status_codes::NotFound;
+      error_code = "TableNotFound";
+    }
+    else {
+      auto e (t->second.entities.find(entity_key_t {res.partition, res.row}));
+      if (e == t->second.entities.end()) {
+        code = status_codes::NotFound;
+        error_code = "ResourceNotFound";
+      }
+      else if (! if_match.empty() && if_match != "*" && if_match != e->second.etag) {
+        code = status_codes::PreconditionFailed;
+        error_code = "UpdateConditionNotSatisfied";
+      }
+      else
+        t->second.entities.erase(e);
+    }
+  }
+  if (! error_code.empty())
+    respond_error(message, code, error_code, "The entity could not be deleted.");
+  else
+    respond(message, status_codes::NoContent);
+}
+
+/*
+  Query a table, returning at most $top (and never more than 1000)
+  entities per page. When more remain, the continuation headers carry
+  the key of the first entity of the next page; the client returns
+  them as the NextPartitionKey/NextRowKey query parameters, base64
+  encoded so any key characters survive the round trip.
+ */
+void query_entities (http_request message, const string& table, const map<string,string>& params,
+                     const map<string,string>& sas) {
+  if (! sas.empty()) {
+    string reason {sas_rejection(sas, table, "r")};
+    if (! reason.empty()) {
+      respond_error(message, status_codes::Forbidden, "AuthorizationFailure", reason);
+      return;
+    }
+  }
+
+  string filter {param_or_empty(params, "$filter")};
+  int top {max_page_size};
+  string top_param {param_or_empty(params, "$top")};
+  if (! top_param.empty())
+    top = std::max(1, std::min(max_page_size, std::atoi(top_param.c_str())));
+
+  vector<string> select {};
+  string select_param {param_or_empty(params, "$select")};
+  for (string::size_type start {0}; start < select_param.size(); ) {
+    string::size_type comma {select_param.find(',', start)};
+    if (comma == string::npos)
+      comma = select_param.size();
+    select.push_back(select_param.substr(start, comma - start));
+    start = comma + 1;
+  }
+
+  entity_key_t from {};
+  string next_pk {param_or_empty(params, "NextPartitionKey")};
+  string next_rk {param_or_empty(params, "NextRowKey")};
+  try {
+    if (! next_pk.empty()) {
+      vector<unsigned char> pk {utility::conversions::from_base64(next_pk)};
+      vector<unsigned char> rk {utility::conversions::from_base64(next_rk)};
+      from = entity_key_t {string(pk.begin(), pk.end()), string(rk.begin(), rk.end())};
+    }
+  }
+  catch (const std::exception& e) {
+    respond_error(message, status_codes::BadRequest, "InvalidInput", "Malformed continuation token");
+    return;
+  }
+
+  vector<value> page {};
+  entity_key_t next {};
+  bool more {false};
+  bool table_found {false};
+  try {
+    scoped_critical_section_t guard {tables_lock};
+    auto t (tables.find(lower(table)));
+    if (t != tables.end()) {
+      table_found = true;
+      for (auto e (t->second.entities.lower_bound(from)); e != t->second.entities.end(); ++e) {
+        if (! sas.empty() && ! sas_key_in_range(sas, e->first.first, e->first.second))
+          continue;
+        if (! FilterEvaluator {filter, e->first.first, e->first.second, e->second}.matches())
+          continue;
+        if (static_cast<int>(page.size()) == top) {
+          next = e->first;
+          more = true;
+          break;
+        }
+        page.push_back(entity_json(t->second.name, e->first, e->second, select, false));
+      }
+    }
+  }
+  catch (const std::exception& e) {
+    respond_error(message, status_codes::BadRequest, "InvalidInput", e.what());
+    return;
+  }
+  if (! table_found) {
+    respond_error(message, status_codes::NotFound, "TableNotFound", "The table specified does not exist.");
+    return;
+  }
+
+  http_response response {status_codes::OK};
+  response.set_body(value::object(vector<pair<string,value>> {
+        make_pair("odata.metadata", value::string(def_url + "/$metadata#" + table)),
+        make_pair("value", value::array(page))}).serialize(),
+    json_content_type);
+  if (more) {
+    response.headers().add("x-ms-continuation-NextPartitionKey",
+                           utility::conversions::to_base64(vector<unsigned char>(next.first.begin(), next.first.end())));
+    response.headers().add("x-ms-continuation-NextRowKey",
+                           utility::conversions::to_base64(vector<unsigned char>(next.second.begin(), next.second.end())));
+  }
+  respond(message, response);
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                   Dispatch                      //
+//                                                 //
+/////////////////////////////////////////////////////
+
+/*
+  Top-level routine for all requests, whatever their method
+  (the client library uses MERGE as well as the usual four).
+ */
+void handle_request (http_request message) {
+  resource_t res {};
+  if (! parse_resource(message.relative_uri().path(), res)) {
+    respond_error(message, status_codes::BadRequest, "InvalidUri", "The requested URI does not represent any resource.");
+    return;
+  }
+
+  map<string,string> params {query_params(message)};
+  map<string,string> sas {};
+  if (params.find("sig") != params.end()) {
+    sas = params;
+  }
+  else {
+    const http_headers& headers {message.headers()};
+    auto auth (headers.find("Authorization"));
+    if (auth == headers.end() || auth->second.find(" " + account_name + ":") == string::npos) {
+      respond_error(message, status_codes::Forbidden, "AuthenticationFailed", "Missing or foreign credentials.");
+      return;
+    }
+  }
+
+  const http_headers& headers {message.headers()};
+  auto if_match_it (headers.find("If-Match"));
+  string if_match {if_match_it == headers.end() ? string {} : if_match_it->second};
+  string method {message.method()};
+
+  // Tokens only ever grant entity access, never table management
+  if (res.tables) {
+    if (! sas.empty())
+      respond_error(message, status_codes::Forbidden, "AuthorizationFailure", "SAS cannot manage tables.");
+    else if (method == methods::POST && res.table.empty())
+      create_table(message);
+    else if (method == methods::GET && ! res.table.empty())
+      table_exists(message, res.table);
+    else if (method == methods::DEL && ! res.table.empty())
+      delete_table(message, res.table);
+    else
+      respond_error(message, status_codes::MethodNotAllowed, "UnsupportedHttpVerb", "Unsupported operation on Tables.");
+    return;
+  }
+
+  entity_key_t key {res.partition, res.row};
+  if (method == methods::GET && res.has_key) {
+    if (! sas.empty()) {
+      string reason {sas_rejection(sas, res.table, "r")};
+      if (reason.empty() && ! sas_key_in_range(sas, res.partition, res.row))
+        reason = "Signature does not cover this entity";
+      if (! reason.empty()) {
+        respond_error(message, status_codes::Forbidden, "AuthorizationFailure", reason);
+        return;
+      }
+    }
+    retrieve_entity(message, res);
+  }
+  else if (method == methods::GET)
+    query_entities(message, res.table, params, sas);
+  else if (method == methods::POST && ! res.has_key) {
+    // Insert takes the key from the body rather than the URI
+    value body {message.extract_json(true).get()};
+    if (! body.is_object() || ! body.has_field("PartitionKey") || ! body.has_field("RowKey")) {
+      respond_error(message, status_codes::BadRequest, "PropertiesNeedValue", "PartitionKey and RowKey are required.");
+      return;
+    }
+    write_entity(message, res.table,
+                 entity_key_t {body.at("PartitionKey").as_string(), body.at("RowKey").as_string()},
+                 body, false, string {}, true, sas);
+  }
+  else if ((method == "MERGE" || method == methods::PUT) && res.has_key)
+    write_entity(message, res.table, key, message.extract_json(true).get(),
+                 method == "MERGE", if_match, false, sas);
+  else if (method == methods::DEL && res.has_key)
+    delete_entity(message, res, if_match, sas);
+  else
+    respond_error(message, status_codes::MethodNotAllowed, "UnsupportedHttpVerb", "Unsupported operation.");
+}
+
+/*
+  Main stand-in server routine
+
+  Install the handler for every HTTP method and open the listener,
+  which processes each request asynchronously.
+
+  Wait for a carriage return, then shut the server down.
+ */
+int main (int argc, char const * argv[]) {
+  for (int i {1}; i < argc; i++) {
+    string arg {argv[i]};
+    bool has_val {i + 1 < argc};
+    if (arg == "--url" && has_val)
+      def_url = argv[++i];
+    else if (arg == "--account" && has_val)
+      account_name = argv[++i];
+    else if (arg == "--key" && has_val)
+      account_key = argv[++i];
+    else if (arg == "--latency-ms" && has_val)
+      latency_ms = std::atoi(argv[++i]);
+    else if (arg == "--jitter-ms" && has_val)
+      jitter_ms = std::atoi(argv[++i]);
+    else if (arg == "--no-sig-check")
+      check_signatures = false;
+    else {
+      cerr << "Usage: LocalTableServer [--url URL] [--account NAME] [--key BASE64KEY] "
+           << "[--latency-ms MS] [--jitter-ms MS] [--no-sig-check]" << endl;
+      return 1;
+    }
+  }
+
+  DelayQueue delays {};
+  delay_queue = &delays;
+
+  cout << "LocalTableServer: Opening listener on " << def_url
+       << " (latency " << latency_ms << " ms + up to " << jitter_ms << " ms jitter)" << endl;
+  http_listener listener {def_url};
+  listener.support(&handle_request);
+  listener.open().wait(); // Wait for listener to complete starting
+
+  cout << "Enter carriage return to stop LocalTableServer." << endl;
+  string line;
+  getline(std::cin, line);
+
+  // Shut it down
+  listener.close().wait();
+  cout << "LocalTableServer closed" << endl;
+}
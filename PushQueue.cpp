@@ -0,0 +1,368 @@
+#include "PushQueue.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+
+using lock_t = std::lock_guard<std::mutex>;
+
+constexpr uint64_t PushQueue::default_segment_limit;
+
+static const string segment_prefix {"segment-"};
+static const string segment_suffix {".log"};
+static const string cursor_file {"cursor"};
+
+// Segment names zero-pad their first sequence number so that they list in order
+constexpr std::size_t seq_digits {20};
+
+// Each record starts with the length of its body and the checksum of it, four bytes each
+constexpr std::size_t record_header_bytes {8};
+
+/*
+  The cursor is rewritten only after this many acknowledgements that
+  advance it, or after cursor_interval, or when a segment can be
+  deleted. A cursor that lags only means more jobs returned again.
+ */
+constexpr uint64_t cursor_acks {64};
+constexpr std::chrono::milliseconds cursor_interval {200};
+
+// No job comes near this; a longer length is a torn or corrupt header
+constexpr uint32_t max_record_bytes {64 << 20};
+
+static void put_varint (string& out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(v));
+}
+
+static void put_string (string& out, const string& s) {
+  put_varint(out, s.size());
+  out.append(s);
+}
+
+static bool get_varint (const string& in, std::size_t& pos, std::size_t end, uint64_t& v) {
+  v = 0;
+  for (int shift {0}; shift < 64; shift += 7) {
+    if (pos >= end)
+      return false;
+    unsigned char byte {static_cast<unsigned char>(in[pos++])};
+    v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+static bool get_string (const string& in, std::size_t& pos, std::size_t end, string& s) {
+  uint64_t len {0};
+  if (! get_varint(in, pos, end, len) || len > end - pos)
+    return false;
+  s.assign(in, pos, len);
+  pos += len;
+  return true;
+}
+
+static void put_u32 (string& out, uint32_t v) {
+  for (int i {0}; i < 4; i++)
+    out.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+}
+
+static uint32_t get_u32 (const string& in, std::size_t pos) {
+  uint32_t v {0};
+  for (int i {0}; i < 4; i++)
+    v |= static_cast<uint32_t>(static_cast<unsigned char>(in[pos + i])) << (8 * i);
+  return v;
+}
+
+static uint32_t fnv1a (const char* data, std::size_t size) {
+  uint32_t h {2166136261u};
+  for (std::size_t i {0}; i < size; i++) {
+    h ^= static_cast<unsigned char>(data[i]);
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static string encode_record (const PushJob& job) {
+  string body {};
+  put_varint(body, job.seq);
+  put_varint(body, job.enqueued_micros);
+  put_varint(body, job.attempts);
+  put_string(body, job.poster_partition);
+  put_string(body, job.poster_row);
+  put_string(body, job.status);
+  put_string(body, job.recipients);
+
+  string record {};
+  record.reserve(record_header_bytes + body.size());
+  put_u32(record, static_cast<uint32_t>(body.size()));
+  put_u32(record, fnv1a(body.data(), body.size()));
+  record.append(body);
+  return record;
+}
+
+/*
+  Decode the record at pos in a segment's contents into job, moving
+  pos past it. Returns false, leaving pos alone, if the record is
+  incomplete or fails its checksum.
+ */
+static bool decode_record (const string& in, std::size_t& pos, PushJob& job) {
+  if (in.size() - pos < record_header_bytes)
+    return false;
+  uint32_t size {get_u32(in, pos)};
+  if (size > max_record_bytes || size > in.size() - pos - record_header_bytes)
+    return false;
+  std::size_t body {pos + record_header_bytes};
+  std::size_t end {body + size};
+  if (fnv1a(in.data() + body, size) != get_u32(in, pos + 4))
+    return false;
+
+  uint64_t attempts {0};
+  std::size_t p {body};
+  if (! (get_varint(in, p, end, job.seq) && get_varint(in, p, end, job.enqueued_micros) &&
+         get_varint(in, p, end, attempts) &&
+         get_string(in, p, end, job.poster_partition) && get_string(in, p, end, job.poster_row) &&
+         get_string(in, p, end, job.status) && get_string(in, p, end, job.recipients) && p == end))
+    return false;
+  job.attempts = static_cast<uint32_t>(attempts);
+  pos = end;
+  return true;
+}
+
+// Write all of data to fd
+static bool write_all (int fd, const string& data) {
+  std::size_t done {0};
+  while (done < data.size()) {
+    ssize_t n {::write(fd, data.data() + done, data.size() - done)};
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    done += static_cast<std::size_t>(n);
+  }
+  return true;
+}
+
+PushQueue::PushQueue (const string& dir, uint64_t segment_limit, bool sync) :
+  mutex {},
+  dir {dir},
+  segment_limit {segment_limit},
+  sync {sync},
+  fd {-1},
+  segments {},
+  unacked {},
+  next_seq {0},
+  cursor {0},
+  appended_count {0},
+  acked_count {0},
+  acks_since_cursor {0},
+  cursor_written {std::chrono::steady_clock::now()}
+  {}
+
+PushQueue::~PushQueue () {
+  lock_t lock {mutex};
+  if (fd >= 0) {
+    write_cursor(unacked.empty() ? next_seq : unacked.begin()->first);
+    ::close(fd);
+  }
+}
+
+string PushQueue::segment_path (uint64_t first_seq) const {
+  string number {std::to_string(first_seq)};
+  number.insert(0, seq_digits - std::min(seq_digits, number.size()), '0');
+  return dir + "/" + segment_prefix + number + segment_suffix;
+}
+
+// Requires mutex held
+bool PushQueue::start_segment () {
+  if (fd >= 0)
+    ::close(fd);
+  string path {segment_path(next_seq)};
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return false;
+
+  // The new file's directory entry must reach the disk too, or a synced record in it can still be lost
+  if (sync) {
+    int dir_fd {::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+    bool synced {dir_fd >= 0 && ::fsync(dir_fd) == 0};
+    if (dir_fd >= 0)
+      ::close(dir_fd);
+    if (! synced) {
+      ::close(fd);
+      fd = -1;
+      return false;
+    }
+  }
+  segments.push_back(Segment {next_seq, 0, 0, 0, path});
+  return true;
+}
+
+// Requires mutex held. Returns false, leaving the cursor as it was, if it could not be written.
+bool PushQueue::write_cursor (uint64_t low) {
+  if (low == cursor)
+    return true;
+  string tmp_path {dir + "/" + cursor_file + ".tmp"};
+  {
+    std::ofstream file {tmp_path, std::ios::trunc};
+    file << low << '\n';
+    file.close();
+    if (! file)
+      return false;
+  }
+  if (std::rename(tmp_path.c_str(), (dir + "/" + cursor_file).c_str()) != 0)
+    return false;
+  cursor = low;
+  acks_since_cursor = 0;
+  cursor_written = std::chrono::steady_clock::now();
+  return true;
+}
+
+/*
+  Requires mutex held. Advance the cursor past every acknowledged job,
+  if it is due to be written (see cursor_acks), and delete the
+  segments, other than the active one, that hold nothing at or after
+  it. The cursor is written before anything is deleted, so a crash in
+  between at worst returns acknowledged jobs.
+ */
+void PushQueue::release_segments () {
+  uint64_t low {unacked.empty() ? next_seq : unacked.begin()->first};
+  if (low == cursor)
+    return;
+
+  const Segment& oldest (segments.front());
+  bool segment_done {segments.size() > 1 && (oldest.jobs == 0 || oldest.last_seq < low)};
+  if (! segment_done && ++acks_since_cursor < cursor_acks &&
+      std::chrono::steady_clock::now() - cursor_written < cursor_interval)
+    return;
+  if (! write_cursor(low))
+    return;
+
+  while (segments.size() > 1 && (segments.front().jobs == 0 || segments.front().last_seq < cursor)) {
+    std::remove(segments.front().path.c_str());
+    segments.pop_front();
+  }
+}
+
+bool PushQueue::open (vector<PushJob>& pending) {
+  lock_t lock {mutex};
+  if (::mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+    return false;
+
+  {
+    std::ifstream file {dir + "/" + cursor_file};
+    uint64_t saved {0};
+    if (file >> saved)
+      cursor = saved;
+  }
+  next_seq = cursor;
+
+  vector<uint64_t> firsts {};
+  DIR* d {::opendir(dir.c_str())};
+  if (d == nullptr)
+    return false;
+  while (struct dirent* entry = ::readdir(d)) {
+    string name {entry->d_name};
+    if (name.size() == segment_prefix.size() + seq_digits + segment_suffix.size() &&
+        name.compare(0, segment_prefix.size(), segment_prefix) == 0 &&
+        name.compare(name.size() - segment_suffix.size(), string::npos, segment_suffix) == 0)
+      firsts.push_back(std::strtoull(name.c_str() + segment_prefix.size(), nullptr, 10));
+  }
+  ::closedir(d);
+  std::sort(firsts.begin(), firsts.end());
+
+  for (uint64_t first : firsts) {
+    Segment segment {first, 0, 0, 0, segment_path(first)};
+    std::ifstream file {segment.path, std::ios::binary};
+    string in {std::istreambuf_iterator<char> {file}, std::istreambuf_iterator<char> {}};
+
+    std::size_t pos {0};
+    PushJob job {};
+    while (decode_record(in, pos, job)) {
+      segment.jobs++;
+      segment.last_seq = std::max(segment.last_seq, job.seq);
+      next_seq = std::max(next_seq, job.seq + 1);
+      if (job.seq >= cursor && unacked.emplace(job.seq, job.enqueued_micros).second)
+        pending.push_back(job);
+    }
+    next_seq = std::max(next_seq, first);
+
+    // Cut off a torn tail, so nothing is ever appended after it
+    if (pos < in.size() && ::truncate(segment.path.c_str(), static_cast<off_t>(pos)) != 0)
+      return false;
+    segment.bytes = pos;
+
+    if (segment.jobs == 0 || segment.last_seq < cursor)
+      std::remove(segment.path.c_str());
+    else
+      segments.push_back(segment);
+  }
+
+  std::sort(pending.begin(), pending.end(), [] (const PushJob& a, const PushJob& b) { return a.seq < b.seq; });
+  return start_segment();
+}
+
+bool PushQueue::append (PushJob& job) {
+  lock_t lock {mutex};
+  if (fd < 0 || segments.back().bytes >= segment_limit) {
+    if (! start_segment())
+      return false;
+  }
+
+  // A number is never reused, even if the write fails
+  job.seq = next_seq++;
+  string record {encode_record(job)};
+  Segment& active (segments.back());
+  if (! write_all(fd, record) || (sync && ::fdatasync(fd) != 0)) {
+    // Take back any part written; failing that, leave the segment, torn, for recovery to cut
+    if (::ftruncate(fd, static_cast<off_t>(active.bytes)) != 0) {
+      ::close(fd);
+      fd = -1;
+    }
+    return false;
+  }
+
+  active.jobs++;
+  active.last_seq = job.seq;
+  active.bytes += record.size();
+  unacked.emplace(job.seq, job.enqueued_micros);
+  appended_count++;
+  return true;
+}
+
+void PushQueue::ack (uint64_t seq) {
+  lock_t lock {mutex};
+  if (unacked.erase(seq) == 0)
+    return;
+  acked_count++;
+  release_segments();
+}
+
+PushQueueStats PushQueue::stats () const {
+  lock_t lock {mutex};
+  uint64_t bytes {0};
+  for (const Segment& s : segments)
+    bytes += s.bytes;
+  return PushQueueStats {unacked.size(), unacked.empty() ? 0 : unacked.begin()->second,
+                         segments.size(), bytes, appended_count, acked_count};
+}
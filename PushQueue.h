@@ -0,0 +1,125 @@
+#ifndef PushQueue_h
+#define PushQueue_h
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+  A status waiting to be pushed: who posted it, the status itself,
+  and the friends list (in text form) of the recipients it has still
+  to reach. attempts counts the earlier tries that left some
+  recipients unreached. enqueued_micros, in microseconds since the
+  Unix epoch, is when the status was first accepted; retries keep it.
+ */
+struct PushJob {
+  uint64_t seq;
+  uint64_t enqueued_micros;
+  uint32_t attempts;
+  std::string poster_partition;
+  std::string poster_row;
+  std::string status;
+  std::string recipients;
+};
+
+struct PushQueueStats {
+  std::size_t depth;        // Jobs appended and not yet acknowledged
+  uint64_t oldest_micros;   // enqueued_micros of the oldest of them, 0 if none
+  std::size_t segments;
+  uint64_t bytes;           // In all segment files
+  uint64_t appended;
+  uint64_t acked;
+};
+
+/*
+  PushServer's durable queue of push jobs, kept in a local directory
+  so that a job accepted once survives a restart of the server.
+
+  Jobs are appended to the active segment file, segment-<seq>.log,
+  where seq is the sequence number of its first job; once it grows
+  past segment_limit bytes a new one is started. Each job is one
+  record: its length and an FNV-1a checksum, then its fields as
+  varint-prefixed strings. A record torn by a crash fails its
+  checksum and is cut off, with anything after it, when the queue is
+  next opened; it was never acknowledged as appended.
+
+  A job stays in the queue until ack () is called for it, in any
+  order. The sequence number below which every job has been
+  acknowledged is kept in the file cursor, rewritten every so often
+  rather than on every ack, and segments holding only jobs below it
+  are deleted. open () returns every job at or after
+  the cursor, so delivery is at least once: a job acknowledged while
+  an earlier one was still outstanding is returned again.
+
+  With sync set, append () does not return until the record is on
+  disk (fdatasync (), and fsync () of the directory for a new
+  segment); otherwise a crash of the machine, though not
+  of the server, may lose the last jobs appended.
+
+  Thread-safe.
+ */
+class PushQueue {
+private:
+  struct Segment {
+    uint64_t first_seq;
+    uint64_t last_seq;
+    std::size_t jobs;
+    uint64_t bytes;
+    std::string path;
+  };
+
+  mutable std::mutex mutex;
+  std::string dir;
+  uint64_t segment_limit;
+  bool sync;
+  int fd;                                   // The active segment, the last of segments; -1 if none
+  std::deque<Segment> segments;             // Oldest first
+  std::map<uint64_t,uint64_t> unacked;      // Sequence number to enqueued_micros
+  uint64_t next_seq;
+  uint64_t cursor;
+  uint64_t appended_count;
+  uint64_t acked_count;
+  uint64_t acks_since_cursor;
+  std::chrono::steady_clock::time_point cursor_written;
+
+  // These require mutex held
+  std::string segment_path (uint64_t first_seq) const;
+  bool start_segment ();
+  bool write_cursor (uint64_t low);
+  void release_segments ();
+
+public:
+  static constexpr uint64_t default_segment_limit {4 << 20};
+
+  explicit PushQueue (const std::string& dir, uint64_t segment_limit = default_segment_limit, bool sync = true);
+  ~PushQueue ();
+
+  PushQueue (const PushQueue&) = delete;
+  PushQueue& operator= (const PushQueue&) = delete;
+
+  /*
+    Create the directory if need be, recover the jobs left in it, in
+    the order they were appended, into pending, and start a new
+    active segment. Returns false if the directory cannot be used.
+   */
+  bool open (std::vector<PushJob>& pending);
+
+  /*
+    Durably append job, giving it the next sequence number in
+    job.seq. Returns false, with nothing appended, if it could not
+    be written.
+   */
+  bool append (PushJob& job);
+
+  // Acknowledge that the job with sequence number seq has been delivered
+  void ack (uint64_t seq);
+
+  PushQueueStats stats () const;
+};
+
+#endif
@@ -10,10 +10,23 @@
  Push Server code for CMPT 276, Spring 2016.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
 #include <exception>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
@@ -32,6 +45,10 @@
 #include "make_unique.h"
 #include "ServerUtils.h"
 #include "ClientUtils.h"
+#include "FanOut.h"
+#include "FollowerIndex.h"
+#include "PushQueue.h"
+#include "StatusFeed.h"
 
 //#include "azure_keys.h"
 
@@ -101,6 +118,7 @@ const string update_entity {"UpdateEntityAdmin"};
 const string delete_entity {"DeleteEntityAdmin"};
 const string update_property {"UpdatePropertyAdmin"};
 const string add_property {"AddPropertyAdmin"};
+const string append_property {"AppendPropertyAdmin"};
 const string read_entity {"ReadEntityAdmin"};
 const string update_entity_auth{"UpdateEntityAuth"};
 const string read_entity_auth{"ReadEntityAuth"};
@@ -130,6 +148,10 @@ const string updates {"Updates"};
 
 // For PushServer
 const string push_status {"PushStatus"};
+const string enqueue_status {"EnqueueStatus"};
+const string push_metrics {"PushMetrics"};
+const string pause_intake {"PauseIntakeAdmin"};
+const string resume_intake {"ResumeIntakeAdmin"};
 
 /*
 
@@ -138,41 +160,648 @@ const string push_status {"PushStatus"};
 //TableCache table_cache {};
 
 /*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
+  If set (by --feed), statuses are pushed as new entities in
+  FeedTable rather than appended to each friend's Updates
+  (see StatusFeed.h)
+ */
+bool feed_mode {false};
+
+/*
+  In feed mode, a poster with more friends than this (set by
+  --fanout-threshold) has their statuses stored once in their outbox
+  for readers to pull, rather than inserted into every friend's feed
+*/
+std::size_t fanout_threshold {1000};
+
+/*
+  If set (by --followers), a status goes to the poster's followers
+  as recorded in FollowersTable (see FollowerIndex.h), rather than to
+  the friends list sent with the request: the people who would see
+  the poster's status are those who friended the poster.
+ */
+bool followers_mode {false};
 
-  Note that all types of JSON values are returned as strings.
-  Use C++ conversion utilities to convert to numbers or dates
-  as necessary.
+/*
+  If set (by --test-admin), PauseIntakeAdmin and ResumeIntakeAdmin
+  are served, so the tester can make EnqueueStatus refuse statuses as
+  though PushServer were down. They are unauthenticated, so off by
+  default.
  */
-unordered_map<string,string> get_json_body(http_request message) {  
-  unordered_map<string,string> results {};
-  const http_headers& headers {message.headers()};
-  auto content_type (headers.find("Content-Type"));
-  if (content_type == headers.end() ||
-      content_type->second != "application/json")
-    return results;
+bool test_admin {false};
 
-  value json{};
-  message.extract_json(true)
-    .then([&json](value v) -> bool
-          {
-            json = v;
-            return true;
-          })
-    .wait();
-
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-        results[v.first] = v.second.as_string();
+/*
+  Set by PauseIntakeAdmin: EnqueueStatus refuses every status until
+  ResumeIntakeAdmin
+ */
+std::atomic<bool> intake_paused {false};
+
+/*
+  The most friends a single push may be writing to at once (set by
+  --max-in-flight). A push to more friends keeps this many requests
+  in flight, starting the next as each completes.
+ */
+std::size_t max_in_flight {16};
+
+/*
+  Statuses accepted by EnqueueStatus are kept in a PushQueue in
+  queue_dir (set by --queue-dir) until every recipient has them, so
+  none is lost if PushServer stops first. --queue-nosync skips
+  waiting for each to reach the disk, which risks losing the last
+  few if the machine, rather than the server, goes down.
+ */
+string queue_dir {"push-queue"};
+bool queue_sync {true};
+
+/*
+  How many threads deliver queued statuses (set by --push-workers),
+  and the most deliveries each takes at a time
+ */
+std::size_t push_workers {4};
+constexpr std::size_t max_batch_deliveries {256};
+
+/*
+  How long a worker holds its first delivery for more to the same
+  recipients to arrive (set by --coalesce-ms); see push_worker ()
+ */
+std::chrono::milliseconds coalesce_window {10};
+
+/*
+  A queued status is tried at most this many times before its
+  unreached recipients are given up on. The first retry waits
+  retry_backoff, and each later one twice as long as the last.
+ */
+constexpr uint32_t max_push_attempts {6};
+constexpr std::chrono::milliseconds retry_backoff {500};
+
+/*
+  Counts of feed-mode writes, reported by GET PushMetrics.
+  inserts_saved is the number of feed inserts the outbox avoided:
+  for each outboxed status, its poster's friends less the outbox
+  write (and the OutboxAuthors write) that replaced them.
+ */
+std::atomic<uint64_t> statuses_pushed {0};
+std::atomic<uint64_t> feed_inserts {0};
+std::atomic<uint64_t> outbox_statuses {0};
+std::atomic<uint64_t> inserts_saved {0};
+
+/*
+  Fan-out counts, also reported by GET PushMetrics: pushes fanned
+  out, the friends each reached or failed to reach, summed over all
+  pushes, and the total and longest time a fan-out took
+ */
+std::atomic<uint64_t> fan_outs {0};
+std::atomic<uint64_t> recipients_delivered {0};
+std::atomic<uint64_t> recipients_failed {0};
+std::atomic<uint64_t> fan_out_micros {0};
+std::atomic<uint64_t> fan_out_micros_max {0};
+
+/*
+  Queue delivery counts, also reported by GET PushMetrics: batches
+  of deliveries made, the requests they took (one per recipient in a
+  batch, however many statuses it had for them) and the statuses
+  those requests appended, and the queued statuses retried and given
+  up on. coalesced_statuses over delivery_writes is the coalescing
+  ratio, the statuses appended per write.
+ */
+std::atomic<uint64_t> delivery_batches {0};
+std::atomic<uint64_t> delivery_writes {0};
+std::atomic<uint64_t> coalesced_statuses {0};
+std::atomic<uint64_t> pushes_retried {0};
+std::atomic<uint64_t> pushes_abandoned {0};
+
+void record_fan_out(const string& poster_row, const FanOutResult& result)
+{
+  uint64_t micros {static_cast<uint64_t>(result.elapsed.count())};
+  fan_outs++;
+  recipients_delivered += result.succeeded;
+  recipients_failed += result.failed;
+  fan_out_micros += micros;
+  uint64_t longest {fan_out_micros_max.load()};
+  while (micros > longest && !fan_out_micros_max.compare_exchange_weak(longest, micros))
+    ;
+  cout << "Fan-out for " << poster_row << ": " << result.succeeded << " delivered, "
+       << result.failed << " failed in " << micros << " us" << endl;
+}
+
+// Microseconds since the Unix epoch
+uint64_t now_micros()
+{
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+/*
+  Insert or merge an entity into table, creating the table if it
+  does not exist yet. Yields the status of the write.
+ */
+pplx::task<status_code> put_entity(const string& table, const string& partition, const string& row, const value& props_json)
+{
+  string entity_uri {basic_url + update_entity + "/" + table + "/" + partition + "/" + row};
+  return do_request_async(methods::PUT, entity_uri, props_json)
+    .then([table, entity_uri, props_json] (pair<status_code, value> put_result)
+    {
+      if (put_result.first != status_codes::NotFound)
+        return pplx::task_from_result(put_result.first);
+      return do_request_async(methods::POST, basic_url + create_table + "/" + table, value {})
+        .then([entity_uri, props_json] (pair<status_code, value>)
+        {
+          return do_request_async(methods::PUT, entity_uri, props_json);
+        })
+        .then([] (pair<status_code, value> retry_result)
+        {
+          return retry_result.first;
+        });
+    });
+}
+
+/*
+  Insert status, posted by poster_partition/poster_row at micros
+  since the Unix epoch, into the FeedTable feed of every friend in
+  friends_list. Each friend costs one insert and nothing is read;
+  the row keys depend only on the arguments, so inserting the same
+  status again rewrites the same entities. A poster with more than
+  fanout_threshold friends gets a single insert into their outbox
+  instead, which reaches all their friends or none.
+ */
+pplx::task<FanOutResult> insert_into_feeds(const string& poster_partition, const string& poster_row,
+                                           const string& status, friends_list_t friends_list, uint64_t micros)
+{
+  value feed_json {build_json_value(feed_status_prop, status,
+                                    feed_poster_prop, poster_partition + pair_delimiter + poster_row)};
+  statuses_pushed++;
+
+  if (friends_list.size() > fanout_threshold)
+  {
+    std::size_t recipients {friends_list.size()};
+    std::chrono::steady_clock::time_point start {std::chrono::steady_clock::now()};
+    string outbox_row {feed_row(poster_row, micros, poster_partition, poster_row)};
+
+    // List the poster as an outbox author first, so no reader misses the status
+    return put_entity(outbox_authors_table, outbox_authors_partition,
+                      poster_partition + pair_delimiter + poster_row,
+                      build_json_value(outbox_friends_prop, std::to_string(recipients)))
+      .then([poster_partition, outbox_row, feed_json] (status_code author_result)
+      {
+        if (author_result != status_codes::OK)
+          return pplx::task_from_result(status_code {status_codes::ServiceUnavailable});
+        return put_entity(outbox_table, poster_partition, outbox_row, feed_json);
+      })
+      .then([poster_row, recipients, start] (status_code outbox_result)
+      {
+        cout << "Outbox insert result for " << poster_row << ": " << outbox_result << endl;
+        std::chrono::microseconds elapsed {std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)};
+        if (outbox_result != status_codes::OK)
+          return FanOutResult {0, recipients, elapsed};
+        outbox_statuses++;
+        if (recipients > 2)
+          inserts_saved += recipients - 2;
+        return FanOutResult {recipients, 0, elapsed};
+      });
+  }
+
+  std::shared_ptr<const friends_list_t> recipients {std::make_shared<const friends_list_t>(std::move(friends_list))};
+  return bounded_fan_out(recipients->size(), max_in_flight,
+                         [recipients, micros, poster_partition, poster_row, feed_json] (std::size_t i)
+  {
+    const pair<string,string>& f ((*recipients)[i]);
+    feed_inserts++;
+    return put_entity(feed_table, f.first, feed_row(f.second, micros, poster_partition, poster_row), feed_json)
+      .then([recipients, i] (status_code insert_result)
+      {
+        cout << "Feed insert result for " << (*recipients)[i].second << ": " << insert_result << endl;
+        return insert_result == status_codes::OK;
+      });
+  });
+}
+
+/*
+  Append entries, a status or several each ended by a newline, to
+  the Updates of the user in partition/row, keeping it to a bounded
+  ring with older entries paged out to UpdatesArchive (see
+  StatusFeed.h). BasicServer does the whole append next to the data,
+  as one conditional write, so this is a single request and a
+  concurrent push to the same user is never lost. A user with no
+  entity yet gets one. Yields whether the entries were appended.
+ */
+pplx::task<bool> append_to_updates(const string& partition, const string& row, const string& entries)
+{
+  return do_request_async(methods::PUT, basic_url + append_property + "/" + data_table_name + "/" + partition + "/" + row,
+                          build_json_value(updates, entries))
+    .then([row] (pair<status_code, value> append_result)
+    {
+      cout << "Append result for " << row << ": " << append_result.first << endl;
+      return append_result.first == status_codes::OK;
+    });
+}
+
+/*
+  Push status, posted by poster_partition/poster_row, to every friend
+  in friends_list: in feed mode by insert_into_feeds (), otherwise by
+  append_to_updates (). Up to max_in_flight friends are written at
+  once. Yields how many friends were and were not reached, and how
+  long it took; no thread waits for it meanwhile.
+ */
+pplx::task<FanOutResult> push_to_friends(const string& poster_partition, const string& poster_row,
+                                         const string& status, friends_list_t friends_list)
+{
+  if (feed_mode)
+    return insert_into_feeds(poster_partition, poster_row, status, std::move(friends_list), now_micros());
+
+  std::shared_ptr<const friends_list_t> recipients {std::make_shared<const friends_list_t>(std::move(friends_list))};
+  return bounded_fan_out(recipients->size(), max_in_flight, [recipients, status] (std::size_t i)
+  {
+    return append_to_updates((*recipients)[i].first, (*recipients)[i].second, status);
+  });
+}
+
+/*
+  Find the recipients of a status posted by the user in
+  partition/row: their followers in followers mode, otherwise the
+  Friends list of the request body.
+
+  Returns OK with the recipients in recipients. A poster nobody
+  follows has no index entity, and so no recipients. Returns
+  BadRequest if the body's list is malformed, and ServiceUnavailable
+  if the index could not be read, so that the status is refused
+  rather than accepted for nobody.
+ */
+status_code push_recipients(const string& partition, const string& row,
+                            unordered_map<string, string>& properties, friends_list_t& recipients)
+{
+  if (!followers_mode)
+  {
+    try
+    {
+      recipients = parse_friends_list(properties[friends]);
+    }
+    catch (const std::invalid_argument& e)
+    {
+      cout << "Malformed friends list: " << e.what() << endl;
+      return status_codes::BadRequest;
+    }
+    return status_codes::OK;
+  }
+
+  pair<status_code, value> index_result {};
+  try
+  {
+    index_result = do_request(methods::GET, basic_url + read_entity + "/" + followers_table + "/" + partition + "/" + row);
+  }
+  catch (const std::exception& e)
+  {
+    cout << "Reading the followers of " << row << " failed: " << e.what() << endl;
+    return status_codes::ServiceUnavailable;
+  }
+  if (index_result.first == status_codes::NotFound)
+  {
+    cout << "No followers recorded for " << row << endl;
+    recipients.clear();
+    return status_codes::OK;
+  }
+  if (index_result.first != status_codes::OK)
+  {
+    cout << "Reading the followers of " << row << " failed: " << index_result.first << endl;
+    return status_codes::ServiceUnavailable;
+  }
+  unordered_map<string, string> index_props {unpack_json_object(index_result.second)};
+  try
+  {
+    recipients = parse_friends_list(index_props[followers_prop]);
+  }
+  catch (const std::invalid_argument& e)
+  {
+    cout << "Malformed followers list for " << row << ": " << e.what() << endl;
+    return status_codes::InternalError;
+  }
+  return status_codes::OK;
+}
+
+/*
+  A job from push_queue being delivered: the recipients it has to
+  reach, and those it failed to. remaining counts its deliveries
+  not yet finished; the last to finish settles the job.
+ */
+struct QueuedPush {
+  PushJob job;
+  friends_list_t recipients;
+  std::atomic<std::size_t> remaining;
+  std::mutex failed_mutex;
+  friends_list_t failed;
+
+  QueuedPush(PushJob job, friends_list_t recipients) :
+    job {std::move(job)},
+    recipients {std::move(recipients)},
+    remaining {0},
+    failed_mutex {},
+    failed {}
+    {}
+};
+
+/*
+  One delivery to make: the status of push to its recipient number
+  recipient, or in feed mode to all of its recipients, with
+  recipient whole_job. queued is when it was handed to a worker.
+ */
+struct Delivery {
+  std::shared_ptr<QueuedPush> push;
+  std::size_t recipient;
+  std::chrono::steady_clock::time_point queued;
+};
+
+constexpr std::size_t whole_job {static_cast<std::size_t>(-1)};
+
+/*
+  The deliveries waiting for one push_worker. Every delivery to a
+  recipient partition goes to the same shard, so a worker sees all
+  the statuses queued for its recipients, in the order they were
+  queued.
+ */
+struct PushShard {
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Delivery> deliveries;
+  bool closed;
+
+  PushShard() : mutex {}, cv {}, deliveries {}, closed {false} {}
+};
+
+std::unique_ptr<PushQueue> push_queue;
+std::vector<std::unique_ptr<PushShard>> push_shards;
+
+/*
+  Jobs that left recipients unreached, waiting until they are due to
+  be tried again. They are already in push_queue, so any still
+  waiting at shutdown are tried again on the next start.
+ */
+std::mutex retry_mutex;
+std::condition_variable retry_cv;
+std::multimap<std::chrono::steady_clock::time_point, std::shared_ptr<QueuedPush>> retries;
+bool retries_closed {false};
+
+PushShard& shard_for(const string& partition)
+{
+  return *push_shards[std::hash<string> {} (partition) % push_shards.size()];
+}
+
+void deliver(Delivery delivery)
+{
+  PushShard& shard (shard_for(delivery.recipient == whole_job ? delivery.push->job.poster_partition
+                                                              : delivery.push->recipients[delivery.recipient].first));
+  delivery.queued = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock {shard.mutex};
+    shard.deliveries.push_back(std::move(delivery));
+  }
+  shard.cv.notify_one();
+}
+
+void settle_push(const std::shared_ptr<QueuedPush>& push);
+
+/*
+  Hand a job's deliveries to the workers. In feed mode a job is
+  delivered whole, by insert_into_feeds (), on the shard of its
+  poster; otherwise each recipient is a delivery of its own.
+ */
+void dispatch_push(const std::shared_ptr<QueuedPush>& push)
+{
+  if (feed_mode)
+  {
+    push->remaining = 1;
+    deliver(Delivery {push, whole_job});
+    return;
+  }
+  if (push->recipients.empty())
+  {
+    settle_push(push);
+    return;
+  }
+  push->remaining = push->recipients.size();
+  for (std::size_t i {0}; i < push->recipients.size(); i++)
+    deliver(Delivery {push, i});
+}
+
+void finish_delivery(const Delivery& delivery, bool delivered)
+{
+  const std::shared_ptr<QueuedPush>& push (delivery.push);
+  if (!delivered)
+  {
+    std::lock_guard<std::mutex> lock {push->failed_mutex};
+    if (delivery.recipient == whole_job)
+      push->failed = push->recipients;
+    else
+      push->failed.push_back(push->recipients[delivery.recipient]);
+  }
+  if (--push->remaining == 0)
+    settle_push(push);
+}
+
+/*
+  Settle a job once all its deliveries have finished. If any
+  recipient was not reached, a job for just those recipients is
+  queued in its place, to be tried again after a backoff that
+  doubles with each attempt, up to max_push_attempts. The job is
+  acknowledged only once nothing more is owed on it.
+ */
+void settle_push(const std::shared_ptr<QueuedPush>& push)
+{
+  const PushJob& job (push->job);
+  if (push->failed.empty())
+  {
+    push_queue->ack(job.seq);
+    return;
+  }
+
+  if (job.attempts + 1 >= max_push_attempts)
+  {
+    cout << "Giving up pushing " << job.poster_row << "'s status to " << push->failed.size() << " friends" << endl;
+    pushes_abandoned++;
+    push_queue->ack(job.seq);
+    return;
+  }
+
+  PushJob retry_job {job};
+  retry_job.attempts++;
+  retry_job.recipients = friends_list_to_string(push->failed);
+  bool requeued {push_queue->append(retry_job)};
+  if (!requeued)
+  {
+    // Try again under the original job, which stays in the queue meanwhile
+    cout << "Queueing a retry failed; retrying job " << job.seq << " in place" << endl;
+    retry_job.seq = job.seq;
+  }
+  std::shared_ptr<QueuedPush> retry {std::make_shared<QueuedPush>(retry_job, std::move(push->failed))};
+  pushes_retried++;
+  {
+    std::lock_guard<std::mutex> lock {retry_mutex};
+    retries.emplace(std::chrono::steady_clock::now() + retry_backoff * (1 << job.attempts), retry);
+  }
+  retry_cv.notify_one();
+  if (requeued)
+    push_queue->ack(job.seq);
+}
+
+/*
+  Dispatch retries as they fall due, until shutdown
+ */
+void retry_worker()
+{
+  std::unique_lock<std::mutex> lock {retry_mutex};
+  while (!retries_closed)
+  {
+    if (retries.empty())
+    {
+      retry_cv.wait(lock);
+      continue;
+    }
+    if (retry_cv.wait_until(lock, retries.begin()->first) != std::cv_status::timeout)
+      continue;
+    while (!retries.empty() && retries.begin()->first <= std::chrono::steady_clock::now())
+    {
+      std::shared_ptr<QueuedPush> retry {retries.begin()->second};
+      retries.erase(retries.begin());
+      lock.unlock();
+      dispatch_push(retry);
+      lock.lock();
+    }
+  }
+}
+
+/*
+  Make a batch of deliveries taken from one shard.
+
+  In feed mode each is a whole job. Otherwise the deliveries are
+  grouped by recipient partition and, within it, by recipient, and
+  all the statuses the batch holds for one recipient are appended in
+  one request, in the order they were queued. Up to max_in_flight
+  recipients are written at once. Waits until every delivery has
+  finished.
+ */
+void deliver_batch(vector<Delivery>& batch)
+{
+  delivery_batches++;
+  if (feed_mode)
+  {
+    for (const Delivery& d : batch)
+    {
+      const PushJob& job (d.push->job);
+      FanOutResult result {0, 1, std::chrono::microseconds {0}};
+      try
+      {
+        result = insert_into_feeds(job.poster_partition, job.poster_row, job.status,
+                                   d.push->recipients, job.enqueued_micros).get();
       }
-      else {
-        results[v.first] = v.second.serialize();
+      catch (const std::exception& e)
+      {
+        cout << "Pushing queued status failed: " << e.what() << endl;
       }
+      record_fan_out(job.poster_row, result);
+      finish_delivery(d, result.failed == 0);
     }
+    return;
+  }
+
+  // The map orders recipients by partition, then row
+  std::map<pair<string,string>, vector<std::size_t>> by_recipient {};
+  for (std::size_t i {0}; i < batch.size(); i++)
+    by_recipient[batch[i].push->recipients[batch[i].recipient]].push_back(i);
+
+  std::shared_ptr<vector<pair<pair<string,string>, string>>> writes {
+    std::make_shared<vector<pair<pair<string,string>, string>>>()};
+  writes->reserve(by_recipient.size());
+  for (const auto& r : by_recipient)
+  {
+    string entries {};
+    for (std::size_t i : r.second)
+    {
+      entries.append(batch[i].push->job.status);
+      entries.push_back('\n');
+    }
+    writes->push_back(make_pair(r.first, std::move(entries)));
+  }
+
+  std::shared_ptr<vector<char>> written {std::make_shared<vector<char>>(writes->size(), false)};
+  try
+  {
+    bounded_fan_out(writes->size(), max_in_flight, [writes, written] (std::size_t w)
+    {
+      const pair<string,string>& recipient ((*writes)[w].first);
+      return append_to_updates(recipient.first, recipient.second, (*writes)[w].second)
+        .then([written, w] (bool ok)
+        {
+          (*written)[w] = ok;
+          return ok;
+        });
+    }).get();
+  }
+  catch (const std::exception& e)
+  {
+    cout << "Delivering a batch failed: " << e.what() << endl;
+  }
+
+  delivery_writes += writes->size();
+  coalesced_statuses += batch.size();
+  std::size_t w {0};
+  for (const auto& r : by_recipient)
+  {
+    bool ok {(*written)[w++] != 0};
+    for (std::size_t i : r.second)
+    {
+      if (ok)
+        recipients_delivered++;
+      else
+        recipients_failed++;
+      finish_delivery(batch[i], ok);
+    }
+  }
+}
+
+/*
+  Deliver shard's deliveries, up to max_batch_deliveries at a time,
+  until it is closed and empty, so that everything dispatched before
+  shutdown is still delivered.
+
+  A batch is not taken until coalesce_window after its oldest
+  delivery was queued, unless a full batch is waiting sooner or the
+  shard is closing, so that statuses pushed to one recipient in a
+  burst are appended in one write. No delivery waits longer than
+  that for its batch to start.
+ */
+void push_worker(PushShard& shard)
+{
+  std::unique_lock<std::mutex> lock {shard.mutex};
+  while (true)
+  {
+    shard.cv.wait(lock, [&shard] { return shard.closed || !shard.deliveries.empty(); });
+    if (shard.deliveries.empty())
+      return;
+    shard.cv.wait_until(lock, shard.deliveries.front().queued + coalesce_window, [&shard]
+    {
+      return shard.closed || shard.deliveries.size() >= max_batch_deliveries;
+    });
+
+    std::size_t count {std::min(shard.deliveries.size(), max_batch_deliveries)};
+    vector<Delivery> batch {std::make_move_iterator(shard.deliveries.begin()),
+                            std::make_move_iterator(shard.deliveries.begin() + count)};
+    shard.deliveries.erase(shard.deliveries.begin(), shard.deliveries.begin() + count);
+    lock.unlock();
+    deliver_batch(batch);
+    lock.lock();
   }
-  return results;
+}
+
+/*
+  Durably queue a status for the recipients in friends_list, and
+  start delivering it. Returns false if it could not be queued.
+ */
+bool enqueue_push(const string& poster_partition, const string& poster_row, const string& status,
+                  friends_list_t friends_list)
+{
+  PushJob job {0, now_micros(), 0, poster_partition, poster_row, status, friends_list_to_string(friends_list)};
+  if (!push_queue->append(job))
+    return false;
+  dispatch_push(std::make_shared<QueuedPush>(std::move(job), std::move(friends_list)));
+  return true;
 }
 
 /*
@@ -181,6 +810,44 @@ unordered_map<string,string> get_json_body(http_request message) {
 void handle_get(http_request message) { 
   string path {uri::decode(message.relative_uri().path())};
   cout << endl << "**** PushServer GET " << path << endl;
+  auto paths = uri::split_path(path);
+
+  // Report the feed-mode write, fan-out and queue counts. Queue lag is how long the oldest queued status has waited.
+  if(paths.size() == 1 && paths[0] == push_metrics)
+  {
+      PushQueueStats queue {push_queue->stats()};
+      uint64_t now {now_micros()};
+      uint64_t lag {queue.depth == 0 || queue.oldest_micros > now ? 0 : now - queue.oldest_micros};
+      uint64_t writes {delivery_writes.load()};
+      double ratio {writes == 0 ? 0.0 : static_cast<double>(coalesced_statuses.load()) / writes};
+      message.reply(status_codes::OK, value::object(prop_vals_t {
+          make_pair("StatusesPushed", value::number(statuses_pushed.load())),
+          make_pair("FeedInserts", value::number(feed_inserts.load())),
+          make_pair("OutboxStatuses", value::number(outbox_statuses.load())),
+          make_pair("InsertsSaved", value::number(inserts_saved.load())),
+          make_pair("FanOuts", value::number(fan_outs.load())),
+          make_pair("RecipientsDelivered", value::number(recipients_delivered.load())),
+          make_pair("RecipientsFailed", value::number(recipients_failed.load())),
+          make_pair("FanOutMicros", value::number(fan_out_micros.load())),
+          make_pair("FanOutMicrosMax", value::number(fan_out_micros_max.load())),
+          make_pair("MaxInFlight", value::number(static_cast<uint64_t>(max_in_flight))),
+          make_pair("QueueDepth", value::number(static_cast<uint64_t>(queue.depth))),
+          make_pair("QueueLagMicros", value::number(lag)),
+          make_pair("QueueSegments", value::number(static_cast<uint64_t>(queue.segments))),
+          make_pair("QueueBytes", value::number(queue.bytes)),
+          make_pair("QueueAppended", value::number(queue.appended)),
+          make_pair("QueueAcked", value::number(queue.acked)),
+          make_pair("DeliveryBatches", value::number(delivery_batches.load())),
+          make_pair("DeliveryWrites", value::number(writes)),
+          make_pair("CoalescedStatuses", value::number(coalesced_statuses.load())),
+          make_pair("CoalescingRatio", value::number(ratio)),
+          make_pair("CoalesceWindowMillis", value::number(static_cast<int64_t>(coalesce_window.count()))),
+          make_pair("PushesRetried", value::number(pushes_retried.load())),
+          make_pair("PushesAbandoned", value::number(pushes_abandoned.load()))}));
+      return;
+  }
+
+  message.reply(status_codes::BadRequest);
 }
 
 /*
@@ -198,6 +865,14 @@ void handle_post(http_request message) {
   //                                                             //
   /////////////////////////////////////////////////////////////////
 
+  // Stop or start taking queued pushes, for testing what senders do while PushServer is down
+  if(test_admin && paths.size() == 1 && (paths[0] == pause_intake || paths[0] == resume_intake))
+  {
+      intake_paused = paths[0] == pause_intake;
+      message.reply(status_codes::OK);
+      return;
+  }
+
   // Need at least the method, partition, row, and status
   if(paths.size() < 4)
   {
@@ -223,7 +898,13 @@ void handle_post(http_request message) {
       }
 
       cout << "All the friends: " << properties[friends] << endl;
-      vector<pair<string,string>> actual_friends = parse_friends_list(properties[friends]);
+      friends_list_t actual_friends {};
+      status_code recipients_result {push_recipients(partition, row, properties, actual_friends)};
+      if (recipients_result != status_codes::OK)
+      {
+        message.reply(recipients_result);
+        return;
+      }
 
       cout << "Number of friends this user has: " << actual_friends.size() << endl;
 
@@ -232,48 +913,88 @@ void handle_post(http_request message) {
         cout << "Friend " << actual_friends[i].first << ": " << actual_friends[i].second << "\n";
       }
 
-      // Update all the user's "Update" statuses
-      int final_result = 0;
-      for(int i = 0; i < actual_friends.size(); i++)
-      {
-
-        // Get the friend's Update property
-        pair<status_code, value> access_result
+      /*
+        Update all the user's "Update" statuses, replying once every
+        friend has been written to (or failed) rather than waiting
+        here, so the listener thread is free meanwhile. The reply
+        says how many friends were reached and how long it took;
+        it is OK only if every one was.
+       */
+      push_to_friends(partition, row, status, std::move(actual_friends))
+        .then([message, row] (pplx::task<FanOutResult> pushed)
         {
-          do_request (methods::GET, 
-                      basic_url + read_entity + "/" + data_table_name + "/" + actual_friends[i].first + "/" + actual_friends[i].second)
-        };
-        cout << "Access properties result for " << actual_friends[i].second << ": " << access_result.first << endl;
-
-        unordered_map<string, string> user_properties = unpack_json_object(access_result.second);
-
-        // Append the friend's updates with the user's new status
-        string initial_update = user_properties[updates];
-        string new_update = initial_update + status + "\n";
-        value updates_json { build_json_value(updates, new_update) };
-
-        // Put it back in.
-        pair<status_code, value> update_result
+          FanOutResult result {};
+          try
+          {
+            result = pushed.get();
+          }
+          catch (const std::exception& e)
+          {
+            cout << "Pushing a status update failed: " << e.what() << endl;
+            message.reply(status_codes::InternalError);
+            return;
+          }
+          record_fan_out(row, result);
+          value report {value::object(prop_vals_t {
+              make_pair("Delivered", value::number(static_cast<uint64_t>(result.succeeded))),
+              make_pair("Failed", value::number(static_cast<uint64_t>(result.failed))),
+              make_pair("FanOutMicros", value::number(static_cast<uint64_t>(result.elapsed.count())))})};
+          if (result.failed == 0)
+          {
+            cout << "Pushing a status update was successful!\n";
+            message.reply(status_codes::OK, report);
+          }
+          else
+          {
+            cout << "Pushing a status update failed for " << result.failed << " friends\n";
+            message.reply(status_codes::ServiceUnavailable, report);
+          }
+        })
+        .then([] (pplx::task<void> replied)
         {
-          do_request (methods::PUT, 
-                      basic_url + update_entity + "/" + data_table_name + "/" + actual_friends[i].first + "/" + actual_friends[i].second,
-                      updates_json)
-        };
-        cout << "Update result for " << actual_friends[i].second << ": " << update_result.first << endl;
-
-        // For convenience only
-        final_result++;
-      }
+          // Observe any failure to reply, which would otherwise go unreported
+          try
+          {
+            replied.get();
+          }
+          catch (const std::exception& e)
+          {
+            cout << "PushStatus reply failed: " << e.what() << endl;
+          }
+        });
+      return;
+  }
 
-      // After all of these, signing in is finished and successful. Return status code "OK" and the update token
-      if(final_result == actual_friends.size())
+  /*
+    Like PushStatus, but reply Accepted as soon as the push is
+    durably queued, rather than after every friend has been updated,
+    so the poster's wait does not grow with their number of friends.
+    Every friend gets the status at least once, even across a
+    restart of PushServer.
+   */
+  if(paths[0] == enqueue_status)
+  {
+      if (intake_paused)
       {
-          cout << "Pushing a status update was successful!\n";
-          message.reply(status_codes::OK);
-          return;
+        message.reply(status_codes::ServiceUnavailable);
+        return;
       }
-
-      cout << "At the end of PushStatus block. Nothing was done.\n";
+      unordered_map<string, string> properties = get_json_body(message);
+      friends_list_t recipients {};
+      status_code recipients_result {push_recipients(paths[1], paths[2], properties, recipients)};
+      if (recipients_result != status_codes::OK)
+      {
+        message.reply(recipients_result);
+        return;
+      }
+      if (!enqueue_push(paths[1], paths[2], paths[3], std::move(recipients)))
+      {
+        cout << "Queueing a status failed" << endl;
+        message.reply(status_codes::ServiceUnavailable);
+        return;
+      }
+      message.reply(status_codes::Accepted);
+      return;
   }
 
   /////////////////////////////////////////////////////////////////
@@ -316,12 +1037,75 @@ void handle_delete(http_request message) {
   Wait for a carriage return, then shut the server down.
  */
 int main (int argc, char const * argv[]) {
+  for (int i {1}; i < argc; i++) {
+    string arg {argv[i]};
+    if (arg == "--feed")
+      feed_mode = true;
+    else if (arg == "--followers")
+      followers_mode = true;
+    else if (arg == "--fanout-threshold" && i + 1 < argc)
+      fanout_threshold = static_cast<std::size_t>(std::strtoull(argv[++i], nullptr, 10));
+    else if (arg == "--max-in-flight" && i + 1 < argc)
+      max_in_flight = std::max<std::size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+    else if (arg == "--queue-dir" && i + 1 < argc)
+      queue_dir = argv[++i];
+    else if (arg == "--queue-nosync")
+      queue_sync = false;
+    else if (arg == "--push-workers" && i + 1 < argc)
+      push_workers = std::max<std::size_t>(1, std::strtoull(argv[++i], nullptr, 10));
+    else if (arg == "--coalesce-ms" && i + 1 < argc)
+      coalesce_window = std::chrono::milliseconds {std::max<long long>(0, std::strtoll(argv[++i], nullptr, 10))};
+    else if (arg == "--test-admin")
+      test_admin = true;
+    else {
+      cout << "Usage: PushServer [--feed] [--followers] [--fanout-threshold FRIENDS] [--max-in-flight REQUESTS]" << endl
+           << "                  [--queue-dir DIR] [--queue-nosync] [--push-workers THREADS] [--coalesce-ms MS]" << endl
+           << "                  [--test-admin]" << endl;
+      return 1;
+    }
+  }
+  if (test_admin)
+    cout << "PushServer: Serving " << pause_intake << " and " << resume_intake << " for the tester" << endl;
+  if (feed_mode)
+    cout << "PushServer: Pushing statuses to " << feed_table << ", or to " << outbox_table
+         << " for posters with over " << fanout_threshold << " friends" << endl;
+
   cout << "PushServer: Parsing connection string" << endl;
   //table_cache.init (storage_connection_string);
 
+  cout << "PushServer: Opening push queue in " << queue_dir << endl;
+  push_queue = std::make_unique<PushQueue>(queue_dir, PushQueue::default_segment_limit, queue_sync);
+  vector<PushJob> recovered {};
+  if (!push_queue->open(recovered)) {
+    cout << "PushServer: Cannot use push queue directory " << queue_dir << endl;
+    return 1;
+  }
+
+  for (std::size_t i {0}; i < push_workers; i++)
+    push_shards.push_back(std::make_unique<PushShard>());
+  vector<std::thread> worker_threads {};
+  for (std::size_t i {0}; i < push_workers; i++)
+    worker_threads.emplace_back(push_worker, std::ref(*push_shards[i]));
+  std::thread retry_thread {retry_worker};
+
+  // Deliver whatever was queued but not delivered before the last shutdown
+  cout << "PushServer: Resuming " << recovered.size() << " queued statuses" << endl;
+  for (PushJob& job : recovered) {
+    friends_list_t recipients {};
+    try {
+      recipients = parse_friends_list(job.recipients);
+    }
+    catch (const std::exception& e) {
+      cout << "Dropping queued status " << job.seq << ": " << e.what() << endl;
+      push_queue->ack(job.seq);
+      continue;
+    }
+    dispatch_push(std::make_shared<QueuedPush>(std::move(job), std::move(recipients)));
+  }
+
   cout << "PushServer: Opening listener" << endl;
   http_listener listener {push_url};
-  //listener.support(methods::GET, &handle_get);
+  listener.support(methods::GET, &handle_get);
   listener.support(methods::POST, &handle_post);
   //listener.support(methods::PUT, &handle_put);
   //listener.support(methods::DEL, &handle_delete);
@@ -333,5 +1117,22 @@ int main (int argc, char const * argv[]) {
 
   // Shut it down
   listener.close().wait();
+
+  // Retries not yet due stay queued for the next start
+  {
+    std::lock_guard<std::mutex> lock {retry_mutex};
+    retries_closed = true;
+  }
+  retry_cv.notify_one();
+  retry_thread.join();
+  for (auto& shard : push_shards) {
+    {
+      std::lock_guard<std::mutex> lock {shard->mutex};
+      shard->closed = true;
+    }
+    shard->cv.notify_one();
+  }
+  for (std::thread& t : worker_threads)
+    t.join();
   cout << "PushServer closed" << endl;
 }
@@ -10,10 +10,13 @@
 #include <utility>
 #include <vector>
 
+#include <cpprest/json.h>
+
 #include <was/table.h>
 
 using azure::storage::cloud_table;
 using azure::storage::cloud_table_client;
+using azure::storage::edm_type;
 using azure::storage::entity_property;
 using azure::storage::storage_credentials;
 using azure::storage::storage_exception;
@@ -29,11 +32,96 @@ using std::string;
 using std::unordered_map;
 using std::vector;
 
+using web::http::http_headers;
 using web::http::http_request;
+using web::http::http_response;
 using web::http::status_code;
 using web::http::status_codes;
 using web::http::uri;
 
+using web::json::value;
+
+using prop_vals_t = vector<pair<string,value>>;
+
+/*
+  Convert properties represented in Azure Storage type
+  to prop_vals_t type.
+
+  The converted properties are appended to values, which
+  lets callers put Partition/Row keys ahead of them.
+ */
+prop_vals_t get_properties (const table_entity::properties_type& properties, prop_vals_t values) {
+  values.reserve(values.size() + properties.size());
+  for (const auto& v : properties) {
+    if (v.second.property_type() == edm_type::string) {
+      values.push_back(make_pair(v.first, value::string(v.second.string_value())));
+    }
+    else if (v.second.property_type() == edm_type::datetime) {
+      values.push_back(make_pair(v.first, value::string(v.second.str())));
+    }
+    else if(v.second.property_type() == edm_type::int32) {
+      values.push_back(make_pair(v.first, value::number(v.second.int32_value())));      
+    }
+    else if(v.second.property_type() == edm_type::int64) {
+      values.push_back(make_pair(v.first, value::number(v.second.int64_value())));      
+    }
+    else if(v.second.property_type() == edm_type::double_floating_point) {
+      values.push_back(make_pair(v.first, value::number(v.second.double_value())));      
+    }
+    else if(v.second.property_type() == edm_type::boolean) {
+      values.push_back(make_pair(v.first, value::boolean(v.second.boolean_value())));      
+    }
+    else {
+      values.push_back(make_pair(v.first, value::string(v.second.str())));
+    }
+  }
+  return values;
+}
+
+/*
+  Given an HTTP message with a JSON body, return the JSON
+  body as an unordered map of strings to strings.
+
+  If the message has no JSON body, return an empty map.
+
+  THIS ROUTINE CAN ONLY BE CALLED ONCE FOR A GIVEN MESSAGE
+  (see http://microsoft.github.io/cpprestsdk/classweb_1_1http_1_1http__request.html#ae6c3d7532fe943de75dcc0445456cbc7
+  for source of this limit).
+
+  Note that all types of JSON values are returned as strings.
+  Use C++ conversion utilities to convert to numbers or dates
+  as necessary.
+ */
+unordered_map<string,string> get_json_body(http_request message) {  
+  unordered_map<string,string> results {};
+  const http_headers& headers {message.headers()};
+  auto content_type (headers.find("Content-Type"));
+  if (content_type == headers.end() ||
+      content_type->second != "application/json")
+    return results;
+
+  value json{};
+  message.extract_json(true)
+    .then([&json](value v) -> bool
+          {
+            json = v;
+            return true;
+          })
+    .wait();
+
+  if (json.is_object()) {
+    for (const auto& v : json.as_object()) {
+      if (v.second.is_string()) {
+        results[v.first] = v.second.as_string();
+      }
+      else {
+        results[v.first] = v.second.serialize();
+      }
+    }
+  }
+  return results;
+}
+
 /*
   Read from a table using a security token
 
@@ -114,6 +202,23 @@ pair<status_code,table_entity> read_with_token (const http_request& message,
 status_code update_with_token (const http_request& message,
                                const string& endpoint,
                                const unordered_map<string,string>& props) {
+  string new_etag {};
+  return update_with_token(message, endpoint, props, string {}, new_etag);
+}
+
+/*
+  Write to a table using a security token, only if the entity's
+  ETag is if_match (or unconditionally if if_match is empty)
+
+  Returns:  HTTP status code from the write, PreconditionFailed if
+    the entity has changed. On success, new_etag is the entity's
+    ETag after the write.
+ */
+status_code update_with_token (const http_request& message,
+                               const string& endpoint,
+                               const unordered_map<string,string>& props,
+                               const string& if_match,
+                               string& new_etag) {
   
   /*
     Tokens can contain %2F ('/'). Thus we split the URI path
@@ -130,6 +235,8 @@ status_code update_with_token (const http_request& message,
   const string partition {undecoded_paths[3]};
   const string row {undecoded_paths[4]};
   table_entity entity {partition, row};
+  // An empty ETag makes the merge unconditional ("If-Match: *")
+  entity.set_etag(if_match);
   try {
     uri endpoint_uri {endpoint};
     storage_credentials creds {token};
@@ -144,8 +251,10 @@ status_code update_with_token (const http_request& message,
     cloud_table table_cred {client.get_table_reference(tname)};
     table_result update_result {table_cred.execute(op)};
     status_code status {static_cast<status_code> (update_result.http_status_code())};
-    if (status == status_codes::NoContent || status == status_codes::OK)
+    if (status == status_codes::NoContent || status == status_codes::OK) {
+      new_etag = update_result.etag();
       return status_codes::OK;
+    }
     else
       return status;
   }
@@ -155,7 +264,23 @@ status_code update_with_token (const http_request& message,
     cout << e.result().extended_error().message() << endl;
     if (e.result().http_status_code() == status_codes::Forbidden)
       return status_codes::Forbidden;
+    else if (e.result().http_status_code() == status_codes::PreconditionFailed)
+      return status_codes::PreconditionFailed;
     else
       return status_codes::InternalError;
   }
 }
+
+/*
+  Reply with code and, if it is not null, body, adding an ETag
+  header if etag is not empty
+ */
+void reply_with_etag (const http_request& message, status_code code,
+                      const value& body, const string& etag) {
+  http_response response {code};
+  if (! etag.empty())
+    response.headers().add("ETag", etag);
+  if (! body.is_null())
+    response.set_body(body);
+  message.reply(response);
+}
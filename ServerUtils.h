@@ -2,12 +2,23 @@
 #define ServerUtils_h
 
 #include <string>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include <cpprest/http_listener.h>
+#include <cpprest/json.h>
 
 #include <was/table.h>
 
+std::vector<std::pair<std::string,web::json::value>>
+get_properties (const azure::storage::table_entity::properties_type& properties,
+                std::vector<std::pair<std::string,web::json::value>> values =
+                  std::vector<std::pair<std::string,web::json::value>> {});
+
+std::unordered_map<std::string,std::string>
+get_json_body (web::http::http_request message);
+
 std::pair<web::http::status_code,azure::storage::table_entity>
 read_with_token(const web::http::http_request& message,
                 const std::string& endpoint);
@@ -17,4 +28,17 @@ web::http::status_code
 update_with_token (const web::http::http_request& message,
                    const std::string& endpoint,
                    const std::unordered_map<std::string,std::string>& props);
+
+web::http::status_code
+update_with_token (const web::http::http_request& message,
+                   const std::string& endpoint,
+                   const std::unordered_map<std::string,std::string>& props,
+                   const std::string& if_match,
+                   std::string& new_etag);
+
+void
+reply_with_etag (const web::http::http_request& message,
+                 web::http::status_code code,
+                 const web::json::value& body,
+                 const std::string& etag);
 #endif
@@ -0,0 +1,257 @@
+#include "SessionStore.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <pplx/pplxtasks.h>
+
+#include "make_unique.h"
+
+using pplx::extensibility::scoped_critical_section_t;
+
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::vector;
+
+/*
+  shard_count is rounded up to a power of two so a shard can be
+  chosen by masking the hash.
+ */
+SessionStore::SessionStore (unsigned int shard_count) :
+  shards {},
+  shard_mask {0}
+{
+  std::size_t n {1};
+  while (n < shard_count)
+    n <<= 1;
+  shard_mask = n - 1;
+  uint64_t now {static_cast<uint64_t>(unix_now())};
+  for (std::size_t i {0}; i < n; i++)
+    shards.push_back(std::make_unique<Shard>(now));
+}
+
+int64_t SessionStore::unix_now () {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool SessionStore::insert (const string& userid, const Session& session) {
+  Shard& shard (shard_for(userid));
+  scoped_critical_section_t lock {shard.lock};
+  auto entry (shard.sessions.find(userid));
+  if (entry != shard.sessions.end()) {
+    if (! entry->second.session.expired(unix_now()))
+      return false;
+    shard.wheel.cancel(entry->second.timer);
+    shard.sessions.erase(entry);
+  }
+
+  TimingWheel::handle_t timer {TimingWheel::no_handle};
+  if (session.expiry() != 0)
+    timer = shard.wheel.schedule(userid, static_cast<uint64_t>(session.expiry()));
+  shard.sessions.insert({userid, Entry {session, timer}});
+  return true;
+}
+
+bool SessionStore::lookup (const string& userid, Session& session) const {
+  Shard& shard (shard_for(userid));
+  scoped_critical_section_t lock {shard.lock};
+  auto entry (shard.sessions.find(userid));
+  // An expired session is left for expire () to evict
+  if (entry == shard.sessions.end() || entry->second.session.expired(unix_now()))
+    return false;
+  session = entry->second.session;
+  return true;
+}
+
+bool SessionStore::set_entity (const string& userid, std::shared_ptr<const UserEntity> entity) {
+  Shard& shard (shard_for(userid));
+  scoped_critical_section_t lock {shard.lock};
+  auto entry (shard.sessions.find(userid));
+  if (entry == shard.sessions.end())
+    return false;
+  entry->second.session.set_entity(std::move(entity));
+  return true;
+}
+
+bool SessionStore::erase (const string& userid) {
+  Shard& shard (shard_for(userid));
+  scoped_critical_section_t lock {shard.lock};
+  auto entry (shard.sessions.find(userid));
+  if (entry == shard.sessions.end())
+    return false;
+  shard.wheel.cancel(entry->second.timer);
+  shard.sessions.erase(entry);
+  return true;
+}
+
+std::size_t SessionStore::size () const {
+  std::size_t total {0};
+  for (const auto& shard : shards) {
+    scoped_critical_section_t lock {shard->lock};
+    total += shard->sessions.size();
+  }
+  return total;
+}
+
+void SessionStore::for_each (const std::function<void(const string&, const Session&)>& fn) const {
+  for (const auto& shard : shards) {
+    scoped_critical_section_t lock {shard->lock};
+    for (const auto& entry : shard->sessions)
+      fn(entry.first, entry.second.session);
+  }
+}
+
+std::size_t SessionStore::expire (int64_t now) {
+  std::size_t evicted {0};
+  for (const auto& shard : shards) {
+    scoped_critical_section_t lock {shard->lock};
+    std::unordered_map<string,Entry>& sessions (shard->sessions);
+    shard->wheel.advance(static_cast<uint64_t>(now),
+                         [&sessions, &evicted] (const string& userid, TimingWheel::handle_t timer) {
+                           // Only the timer of the current session may evict it
+                           auto entry (sessions.find(userid));
+                           if (entry != sessions.end() && entry->second.timer == timer) {
+                             sessions.erase(entry);
+                             evicted++;
+                           }
+                         });
+  }
+  return evicted;
+}
+
+/*
+  Session file format: the magic bytes "USS", a version byte, then
+  for each session its userid, token, partition and row (each a
+  varint length followed by the bytes) and its expiry as a varint.
+ */
+static const string session_file_magic {"USS"};
+constexpr char session_file_version {1};
+
+static void put_varint (string& out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+  out.push_back(static_cast<char>(v));
+}
+
+static void put_string (string& out, const string& s) {
+  put_varint(out, s.size());
+  out.append(s);
+}
+
+static bool get_varint (const string& in, std::size_t& pos, uint64_t& v) {
+  v = 0;
+  for (int shift {0}; shift < 64; shift += 7) {
+    if (pos >= in.size())
+      return false;
+    unsigned char byte {static_cast<unsigned char>(in[pos++])};
+    v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+static bool get_string (const string& in, std::size_t& pos, string& s) {
+  uint64_t len {0};
+  if (! get_varint(in, pos, len) || len > in.size() - pos)
+    return false;
+  s.assign(in, pos, len);
+  pos += len;
+  return true;
+}
+
+// Write all of data to fd
+static bool write_all (int fd, const string& data) {
+  std::size_t done {0};
+  while (done < data.size()) {
+    ssize_t n {::write(fd, data.data() + done, data.size() - done)};
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    done += static_cast<std::size_t>(n);
+  }
+  return true;
+}
+
+bool SessionStore::save (const string& path, int64_t now) const {
+  string out {session_file_magic};
+  out.push_back(session_file_version);
+  for_each([&out, now] (const string& userid, const Session& session) {
+      if (session.expired(now))
+        return;
+      put_string(out, userid);
+      put_string(out, session.token());
+      put_string(out, session.partition());
+      put_string(out, session.row());
+      put_varint(out, static_cast<uint64_t>(session.expiry()));
+    });
+
+  // Write a temporary file and rename it over the old one, so a crash
+  // mid-write never leaves a truncated checkpoint behind. The tokens in
+  // it are live credentials, so only the owner may read it; a temporary
+  // file left by an older run is made private before it is reused.
+  string tmp_path {path + ".tmp"};
+  int fd {::open(tmp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600)};
+  if (fd < 0)
+    return false;
+  bool written {::fchmod(fd, 0600) == 0 && write_all(fd, out) && ::fsync(fd) == 0};
+  written = ::close(fd) == 0 && written;
+  if (! written || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::size_t SessionStore::load (const string& path, int64_t now) {
+  std::ifstream file {path, std::ios::binary};
+  if (! file)
+    return 0;
+  string in {std::istreambuf_iterator<char> {file}, std::istreambuf_iterator<char> {}};
+  if (in.compare(0, session_file_magic.size(), session_file_magic) != 0 ||
+      in.size() <= session_file_magic.size() ||
+      in[session_file_magic.size()] != session_file_version)
+    return 0;
+
+  // Parse the whole file before adding anything, so a damaged file adds nothing
+  vector<pair<string,Session>> sessions {};
+  std::size_t pos {session_file_magic.size() + 1};
+  while (pos < in.size()) {
+    string userid {};
+    string token {};
+    string partition {};
+    string row {};
+    uint64_t expiry {0};
+    if (! (get_string(in, pos, userid) && get_string(in, pos, token) &&
+           get_string(in, pos, partition) && get_string(in, pos, row) &&
+           get_varint(in, pos, expiry)))
+      return 0;
+    sessions.push_back(make_pair(userid, Session {token, partition, row, static_cast<int64_t>(expiry)}));
+  }
+
+  std::size_t loaded {0};
+  for (const auto& s : sessions) {
+    if (! s.second.expired(now) && insert(s.first, s.second))
+      loaded++;
+  }
+  return loaded;
+}
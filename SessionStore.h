@@ -0,0 +1,164 @@
+#ifndef SessionStore_h
+#define SessionStore_h
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <pplx/pplxtasks.h>
+
+#include "TimingWheel.h"
+
+/*
+  UserServer's copy of a user's DataTable entity, as of etag.
+  archived_pages is the UpdatesArchived count (see StatusFeed.h).
+
+  Copies are shared between sessions and handlers and never
+  modified; a changed entity is cached as a new UserEntity.
+ */
+struct UserEntity {
+  std::string friends;
+  std::string status;
+  std::string updates;
+  uint64_t archived_pages;
+  std::string etag;
+};
+
+/*
+  The data UserServer keeps for a signed-on user.
+
+  The token, data partition and data row are packed into a single
+  string with their lengths alongside, so a session costs one heap
+  allocation instead of three.
+
+  expiry is when the session's token stops working, in seconds
+  since the Unix epoch; 0 means the session never expires.
+
+  entity is the user's cached data entity, or null if it has not
+  been read yet. Copying a session shares the entity.
+ */
+class Session {
+private:
+  std::string packed;
+  uint32_t token_len;
+  uint32_t partition_len;
+  int64_t expiry_time;
+  std::shared_ptr<const UserEntity> cached_entity;
+
+public:
+  Session () :
+    packed {},
+    token_len {0},
+    partition_len {0},
+    expiry_time {0},
+    cached_entity {}
+    {};
+
+  Session (const std::string& token, const std::string& partition, const std::string& row,
+           int64_t expiry = 0) :
+    packed {token + partition + row},
+    token_len {static_cast<uint32_t>(token.size())},
+    partition_len {static_cast<uint32_t>(partition.size())},
+    expiry_time {expiry},
+    cached_entity {}
+    {};
+
+  std::string token () const { return packed.substr(0, token_len); }
+  std::string partition () const { return packed.substr(token_len, partition_len); }
+  std::string row () const { return packed.substr(token_len + partition_len); }
+  int64_t expiry () const { return expiry_time; }
+  bool expired (int64_t now) const { return expiry_time != 0 && now >= expiry_time; }
+  const std::shared_ptr<const UserEntity>& entity () const { return cached_entity; }
+  void set_entity (std::shared_ptr<const UserEntity> entity) { cached_entity = std::move(entity); }
+};
+
+/*
+  Thread-safe map from userid to Session.
+
+  The listener runs handlers on a thread pool, so sessions are
+  split across a power-of-two number of shards by hash of the userid,
+  each with its own lock. Operations on different users rarely
+  contend, and no operation holds more than one shard lock.
+
+  Each shard also has a TimingWheel holding the expiry of its
+  sessions, so expire () evicts sessions whose tokens have lapsed
+  in time proportional to the number evicted, however many sessions
+  there are. Lookups also check expiry, so a session is never used
+  after its token lapses even if expire () has not yet run.
+
+  save () and load () checkpoint the sessions to a local file so
+  that a restarted UserServer need not sign every user on again.
+ */
+class SessionStore {
+private:
+  struct Entry {
+    Session session;
+    TimingWheel::handle_t timer;
+  };
+
+  struct Shard {
+    pplx::extensibility::critical_section_t lock;
+    std::unordered_map<std::string,Entry> sessions;
+    TimingWheel wheel;
+
+    explicit Shard (uint64_t start_tick) :
+      lock {},
+      sessions {},
+      wheel {start_tick}
+      {};
+  };
+
+  std::vector<std::unique_ptr<Shard>> shards;
+  std::size_t shard_mask;
+
+  Shard& shard_for (const std::string& userid) const {
+    return *shards[std::hash<std::string> {} (userid) & shard_mask];
+  }
+
+public:
+  explicit SessionStore (unsigned int shard_count = 64);
+
+  // Add a session unless userid already has an unexpired one. Returns true if added.
+  bool insert (const std::string& userid, const Session& session);
+
+  // Copy userid's session into session. Returns false if there is none or it has expired.
+  bool lookup (const std::string& userid, Session& session) const;
+
+  // Replace the cached entity of userid's session. Returns false if there is no session.
+  bool set_entity (const std::string& userid, std::shared_ptr<const UserEntity> entity);
+
+  // Remove userid's session. Returns false if there was none.
+  bool erase (const std::string& userid);
+
+  std::size_t size () const;
+
+  // Call fn on every session, one shard at a time
+  void for_each (const std::function<void(const std::string&, const Session&)>& fn) const;
+
+  // Evict every session whose expiry is at or before now. Returns the number evicted.
+  std::size_t expire (int64_t now);
+
+  /*
+    Write every session unexpired at now to path, replacing any
+    previous file only once the new one is complete and on disk.
+    The file holds each session's SAS token, so it is created
+    readable by its owner only (mode 0600) and must be kept that
+    way. Returns false if the file could not be written.
+   */
+  bool save (const std::string& path, int64_t now) const;
+
+  /*
+    Add the sessions saved in path that are unexpired at now.
+    Returns the number added; 0 if the file is missing or malformed.
+   */
+  std::size_t load (const std::string& path, int64_t now);
+
+  // The current time in seconds since the Unix epoch, the unit of Session::expiry ()
+  static int64_t unix_now ();
+};
+
+#endif
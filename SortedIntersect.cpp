@@ -0,0 +1,118 @@
+#include "SortedIntersect.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Gallop rather than merge once the larger set is this many times the smaller
+constexpr std::size_t gallop_ratio {32};
+
+std::size_t intersect_sorted_scalar (const uint32_t* a, std::size_t na, const uint32_t* b, std::size_t nb, uint32_t* out) {
+  std::size_t i {0};
+  std::size_t j {0};
+  std::size_t n {0};
+  while (i < na && j < nb) {
+    if (a[i] < b[j])
+      i++;
+    else if (b[j] < a[i])
+      j++;
+    else {
+      out[n++] = a[i];
+      i++;
+      j++;
+    }
+  }
+  return n;
+}
+
+/*
+  Find each element of small in large, starting each search where the
+  last one ended: step forward 1, 2, 4 ... elements until past it,
+  then binary search the last step
+ */
+static std::size_t intersect_gallop (const uint32_t* small, std::size_t ns, const uint32_t* large, std::size_t nl, uint32_t* out) {
+  std::size_t n {0};
+  std::size_t lo {0};
+  for (std::size_t i {0}; i < ns && lo < nl; i++) {
+    uint32_t x {small[i]};
+    std::size_t step {1};
+    std::size_t hi {lo};
+    while (hi < nl && large[hi] < x) {
+      lo = hi + 1;
+      hi += step;
+      step *= 2;
+    }
+    hi = std::min(hi + 1, nl);
+    lo = static_cast<std::size_t>(std::lower_bound(large + lo, large + hi, x) - large);
+    if (lo < nl && large[lo] == x)
+      out[n++] = x;
+  }
+  return n;
+}
+
+#ifdef __SSE2__
+static std::size_t intersect_sse2 (const uint32_t* a, std::size_t na, const uint32_t* b, std::size_t nb, uint32_t* out) {
+  std::size_t i {0};
+  std::size_t j {0};
+  std::size_t n {0};
+  std::size_t na4 {na & ~std::size_t {3}};
+  std::size_t nb4 {nb & ~std::size_t {3}};
+  std::size_t room {std::min(na, nb)};
+  while (i < na4 && j < nb4) {
+    __m128i va {_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i))};
+    __m128i vb {_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + j))};
+
+    // Lane k of the result is set if a[i + k] equals any of b[j .. j + 3]
+    __m128i eq {_mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                     _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1)))),
+        _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(1, 0, 3, 2))),
+                     _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, _MM_SHUFFLE(2, 1, 0, 3)))))};
+    unsigned mask {static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(eq)))};
+
+    // Store all four and keep only the matches, so there is no branch on the data, while out has room
+    if (n + 4 <= room) {
+      for (unsigned k {0}; k < 4; k++) {
+        out[n] = a[i + k];
+        n += (mask >> k) & 1;
+      }
+    }
+    else {
+      for (unsigned k {0}; mask != 0; k++, mask >>= 1)
+        if (mask & 1)
+          out[n++] = a[i + k];
+    }
+
+    // Move past whichever block ends first, or both if they end together
+    uint32_t a_last {a[i + 3]};
+    uint32_t b_last {b[j + 3]};
+    if (a_last <= b_last)
+      i += 4;
+    if (b_last <= a_last)
+      j += 4;
+  }
+  // Any element matched above is at most the last of a block already passed, so the tails cannot match it again
+  return n + intersect_sorted_scalar(a + i, na - i, b + j, nb - j, out + n);
+}
+#endif
+
+std::size_t intersect_sorted (const uint32_t* a, std::size_t na, const uint32_t* b, std::size_t nb, uint32_t* out) {
+  if (na > nb) {
+    std::swap(a, b);
+    std::swap(na, nb);
+  }
+  if (na == 0)
+    return 0;
+  if (nb / na >= gallop_ratio)
+    return intersect_gallop(a, na, b, nb, out);
+#ifdef __SSE2__
+  return intersect_sse2(a, na, b, nb, out);
+#else
+  return intersect_sorted_scalar(a, na, b, nb, out);
+#endif
+}
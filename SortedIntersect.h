@@ -0,0 +1,30 @@
+#ifndef SortedIntersect_h
+#define SortedIntersect_h
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+  Intersection of sorted sets of uint32_t, as FriendGraph rows are:
+  ascending and without duplicates.
+
+  Sets of similar size are merged four elements at a time with SSE2
+  where the compiler targets it (every x86-64 build), comparing a
+  block of each set against all rotations of the other in four
+  vector compares; otherwise, and for the tails, one element at a
+  time. When one set is far smaller than the other, each of its
+  elements is instead found in the larger by galloping search, so
+  the cost follows the smaller set.
+ */
+
+/*
+  Write the elements of a (na long) that are also in b (nb long) to
+  out, in ascending order, and return how many there are. out must
+  have room for the smaller of na and nb.
+ */
+std::size_t intersect_sorted (const uint32_t* a, std::size_t na, const uint32_t* b, std::size_t nb, uint32_t* out);
+
+// The one-at-a-time merge, for comparison and for builds without SSE2
+std::size_t intersect_sorted_scalar (const uint32_t* a, std::size_t na, const uint32_t* b, std::size_t nb, uint32_t* out);
+
+#endif
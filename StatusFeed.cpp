@@ -0,0 +1,117 @@
+#include "StatusFeed.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+const string updates_archive_table {"UpdatesArchive"};
+const string updates_archived_prop {"UpdatesArchived"};
+const string feed_table {"FeedTable"};
+const string feed_status_prop {"Status"};
+const string feed_poster_prop {"Poster"};
+const string outbox_table {"OutboxTable"};
+const string outbox_authors_table {"OutboxAuthors"};
+const string outbox_authors_partition {"Authors"};
+const string outbox_friends_prop {"Friends"};
+
+constexpr char entry_end {'\n'};
+
+// Row keys sort as strings, so page numbers are zero-padded to keep them in page order
+constexpr std::size_t page_digits {10};
+
+// Feed rows sort newest first by counting down from here; 19 digits cover any uint64_t below it
+constexpr uint64_t feed_time_max {9999999999999999999ULL};
+constexpr std::size_t feed_time_digits {19};
+
+static string zero_pad (uint64_t n, std::size_t digits) {
+  string number {std::to_string(n)};
+  if (number.size() < digits)
+    number.insert(0, digits - number.size(), '0');
+  return number;
+}
+
+FeedAppend append_status (const string& updates, const string& status) {
+  FeedAppend result {updates, {}};
+  result.updates.append(status);
+  result.updates.push_back(entry_end);
+
+  std::size_t entries {0};
+  for (char c : result.updates)
+    if (c == entry_end)
+      entries++;
+
+  // Cut whole pages off the front until the ring is back within bounds
+  std::size_t start {0};
+  while (entries > feed_ring_entries) {
+    std::size_t end {start};
+    for (std::size_t n {0}; n < feed_page_entries; n++)
+      end = result.updates.find(entry_end, end) + 1;
+    result.pages.push_back(result.updates.substr(start, end - start));
+    start = end;
+    entries -= feed_page_entries;
+  }
+  if (start > 0)
+    result.updates.erase(0, start);
+  return result;
+}
+
+vector<string> split_entries (const string& updates) {
+  vector<string> entries {};
+  std::size_t start {0};
+  while (start < updates.size()) {
+    std::size_t end {updates.find(entry_end, start)};
+    if (end == string::npos)
+      end = updates.size();
+    entries.push_back(updates.substr(start, end - start));
+    start = end + 1;
+  }
+  return entries;
+}
+
+string archive_row (const string& data_row, uint64_t page) {
+  return data_row + ";" + zero_pad(page, page_digits);
+}
+
+uint64_t parse_archived (const string& archived) {
+  uint64_t pages {0};
+  for (char c : archived) {
+    if (c < '0' || c > '9')
+      return 0;
+    pages = pages * 10 + static_cast<uint64_t>(c - '0');
+  }
+  return pages;
+}
+
+string feed_row_prefix (const string& data_row) {
+  return data_row + ";";
+}
+
+string feed_row (const string& data_row, uint64_t micros,
+                 const string& poster_partition, const string& poster_row) {
+  uint64_t reverse {micros < feed_time_max ? feed_time_max - micros : 0};
+  return feed_row_prefix(data_row) + zero_pad(reverse, feed_time_digits) + ";" +
+    poster_partition + ";" + poster_row;
+}
+
+string feed_key (const string& row, const string& data_row) {
+  string prefix {feed_row_prefix(data_row)};
+  if (row.compare(0, prefix.size(), prefix) != 0)
+    return row;
+  return row.substr(prefix.size());
+}
+
+uint64_t feed_key_micros (const string& key) {
+  if (key.size() < feed_time_digits)
+    return 0;
+  uint64_t reverse {0};
+  for (std::size_t i {0}; i < feed_time_digits; i++) {
+    if (key[i] < '0' || key[i] > '9')
+      return 0;
+    reverse = reverse * 10 + static_cast<uint64_t>(key[i] - '0');
+  }
+  return feed_time_max - reverse;
+}
@@ -0,0 +1,99 @@
+#ifndef StatusFeed_h
+#define StatusFeed_h
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+  A user's status feed: the statuses pushed to them, oldest first,
+  each followed by a newline.
+
+  Only the newest entries are kept in the Updates property of the
+  user's DataTable entity, so that appending a status costs the same
+  however long the feed has grown, and the entity stays well under
+  the storage property size limit. When the ring in Updates grows
+  past feed_ring_entries, its oldest feed_page_entries entries are
+  moved as one page to the UpdatesArchive table, in the user's data
+  partition, under archive_row (). The number of pages moved so far
+  is kept in the entity's UpdatesArchived property.
+
+  Pages are always full and are numbered from 0, oldest first, so
+  the entry at position i of the whole feed (counting from 0 at the
+  oldest) is entry i % feed_page_entries of page i / feed_page_entries
+  if it has been archived, and otherwise entry
+  i - archived * feed_page_entries of the ring. Positions never
+  change as the feed grows, which makes them usable as read cursors.
+ */
+constexpr std::size_t feed_ring_entries {100};
+constexpr std::size_t feed_page_entries {50};
+
+extern const std::string updates_archive_table;
+extern const std::string updates_archived_prop;
+
+struct FeedAppend {
+  std::string updates;             // The new ring
+  std::vector<std::string> pages;  // Full pages to archive, oldest first, in Updates form
+};
+
+// Append status to the ring updates, spilling full pages if it grows past feed_ring_entries
+FeedAppend append_status (const std::string& updates, const std::string& status);
+
+// The entries of updates or of an archived page, oldest first
+std::vector<std::string> split_entries (const std::string& updates);
+
+// The row key of page number page of the feed of the user in data_row
+std::string archive_row (const std::string& data_row, uint64_t page);
+
+// Parse an UpdatesArchived value; missing or malformed counts as 0
+uint64_t parse_archived (const std::string& archived);
+
+/*
+  The alternative to Updates used by PushServer --feed: every status
+  delivered to a user is its own small entity in FeedTable, so
+  pushing a status is a single insert with no read of what the user
+  already has.
+
+  A user's feed entities are in their data partition, with row keys
+  feed_row_prefix (their data row) followed by a reverse timestamp,
+  so a prefix scan of the partition reads the feed newest first.
+  The poster is part of the row key so that statuses posted by
+  different users in the same microsecond do not collide.
+ */
+extern const std::string feed_table;
+extern const std::string feed_status_prop;
+extern const std::string feed_poster_prop;
+
+// The row key prefix shared by every feed entity of the user in data_row
+std::string feed_row_prefix (const std::string& data_row);
+
+// The row key of a status posted by poster_partition/poster_row at micros since the Unix epoch
+std::string feed_row (const std::string& data_row, uint64_t micros,
+                      const std::string& poster_partition, const std::string& poster_row);
+
+/*
+  A poster with more than PushServer's fan-out threshold of friends
+  is not pushed to each friend's feed. Their status is stored once,
+  in their own partition of OutboxTable under the same row key
+  feed_row () would give it in their own feed, and readers merge it
+  into their feed when they read it. Such posters are listed in
+  OutboxAuthors, partition outbox_authors_partition, with row
+  "<data partition>;<data row>" as in a friends list.
+
+  Feed and outbox rows share their form after the prefix, so that
+  suffix (the feed key) orders statuses from every source alike,
+  newest first, and one key serves as a cursor into all of them.
+ */
+extern const std::string outbox_table;
+extern const std::string outbox_authors_table;
+extern const std::string outbox_authors_partition;
+extern const std::string outbox_friends_prop;
+
+// The part of a feed or outbox row key after feed_row_prefix (data_row)
+std::string feed_key (const std::string& row, const std::string& data_row);
+
+// When the status with feed key key was posted, in microseconds since the Unix epoch; 0 if malformed
+uint64_t feed_key_micros (const std::string& key);
+
+#endif
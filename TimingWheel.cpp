@@ -0,0 +1,153 @@
+#include "TimingWheel.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+using std::string;
+
+constexpr TimingWheel::handle_t TimingWheel::no_handle;
+constexpr uint32_t TimingWheel::slots;
+constexpr uint32_t TimingWheel::nil;
+
+/*
+  Handles pack the pool index with its generation, which is bumped
+  every time the pool entry is reused, so a stale handle is never
+  mistaken for the timer that now occupies its entry. Generations
+  start at 1 so that no valid handle equals no_handle.
+ */
+static TimingWheel::handle_t make_handle (uint32_t index, uint32_t generation) {
+  return (static_cast<uint64_t>(generation) << 32) | index;
+}
+
+TimingWheel::TimingWheel (uint64_t start_tick) :
+  timers {},
+  heads (levels * slots, nil),
+  free_list {nil},
+  now_tick {start_tick},
+  live {0}
+  {}
+
+/*
+  Put a timer in the slot for its due tick. The level is the lowest
+  one whose window (all bits above the level's slot bits) contains
+  both now_tick and due.
+ */
+void TimingWheel::link (uint32_t index) {
+  Timer& t (timers[index]);
+  int level {0};
+  while (level < levels - 1 &&
+         (t.due >> (slot_bits * (level + 1))) != (now_tick >> (slot_bits * (level + 1))))
+    level++;
+  uint32_t slot {level * slots + static_cast<uint32_t>((t.due >> (slot_bits * level)) & (slots - 1))};
+
+  t.slot = slot;
+  t.prev = nil;
+  t.next = heads[slot];
+  if (t.next != nil)
+    timers[t.next].prev = index;
+  heads[slot] = index;
+}
+
+void TimingWheel::unlink (uint32_t index) {
+  Timer& t (timers[index]);
+  if (t.prev != nil)
+    timers[t.prev].next = t.next;
+  else
+    heads[t.slot] = t.next;
+  if (t.next != nil)
+    timers[t.next].prev = t.prev;
+}
+
+/*
+  Re-file every timer in the current slot of level, now that
+  now_tick has entered that slot's window
+ */
+void TimingWheel::cascade (int level) {
+  uint32_t slot {level * slots + static_cast<uint32_t>((now_tick >> (slot_bits * level)) & (slots - 1))};
+  uint32_t index {heads[slot]};
+  heads[slot] = nil;
+  while (index != nil) {
+    uint32_t next {timers[index].next};
+    link(index);
+    index = next;
+  }
+}
+
+TimingWheel::handle_t TimingWheel::schedule (const string& key, uint64_t due) {
+  uint32_t index {free_list};
+  if (index != nil) {
+    free_list = timers[index].next;
+  }
+  else {
+    index = static_cast<uint32_t>(timers.size());
+    timers.push_back(Timer {string {}, 0, nil, nil, 0, nil});
+  }
+
+  Timer& t (timers[index]);
+  t.key = key;
+  t.due = due > now_tick ? due : now_tick + 1;
+  t.generation++;
+  if (t.generation == 0)
+    t.generation = 1;
+  link(index);
+  live++;
+  return make_handle(index, t.generation);
+}
+
+bool TimingWheel::cancel (handle_t handle) {
+  uint32_t index {static_cast<uint32_t>(handle & 0xffffffffu)};
+  uint32_t generation {static_cast<uint32_t>(handle >> 32)};
+  if (index >= timers.size() || timers[index].generation != generation || timers[index].slot == nil)
+    return false;
+
+  unlink(index);
+  Timer& t (timers[index]);
+  t.slot = nil;
+  t.key.clear();
+  t.next = free_list;
+  free_list = index;
+  live--;
+  return true;
+}
+
+std::size_t TimingWheel::advance (uint64_t tick,
+                                  const std::function<void(const string&, handle_t)>& fire) {
+  std::size_t fired {0};
+  while (now_tick < tick) {
+    // Nothing pending: jump straight to the target tick
+    if (live == 0) {
+      now_tick = tick;
+      break;
+    }
+    now_tick++;
+
+    // Cascade from the highest level whose window just began, so
+    // that timers land in lower slots before those are cascaded
+    int top {0};
+    while (top < levels - 1 && (now_tick & ((uint64_t {1} << (slot_bits * (top + 1))) - 1)) == 0)
+      top++;
+    for (int level {top}; level >= 1; level--)
+      cascade(level);
+
+    uint32_t slot {static_cast<uint32_t>(now_tick & (slots - 1))};
+    uint32_t index {heads[slot]};
+    heads[slot] = nil;
+    while (index != nil) {
+      Timer& t (timers[index]);
+      uint32_t next {t.next};
+      string key {std::move(t.key)};
+      handle_t handle {make_handle(index, t.generation)};
+      t.key.clear();
+      t.slot = nil;
+      t.next = free_list;
+      free_list = index;
+      live--;
+      fire(key, handle);
+      fired++;
+      index = next;
+    }
+  }
+  return fired;
+}
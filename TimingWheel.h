@@ -0,0 +1,79 @@
+#ifndef TimingWheel_h
+#define TimingWheel_h
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+/*
+  Hierarchical timing wheel of string keys, with one-second ticks.
+
+  Timers are kept in six levels of 64 slots. Level 0 holds timers
+  due within the current 64-tick window, one slot per tick; each
+  higher level covers a 64 times longer window. As time advances past
+  a window boundary, the matching slot of the next level up is
+  cascaded into the lower levels, so each timer is moved at most
+  once per level over its lifetime.
+
+  schedule () and cancel () are O(1) and timers live in a single
+  pooled vector, so memory is proportional to the number of live
+  timers and independent of how far in the future they are due.
+
+  Ticks are absolute (seconds since the Unix epoch for UserServer);
+  six levels of 64 slots span 2^36 ticks, so every realistic
+  expiry time fits without wrapping.
+
+  Not thread-safe: callers provide their own locking.
+ */
+class TimingWheel {
+public:
+  using handle_t = uint64_t;
+  static constexpr handle_t no_handle {0};
+
+private:
+  static constexpr int slot_bits {6};
+  static constexpr uint32_t slots {1u << slot_bits};
+  static constexpr int levels {6};
+  static constexpr uint32_t nil {0xffffffffu};
+
+  struct Timer {
+    std::string key;
+    uint64_t due;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t generation;
+    uint32_t slot;  // Index into heads, or nil when free
+  };
+
+  std::vector<Timer> timers;
+  std::vector<uint32_t> heads;  // levels * slots list heads
+  uint32_t free_list;
+  uint64_t now_tick;
+  std::size_t live;
+
+  void link (uint32_t index);
+  void unlink (uint32_t index);
+  void cascade (int level);
+
+public:
+  explicit TimingWheel (uint64_t start_tick);
+
+  uint64_t now () const { return now_tick; }
+  std::size_t size () const { return live; }
+
+  // Schedule key to fire at tick due (or at the next tick if due has passed)
+  handle_t schedule (const std::string& key, uint64_t due);
+
+  // Cancel a timer. Returns false if it already fired or was cancelled.
+  bool cancel (handle_t handle);
+
+  /*
+    Advance to tick, calling fire (key, handle) for every timer due
+    at or before it, in due order. Returns the number fired.
+   */
+  std::size_t advance (uint64_t tick,
+                       const std::function<void(const std::string&, handle_t)>& fire);
+};
+
+#endif
@@ -10,14 +10,27 @@
  User Server code for CMPT 276, Spring 2016.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <exception>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include <cpprest/asyncrt_utils.h>
 #include <cpprest/base_uri.h>
 #include <cpprest/http_listener.h>
 #include <cpprest/json.h>
@@ -32,6 +45,16 @@
 #include "make_unique.h"
 #include "ServerUtils.h"
 #include "ClientUtils.h"
+#include "FanOut.h"
+#include "FollowerIndex.h"
+#include "FriendGraph.h"
+#include "FriendQueries.h"
+#include "FriendSet.h"
+#include "FriendsCodec.h"
+#include "KWayMerge.h"
+#include "PushQueue.h"
+#include "SessionStore.h"
+#include "StatusFeed.h"
 
 //#include "azure_keys.h"
 
@@ -59,9 +82,6 @@ using std::endl;
 using std::getline;
 using std::make_pair;
 using std::pair;
-using std::tuple;
-using std::make_tuple;
-using std::get;
 using std::string;
 using std::unordered_map;
 using std::vector;
@@ -107,6 +127,9 @@ const string add_property {"AddPropertyAdmin"};
 const string read_entity {"ReadEntityAdmin"};
 const string update_entity_auth{"UpdateEntityAuth"};
 const string read_entity_auth{"ReadEntityAuth"};
+const string query_entities {"QueryEntitiesAdmin"};
+const string add_to_set {"AddToSetAdmin"};
+const string remove_from_set {"RemoveFromSetAdmin"};
 
 // For AuthServer
 const string auth_table_name {"AuthTable"};
@@ -118,6 +141,8 @@ const string data_table_name {"DataTable"};
 const string get_read_token_op {"GetReadToken"};
 const string get_update_token_op {"GetUpdateToken"};
 const string get_update_data {"GetUpdateData"};
+const string update_data_entity_prop {"Entity"};
+const string update_data_etag_prop {"ETag"};
 
 // For UserServer
 const string sign_on {"SignOn"};
@@ -126,6 +151,19 @@ const string add_friend {"AddFriend"};
 const string unfriend {"UnFriend"};
 const string update_status {"UpdateStatus"};
 const string read_friend_list {"ReadFriendList"};
+const string read_updates {"ReadUpdates"};
+const string read_updates_cursor_prop {"Cursor"};
+const string get_feed {"GetFeed"};
+const string feed_time_prop {"Time"};
+const string bulk_friends {"BulkFriends"};
+const string bulk_add_prop {"Add"};
+const string bulk_remove_prop {"Remove"};
+const string friend_graph_stats {"FriendGraphStats"};
+const string mutual_friends_op {"MutualFriends"};
+const string suggest_friends_op {"SuggestFriends"};
+const string suggestions_prop {"Suggestions"};
+const string suggestion_friend_prop {"Friend"};
+const string suggestion_mutual_prop {"Mutual"};
 
 const string friends {"Friends"};
 const string status {"Status"};
@@ -133,96 +171,203 @@ const string updates {"Updates"};
 
 // For PushServer
 const string push_status {"PushStatus"};
+const string enqueue_status {"EnqueueStatus"};
+const string push_spool_op {"PushSpool"};
 
 /*
   Cache of opened tables
  */
 //TableCache table_cache {};
 
+////////////////////////////////////////////////////////////////////////////
+//                                                                        //
+//                 The list of users with active sessions                 //
+//                                                                        //
+////////////////////////////////////////////////////////////////////////////
+
 /*
-  Given an HTTP message with a JSON body, return the JSON
-  body as an unordered map of strings to strings.
+  Sessions of signed-on users, keyed by userid. Handlers run
+  concurrently on the listener's thread pool, so all access goes
+  through the thread-safe SessionStore.
+ */
+SessionStore active_users {};
 
-  Note that all types of JSON values are returned as strings.
-  Use C++ conversion utilities to convert to numbers or dates
-  as necessary.
+/*
+  Sessions are checkpointed to this file every session_checkpoint_secs
+  and at shutdown, and reloaded at startup, so a restart does not
+  make every user sign on again at once
  */
-unordered_map<string,string> get_json_body(http_request message) {  
-  unordered_map<string,string> results {};
-  const http_headers& headers {message.headers()};
-  auto content_type (headers.find("Content-Type"));
-  if (content_type == headers.end() ||
-      content_type->second != "application/json")
-    return results;
+const string session_file {"UserServer.sessions"};
+constexpr int session_checkpoint_secs {30};
 
-  value json{};
-  message.extract_json(true)
-    .then([&json](value v) -> bool
-          {
-            json = v;
-            return true;
-          })
-    .wait();
+void checkpoint_sessions()
+{
+  if (!active_users.save(session_file, SessionStore::unix_now()))
+    cout << "UserServer: could not write " << session_file << endl;
+}
 
-  if (json.is_object()) {
-    for (const auto& v : json.as_object()) {
-      if (v.second.is_string()) {
-        results[v.first] = v.second.as_string();
-      }
-      else {
-        results[v.first] = v.second.serialize();
-      }
+/*
+  Pushes PushServer could not take, because it was down or refused
+  them, are kept in a PushQueue in push_spool_dir and offered again
+  every push_spool_retry_secs until it takes them, so a status
+  UpdateStatus has stored always reaches the poster's friends, at
+  least once. While any are spooled, later pushes are spooled behind
+  them, so PushServer still gets each poster's statuses in order.
+
+  push_order_mutex is held from deciding where a push goes until it
+  has been offered or spooled, and by the replay across each offer,
+  so no push can overtake one spooled before it. It is taken before
+  push_spool_mutex, which guards only spooled_pushes.
+ */
+const string push_spool_dir {"UserServer.pushes"};
+constexpr int push_spool_retry_secs {1};
+
+PushQueue push_spool {push_spool_dir};
+std::mutex push_order_mutex;
+std::mutex push_spool_mutex;
+std::deque<PushJob> spooled_pushes;
+std::atomic<uint64_t> pushes_spooled {0};
+std::atomic<uint64_t> pushes_replayed {0};
+
+/*
+  Offer a push to PushServer's EnqueueStatus. Returns true if it is
+  settled: PushServer took it, or refused it as malformed (BadRequest),
+  which no retry would change.
+ */
+bool offer_push(const PushJob& job)
+{
+  try
+  {
+    pair<status_code, value> result {
+      do_request(methods::POST, push_url + enqueue_status + "/" + job.poster_partition + "/" + job.poster_row + "/" + job.status,
+                 build_json_value(friends, job.recipients))};
+    cout << "PushServer access response: " << result.first << endl;
+    if (result.first == status_codes::BadRequest)
+      cout << "PushServer refused the push of " << job.poster_row << "'s status as malformed; dropping it" << endl;
+    return result.first == status_codes::Accepted || result.first == status_codes::BadRequest;
+  }
+  catch (const std::exception& e)
+  {
+    cout << "PushServer unreachable: " << e.what() << endl;
+    return false;
+  }
+}
+
+/*
+  Hand the push of status, posted by the user in partition/row, to
+  their friends in friends_list, over to PushServer, or spool it if
+  PushServer cannot take it now. Returns false only if it could be
+  neither handed over nor spooled.
+ */
+bool hand_off_push(const string& partition, const string& row, const string& status, const string& friends_list)
+{
+  PushJob job {0, 0, 0, partition, row, status, friends_list};
+  std::lock_guard<std::mutex> order {push_order_mutex};
+  bool spooling {false};
+  {
+    std::lock_guard<std::mutex> lock {push_spool_mutex};
+    spooling = !spooled_pushes.empty();
+  }
+  if (!spooling && offer_push(job))
+    return true;
+
+  std::lock_guard<std::mutex> lock {push_spool_mutex};
+  if (!push_spool.append(job))
+  {
+    cout << "UserServer: could not spool a push to " << push_spool_dir << endl;
+    return false;
+  }
+  spooled_pushes.push_back(job);
+  pushes_spooled++;
+  return true;
+}
+
+/*
+  Offer the spooled pushes to PushServer, oldest first, until it
+  refuses one or none are left
+ */
+void replay_spooled_pushes()
+{
+  while (true)
+  {
+    // Held until the job is off the spool, so a new push cannot go straight to PushServer ahead of it
+    std::lock_guard<std::mutex> order {push_order_mutex};
+    PushJob job {};
+    {
+      std::lock_guard<std::mutex> lock {push_spool_mutex};
+      if (spooled_pushes.empty())
+        return;
+      job = spooled_pushes.front();
     }
+    if (!offer_push(job))
+      return;
+    {
+      std::lock_guard<std::mutex> lock {push_spool_mutex};
+      spooled_pushes.pop_front();
+    }
+    push_spool.ack(job.seq);
+    pushes_replayed++;
   }
-  return results;
 }
 
-////////////////////////////////////////////////////////////////////////////
-//                                                                        //
-//                 The list of users with active sessions                 //
-//                                                                        //
-////////////////////////////////////////////////////////////////////////////
+/*
+  Seconds between the Windows file-time epoch (1601-01-01), which
+  utility::datetime counts from, and the Unix epoch
+ */
+constexpr int64_t file_time_to_unix_seconds {11644473600LL};
 
-unordered_map<string, tuple<string, string, string>> active_users {};
+/*
+  Return when a SAS token stops working, in seconds since the Unix epoch.
+
+  The expiry is the token's "se" parameter. If that is missing or
+  unreadable, assume the 24 hours AuthServer grants from now.
+*/
+int64_t token_expiry(const string& token)
+{
+  string query {token};
+  if (!query.empty() && query[0] == '?')
+    query.erase(0, 1);
+
+  std::map<string,string> params {uri::split_query(query)};
+  auto se = params.find("se");
+  if (se != params.end()) {
+    utility::datetime expiry {utility::datetime::from_string(uri::decode(se->second),
+                                                             utility::datetime::ISO_8601)};
+    if (expiry.is_initialized())
+      return static_cast<int64_t>(expiry.to_interval() / 10000000) - file_time_to_unix_seconds;
+  }
+  return SessionStore::unix_now() + 24*60*60;
+}
 
 /*
   A function that adds the specified user to the list of active users.
-  Used when signing in a user
+  Used when signing in a user. Does nothing if the user already
+  has an active session. The session expires along with its token.
 */
 void add_user(const string& userid, const string& token, const string& data_partition, const string& data_row)
 {
   cout << "Adding the user " << userid << endl;
-  tuple<string, string, string> data_tuple {make_tuple(token, data_partition, data_row)};
-  active_users.insert({userid, data_tuple});
-
-  for(auto it = active_users.begin(); it != active_users.end(); ++it)
-  {
-    cout << "\tUser " << it->first << ": " << get<1>(it->second) << "/" << get<2>(it->second) << endl;
-  }
+  active_users.insert(userid, Session {token, data_partition, data_row, token_expiry(token)});
 }
 
 /*
-  A function that accesses the tuple of the specified user from the list of active users.
+  A function that accesses the session of the specified user from the list of active users.
+  Returns false if the user has no active session.
 */
-tuple<string, string, string> get_user(const string& userid)
+bool get_user(const string& userid, Session& session)
 {
   cout << "Accessing the user " << userid << endl;
-  return active_users.at(userid);
+  return active_users.lookup(userid, session);
 }
 
 /*
   A function that removes the specified user from the list of active users.
-  Used when signing out a user
+  Used when signing out a user. Returns false if the user had no active session.
 */
-void remove_user(const string& userid)
+bool remove_user(const string& userid)
 {
   cout << "Removing the user " << userid << endl;
-  active_users.erase(userid);
-
-  for(auto it = active_users.begin(); it != active_users.end(); ++it)
-  {
-    cout << "\tUser " << it->first << ": " << get<1>(it->second) << "/" << get<2>(it->second) << endl;
-  }
+  return active_users.erase(userid);
 }
 
 /*
@@ -230,12 +375,656 @@ void remove_user(const string& userid)
 */
 void active_users_list()
 {
-  for(auto it = active_users.begin(); it != active_users.end(); ++it)
+  active_users.for_each([] (const string& userid, const Session& session)
+  {
+    cout << "\tUser " << userid << ": " << session.partition() << "/" << session.row() << endl;
+  });
+}
+
+
+/*
+  How many times change_entity () re-reads and retries when another
+  writer changed the entity between its read and its write
+ */
+constexpr int entity_write_attempts {4};
+
+string entity_auth_path(const string& op, const Session& session)
+{
+  return basic_url + op + "/" + data_table_name + "/" + session.token() + "/" + session.partition() + "/" + session.row();
+}
+
+/*
+  If set (by --compact-friends), friends lists are written to
+  DataTable in the compact form (see FriendsCodec.h). Lists stored in
+  either form are read, and everything past stored_friends () and
+  friends_to_store () deals only in the text form, so clients never
+  see the compact one.
+ */
+bool compact_friends_mode {false};
+
+/*
+  A friends list as read from DataTable, in the text form. A compact
+  list that cannot be decoded is left as it is, so it reads as
+  malformed wherever it is parsed, as a malformed text list would.
+ */
+string stored_friends(const string& stored)
+{
+  try
+  {
+    return friends_to_text(stored);
+  }
+  catch (const std::invalid_argument&)
+  {
+    cout << "Malformed compact friends list: " << stored << endl;
+    return stored;
+  }
+}
+
+/*
+  A friends list in the text form, as it is to be written to
+  DataTable. A list too malformed to encode is written as it is.
+ */
+string friends_to_store(const string& friends_list)
+{
+  if (!compact_friends_mode)
+    return friends_list;
+  try
+  {
+    return compact_friends(friends_list);
+  }
+  catch (const std::invalid_argument&)
+  {
+    cout << "Malformed friends list written as text: " << friends_list << endl;
+    return friends_list;
+  }
+}
+
+/*
+  Cache entity_json, the user's data entity as read with ETag etag,
+  in the user's session, and return the cached copy.
+  An entity without an ETag is not cached, since a conditional write
+  could not tell whether it is current.
+ */
+std::shared_ptr<const UserEntity> cache_entity(const string& userid, const value& entity_json, const string& etag)
+{
+  unordered_map<string, string> data_properties = unpack_json_object(entity_json);
+  std::shared_ptr<const UserEntity> entity {std::make_shared<const UserEntity>(UserEntity {
+      stored_friends(data_properties[friends]), data_properties[status], data_properties[updates],
+      parse_archived(data_properties[updates_archived_prop]), etag})};
+  if (!etag.empty())
+    active_users.set_entity(userid, entity);
+  return entity;
+}
+
+/*
+  Get the user's data entity.
+
+  entity is the caller's own copy, if it has one newer than the
+  session's. Either is used as is, unless revalidate is set.
+  Then BasicServer is asked for the entity only if it has changed
+  (If-None-Match), so an unchanged entity costs no response body.
+
+  Returns OK, or the status of the failed read.
+ */
+status_code read_entity_cached(const string& userid, const Session& session, bool revalidate,
+                               std::shared_ptr<const UserEntity>& entity)
+{
+  if (!entity)
+    entity = session.entity();
+  if (entity && !revalidate)
+    return status_codes::OK;
+
+  string etag {};
+  pair<status_code, value> read_result
+  {
+    do_conditional_request(methods::GET, entity_auth_path(read_entity_auth, session), value {},
+                           "", entity ? entity->etag : "", etag)
+  };
+  cout << "BasicServer access response " << read_result.first << endl;
+
+  if (read_result.first == status_codes::NotModified)
+    return status_codes::OK;
+  if (read_result.first != status_codes::OK)
+    return read_result.first;
+  entity = cache_entity(userid, read_result.second, etag);
+  return status_codes::OK;
+}
+
+/*
+  Change the user's data entity with a single conditional write.
+
+  change is given the current entity and fills in the properties
+  to merge into it, returning false if nothing needs writing.
+  The write carries the cached entity's ETag (If-Match), so the
+  entity is not read first; if another writer (PushServer, say)
+  changed it in the meantime, the entity is re-read and change
+  is run again on the new copy.
+
+  entity is the caller's copy of the entity, if it has one newer
+  than the session's, and is set to the entity after the change.
+
+  Returns OK if the change was written or not needed,
+  NotFound if the entity could not be read, and otherwise the
+  status of the failed write.
+ */
+status_code change_entity(const string& userid, const Session& session,
+                          const std::function<bool(const UserEntity&, prop_str_vals_t&)>& change,
+                          std::shared_ptr<const UserEntity>& entity)
+{
+  status_code write_status {status_codes::PreconditionFailed};
+  for (int attempt {0}; attempt < entity_write_attempts && write_status == status_codes::PreconditionFailed; attempt++)
+  {
+    if (read_entity_cached(userid, session, attempt > 0, entity) != status_codes::OK)
+    {
+      cout << "Getting user's status to signed in, authorized, was unsuccessful.\n";
+      return status_codes::NotFound;
+    }
+
+    prop_str_vals_t props {};
+    if (!change(*entity, props))
+      return status_codes::OK;
+
+    prop_str_vals_t stored_props {props};
+    for (auto& p : stored_props)
+    {
+      if (p.first == friends)
+        p.second = friends_to_store(p.second);
+    }
+
+    string etag {};
+    pair<status_code, value> write_result
+    {
+      do_conditional_request(methods::PUT, entity_auth_path(update_entity_auth, session),
+                             build_json_value(stored_props), entity->etag, "", etag)
+    };
+    cout << "BasicServer access response: " << write_result.first << endl;
+    write_status = write_result.first;
+  
+    if (write_status == status_codes::OK)
+    {
+      // Apply the change to a copy of the cached entity rather than reading it back
+      UserEntity updated {*entity};
+      for (const auto& p : props)
+      {
+        if (p.first == friends)
+          updated.friends = p.second;
+        else if (p.first == status)
+          updated.status = p.second;
+        else if (p.first == updates)
+          updated.updates = p.second;
+        else if (p.first == updates_archived_prop)
+          updated.archived_pages = parse_archived(p.second);
+      }
+      updated.etag = etag;
+      entity = std::make_shared<const UserEntity>(std::move(updated));
+      active_users.set_entity(userid, etag.empty() ? std::shared_ptr<const UserEntity> {} : entity);
+    }
+  }
+  return write_status;
+}
+
+/*
+  Write pages spilled from the feed ring of the user in partition/row
+  to UpdatesArchive, as page numbers first_page onwards. The page
+  numbers come from the entity the pages were cut from, so writing
+  them again on a retried change just rewrites the same pages.
+  Returns false if any page could not be written.
+ */
+bool archive_feed_pages(const string& partition, const string& row, uint64_t first_page, const vector<string>& pages)
+{
+  for (std::size_t i {0}; i < pages.size(); i++)
+  {
+    string page_uri {basic_url + update_entity + "/" + updates_archive_table + "/" + partition + "/" + archive_row(row, first_page + i)};
+    value page_json {build_json_value(updates, pages[i])};
+    pair<status_code, value> page_result {do_request(methods::PUT, page_uri, page_json)};
+
+    // The archive table is created the first time any feed spills
+    if (page_result.first == status_codes::NotFound)
+    {
+      do_request(methods::POST, basic_url + create_table + "/" + updates_archive_table);
+      page_result = do_request(methods::PUT, page_uri, page_json);
+    }
+    cout << "Archive page " << first_page + i << " response: " << page_result.first << endl;
+    if (page_result.first != status_codes::OK)
+      return false;
+  }
+  return true;
+}
+
+/*
+  A change to the reverse friend index (see FollowerIndex.h): the
+  user in partition/row has added (op add_to_set) or removed
+  (remove_from_set) friend_partition/friend_row as a friend. seq is
+  its sequence number in follower_spool, once spooled.
+ */
+struct FollowerChange {
+  uint64_t seq;
+  string op;
+  string friend_partition;
+  string friend_row;
+  string partition;
+  string row;
+};
+
+/*
+  follower_spool keeps changes in PushQueue's records. Only these two
+  know the layout: the user in the poster fields, the op as the
+  status and the friend, as a Friends-format pair, as the recipients.
+ */
+PushJob follower_change_record(const FollowerChange& change)
+{
+  return PushJob {0, 0, 0, change.partition, change.row, change.op,
+                  change.friend_partition + pair_delimiter + change.friend_row};
+}
+
+// Returns false if record is not a follower change, from an older format or damaged
+bool parse_follower_change(const PushJob& record, FollowerChange& change)
+{
+  string::size_type delim {record.recipients.find(pair_delimiter)};
+  if ((record.status != add_to_set && record.status != remove_from_set) || delim == string::npos ||
+      delim == 0 || delim + 1 == record.recipients.size() ||
+      record.poster_partition.empty() || record.poster_row.empty())
+    return false;
+  change = FollowerChange {record.seq, record.status, record.recipients.substr(0, delim),
+                           record.recipients.substr(delim + 1), record.poster_partition, record.poster_row};
+  return true;
+}
+
+/*
+  Follower index changes that could not be made, kept in a PushQueue
+  in follower_spool_dir so they survive a restart, and made again
+  every push_spool_retry_secs until they succeed. While any are
+  spooled, later changes are spooled behind them, so an add and a
+  remove of the same friend are still made in order.
+ */
+const string follower_spool_dir {"UserServer.followers"};
+
+PushQueue follower_spool {follower_spool_dir};
+std::mutex follower_spool_mutex;
+std::deque<FollowerChange> spooled_follower_changes;
+
+// Changes made at once by update_followers_bulk ()
+constexpr std::size_t max_follower_writes {16};
+
+/*
+  Make change in the index. Yields true if it is settled: made, or
+  refused as malformed (BadRequest), which no retry would change.
+  Nothing waits for it meanwhile.
+ */
+pplx::task<bool> write_follower_change(const FollowerChange& change)
+{
+  string set_uri {basic_url + change.op + "/" + followers_table + "/" + change.friend_partition + "/" + change.friend_row};
+  value key_json {build_json_value(followers_prop, change.partition + pair_delimiter + change.row)};
+  string friend_row {change.friend_row};
+  return do_request_async(methods::PUT, set_uri, key_json)
+    .then([set_uri, key_json] (pair<status_code, value> set_result)
+    {
+      // The index table is created by the first friend ever added
+      if (set_result.first != status_codes::NotFound)
+        return pplx::task_from_result(set_result.first);
+      return do_request_async(methods::POST, basic_url + create_table + "/" + followers_table, value {})
+        .then([set_uri, key_json] (pair<status_code, value>)
+        {
+          return do_request_async(methods::PUT, set_uri, key_json);
+        })
+        .then([] (pair<status_code, value> retry_result)
+        {
+          return retry_result.first;
+        });
+    })
+    .then([friend_row] (pplx::task<status_code> done)
+    {
+      try
+      {
+        status_code set_result {done.get()};
+        if (set_result == status_codes::OK)
+          return true;
+        if (set_result == status_codes::BadRequest)
+        {
+          cout << "Follower index update for " << friend_row << " refused as malformed; dropping it" << endl;
+          return true;
+        }
+        cout << "Follower index update for " << friend_row << " failed: " << set_result << endl;
+      }
+      catch (const std::exception& e)
+      {
+        cout << "Follower index update for " << friend_row << " failed: " << e.what() << endl;
+      }
+      return false;
+    });
+}
+
+// Spool a change write_follower_change () could not make. Returns false if it could not be spooled either.
+bool spool_follower_change(FollowerChange change)
+{
+  PushJob record {follower_change_record(change)};
+  std::lock_guard<std::mutex> lock {follower_spool_mutex};
+  if (!follower_spool.append(record))
+  {
+    cout << "UserServer: could not spool a follower index change to " << follower_spool_dir << endl;
+    return false;
+  }
+  change.seq = record.seq;
+  spooled_follower_changes.push_back(std::move(change));
+  return true;
+}
+
+bool follower_changes_spooled()
+{
+  std::lock_guard<std::mutex> lock {follower_spool_mutex};
+  return !spooled_follower_changes.empty();
+}
+
+/*
+  Record change in the index, as write_follower_change () does, or
+  spool it if it cannot be made now.
+
+  This is done after the friends list itself is written. Returns
+  false only if the change could be neither made nor spooled, in
+  which case the index lacks it until the friend is next added or
+  removed.
+ */
+bool update_followers(const FollowerChange& change)
+{
+  if (!follower_changes_spooled() && write_follower_change(change).get())
+    return true;
+  return spool_follower_change(change);
+}
+
+/*
+  update_followers () for many changes, up to max_follower_writes at
+  once. No two may be for the same user and friend, since they are
+  made in no particular order.
+ */
+bool update_followers_bulk(const vector<FollowerChange>& changes)
+{
+  std::shared_ptr<vector<char>> made {std::make_shared<vector<char>>(changes.size(), false)};
+  if (!follower_changes_spooled())
+  {
+    std::shared_ptr<const vector<FollowerChange>> to_make {std::make_shared<const vector<FollowerChange>>(changes)};
+    try
+    {
+      bounded_fan_out(changes.size(), max_follower_writes, [to_make, made] (std::size_t i)
+      {
+        return write_follower_change((*to_make)[i])
+          .then([made, i] (bool ok)
+          {
+            (*made)[i] = ok;
+            return ok;
+          });
+      }).get();
+    }
+    catch (const std::exception& e)
+    {
+      cout << "Follower index updates failed: " << e.what() << endl;
+    }
+  }
+
+  bool all {true};
+  for (std::size_t i {0}; i < changes.size(); i++)
+  {
+    if (!(*made)[i])
+      all = spool_follower_change(changes[i]) && all;
+  }
+  return all;
+}
+
+/*
+  Make the spooled follower index changes, oldest first, until one
+  fails or none are left
+ */
+void replay_follower_changes()
+{
+  while (true)
+  {
+    FollowerChange change {};
+    {
+      std::lock_guard<std::mutex> lock {follower_spool_mutex};
+      if (spooled_follower_changes.empty())
+        return;
+      change = spooled_follower_changes.front();
+    }
+    if (!write_follower_change(change).get())
+      return;
+    {
+      std::lock_guard<std::mutex> lock {follower_spool_mutex};
+      spooled_follower_changes.pop_front();
+    }
+    follower_spool.ack(change.seq);
+  }
+}
+
+/*
+  Load the changes left in follower_spool by an earlier run. A record
+  that is not a valid change could never be made, so it is
+  acknowledged and dropped rather than left to block those behind it.
+ */
+bool open_follower_spool()
+{
+  vector<PushJob> records {};
+  if (!follower_spool.open(records))
+    return false;
+  std::lock_guard<std::mutex> lock {follower_spool_mutex};
+  for (const PushJob& record : records)
+  {
+    FollowerChange change {};
+    if (parse_follower_change(record, change))
+      spooled_follower_changes.push_back(std::move(change));
+    else
+    {
+      cout << "UserServer: dropping malformed follower index change " << record.seq << endl;
+      follower_spool.ack(record.seq);
+    }
+  }
+  cout << "UserServer: " << spooled_follower_changes.size() << " spooled follower index change(s)" << endl;
+  return true;
+}
+
+/*
+  Parse a count or cursor from a path. Returns false unless s is
+  a nonempty string of digits.
+ */
+bool parse_position(const string& s, uint64_t& n)
+{
+  if (s.empty() || s.size() > 18)
+    return false;
+  for (char c : s)
+  {
+    if (c < '0' || c > '9')
+      return false;
+  }
+  n = std::stoull(s);
+  return true;
+}
+
+// The most entries one ReadUpdates returns
+constexpr uint64_t max_read_updates {500};
+
+// The most people one SuggestFriends returns
+constexpr uint64_t max_suggestions {100};
+
+/*
+  The outbox authors (see StatusFeed.h), as (data partition, data row)
+  pairs. The list is small and rarely changes, so it is re-read from
+  OutboxAuthors at most every outbox_authors_ttl_secs.
+ */
+constexpr int64_t outbox_authors_ttl_secs {30};
+std::mutex outbox_authors_mutex;
+friends_list_t outbox_authors_cache {};
+int64_t outbox_authors_read_at {0};
+
+friends_list_t outbox_authors()
+{
+  int64_t now {SessionStore::unix_now()};
+  {
+    std::lock_guard<std::mutex> lock {outbox_authors_mutex};
+    if (outbox_authors_read_at != 0 && now - outbox_authors_read_at < outbox_authors_ttl_secs)
+      return outbox_authors_cache;
+  }
+
+  pair<status_code, value> authors_result
+  {
+    do_request(methods::GET, basic_url + read_entity + "/" + outbox_authors_table + "/" + outbox_authors_partition + "/*")
+  };
+  friends_list_t authors {};
+  if (authors_result.first == status_codes::OK && authors_result.second.is_array())
+  {
+    for (const value& a : authors_result.second.as_array())
+    {
+      string key {get_json_object_prop(a, "Row")};
+      string::size_type delim {key.find(pair_delimiter)};
+      if (delim != string::npos)
+        authors.push_back(make_pair(key.substr(0, delim), key.substr(delim + 1)));
+    }
+  }
+  // With no OutboxAuthors table there are no authors; on any other failure keep the old list
+  else if (authors_result.first != status_codes::NotFound)
+  {
+    std::lock_guard<std::mutex> lock {outbox_authors_mutex};
+    return outbox_authors_cache;
+  }
+
+  std::lock_guard<std::mutex> lock {outbox_authors_mutex};
+  outbox_authors_cache = authors;
+  outbox_authors_read_at = now;
+  return authors;
+}
+
+/*
+  Every user's friends as a graph over dense integer ids (see
+  FriendGraph.h), for traversals that should not touch strings.
+
+  It is loaded in full from DataTable by friend_graph_thread in main
+  (), and kept up to date by this server's own friend changes. Lists
+  changed some other way (by a second UserServer, or directly in
+  DataTable) are picked up by a full reload every
+  friend_graph_reload_secs. Requests never wait on a load: they use
+  the graph as it stands. A failed load is tried again after
+  friend_graph_retry_secs, doubling up to friend_graph_reload_secs.
+ */
+FriendGraph friend_graph {};
+constexpr int64_t friend_graph_reload_secs {300};
+constexpr int64_t friend_graph_retry_secs {5};
+
+/*
+  Read every user's friends list from DataTable into friend_graph.
+  Returns false, leaving the graph as it was, if DataTable could not
+  be read.
+ */
+bool load_friend_graph()
+{
+  // Lists this server changes from here on are newer than what the read returns
+  uint64_t since {friend_graph.generation()};
+  pair<status_code, value> table_result {do_request(methods::GET, basic_url + read_entity + "/" + data_table_name)};
+  if (table_result.first != status_codes::OK || !table_result.second.is_array())
+  {
+    cout << "Loading the friend graph failed: " << table_result.first << endl;
+    return false;
+  }
+
+  vector<pair<pair<string,string>,friends_list_t>> users {};
+  for (const value& e : table_result.second.as_array())
+  {
+    friends_list_t friends_list {};
+    try
+    {
+      friends_list = parse_friends_list(stored_friends(get_json_object_prop(e, friends)));
+    }
+    catch (const std::invalid_argument&)
+    {
+      cout << "Malformed friends list for " << get_json_object_prop(e, "Row") << endl;
+    }
+    users.push_back(make_pair(make_pair(get_json_object_prop(e, "Partition"), get_json_object_prop(e, "Row")),
+                              std::move(friends_list)));
+  }
+  friend_graph.load(users, since);
+  cout << "Loaded the friend graph: " << users.size() << " users\n";
+  return true;
+}
+
+/*
+  Record a user's changed friends list in friend_graph. A malformed
+  list cannot have been written by this server, so it is skipped.
+ */
+void note_friends_changed(const string& partition, const string& row, const string& friends_list)
+{
+  try
+  {
+    friend_graph.set_friends(partition, row, parse_friends_view(friends_list));
+  }
+  catch (const std::invalid_argument&)
+  {
+    cout << "Malformed friends list for " << row << " not added to the friend graph\n";
+  }
+}
+
+/*
+  An entry of a user's feed, as GetFeed returns it, with the feed
+  key it is ordered by
+ */
+struct FeedItem {
+  string key;
+  value entry;  // {"Status", "Poster", "Time"}
+};
+
+// Feed keys sort newest first
+struct feed_item_newer {
+  bool operator() (const FeedItem& a, const FeedItem& b) const { return a.key < b.key; }
+};
+
+using FeedStream = KWayStream<FeedItem, feed_item_newer>;
+
+/*
+  How many entries of an outbox GetFeed reads at first. Most pages
+  take few entries from any one outbox, so outboxes are read in
+  small batches, doubling as they are used up.
+ */
+constexpr uint64_t feed_outbox_batch {16};
+
+/*
+  A FeedStream source reading the feed entries of the user in
+  partition/row from table (FeedTable or OutboxTable), newest first,
+  starting after the feed key after (or at the newest, if empty).
+  The first query asks for first_batch entries, and each later one
+  for twice as many as the last, up to max_batch. A missing table is
+  an empty source; any other failure ends the source and sets failed.
+ */
+FeedStream::refill_t feed_source(const string& table, const string& partition, const string& row,
+                                 const string& after, uint64_t first_batch, uint64_t max_batch, bool& failed)
+{
+  string last {after};
+  uint64_t batch {first_batch};
+  return [table, partition, row, last, batch, max_batch, &failed] (vector<FeedItem>& items) mutable -> bool
   {
-    cout << "\tUser " << it->first << ": " << get<1>(it->second) << "/" << get<2>(it->second) << endl;
-  }
-}
+    string query_uri {basic_url + query_entities + "/" + table + "/" + partition + "/" +
+                      feed_row_prefix(row) + "/" + std::to_string(batch)};
+    if (!last.empty())
+      query_uri += "/" + feed_row_prefix(row) + last;
+    pair<status_code, value> query_result {do_request(methods::GET, query_uri)};
+    cout << "BasicServer query response for " << table << "/" << partition << " " << query_result.first << endl;
+
+    if (query_result.first == status_codes::NotFound)
+      return false;
+    if (query_result.first != status_codes::OK || !query_result.second.is_array())
+    {
+      failed = true;
+      return false;
+    }
 
+    const web::json::array& rows {query_result.second.as_array()};
+    for (const value& e : rows)
+    {
+      last = feed_key(get_json_object_prop(e, "Row"), row);
+      items.push_back(FeedItem {last, value::object(prop_vals_t {
+          make_pair(feed_status_prop, value::string(get_json_object_prop(e, feed_status_prop))),
+          make_pair(feed_poster_prop, value::string(get_json_object_prop(e, feed_poster_prop))),
+          make_pair(feed_time_prop, value::number(feed_key_micros(last)))})});
+    }
+    bool more {rows.size() == batch};
+    batch = std::min(batch * 2, max_batch);
+    return more;
+  };
+}
 
 ////////////////////////////////////////////////////////////////////////////
 
@@ -249,6 +1038,42 @@ void handle_get(http_request message) {
   cout << endl << "**** UserServer GET " << path << endl;
   auto paths = uri::split_path(path);
 
+  // Report the pushes waiting in the spool for PushServer, and how many have been spooled and replayed
+  if(paths.size() == 1 && paths[0] == push_spool_op)
+  {
+      std::size_t waiting {0};
+      {
+        std::lock_guard<std::mutex> lock {push_spool_mutex};
+        waiting = spooled_pushes.size();
+      }
+      message.reply(status_codes::OK, value::object(prop_vals_t {
+          make_pair("Waiting", value::number(static_cast<uint64_t>(waiting))),
+          make_pair("Spooled", value::number(pushes_spooled.load())),
+          make_pair("Replayed", value::number(pushes_replayed.load()))}));
+      return;
+  }
+
+  /*
+    Report the size of the friend graph: users and edges, and the
+    bytes its adjacency arrays and its id table take, overall and
+    per edge
+   */
+  if(paths.size() == 1 && paths[0] == friend_graph_stats)
+  {
+      std::shared_ptr<const FriendGraphSnapshot> graph {friend_graph.snapshot()};
+      std::size_t adjacency_bytes {graph->adjacency_bytes()};
+      std::size_t id_bytes {friend_graph.id_bytes()};
+      double bytes_per_edge {graph->edges() == 0 ? 0.0 :
+                             static_cast<double>(adjacency_bytes + id_bytes) / graph->edges()};
+      message.reply(status_codes::OK, value::object(prop_vals_t {
+          make_pair("Users", value::number(static_cast<uint64_t>(graph->users()))),
+          make_pair("Edges", value::number(static_cast<uint64_t>(graph->edges()))),
+          make_pair("AdjacencyBytes", value::number(static_cast<uint64_t>(adjacency_bytes))),
+          make_pair("IdBytes", value::number(static_cast<uint64_t>(id_bytes))),
+          make_pair("BytesPerEdge", value::number(bytes_per_edge))}));
+      return;
+  }
+
   /////////////////////////////////////////////////////////////////
   //                                                             //
   //                       ASSIGNMENT # 3                        //
@@ -263,48 +1088,35 @@ void handle_get(http_request message) {
       string username = paths[1];
 
       // Check if the user has an active session.
-      std::unordered_map<string, tuple<string, string, string>>::iterator active_user = active_users.find(username);
+      Session user_session {};
 
-      if(active_user == active_users.end())
+      if(!get_user(username, user_session))
       {
         cout << "The user never had an active session.\n";
         message.reply(status_codes::Forbidden);
         return;
       }
 
-      tuple<string, string, string> user_properties = get_user(username);
-      cout << "\tUser token: " << get<0>(user_properties) << endl;
-      cout << "\tUser partition: " << get<1>(user_properties) << endl;
-      cout << "\tUser row: " << get<2>(user_properties) << endl;
+      string user_token = user_session.token();
+      string user_partition = user_session.partition();
+      string user_row = user_session.row();
+      cout << "\tUser token: " << user_token << endl;
+      cout << "\tUser partition: " << user_partition << endl;
+      cout << "\tUser row: " << user_row << endl;
 
-      string user_token = get<0>(user_properties);
-      string user_partition = get<1>(user_properties);
-      string user_row = get<2>(user_properties);
+      // Get the user's friend list, revalidating the session's cached copy
+      std::shared_ptr<const UserEntity> entity {};
+      status_code read_status {read_entity_cached(username, user_session, true, entity)};
 
-      // Get the user's friend list.
-      pair<status_code, value> signed_on_result
-      {
-        do_request (methods::GET,
-                    basic_url + read_entity_auth + "/" + data_table_name + "/" + user_token + "/" + user_partition + "/" + user_row)
-      };
-      cout << "BasicServer access response " << signed_on_result.first << endl;
-
-      if(signed_on_result.first == status_codes::BadRequest || signed_on_result.first == status_codes::NotFound)
+      if(read_status == status_codes::BadRequest || read_status == status_codes::NotFound)
       {
         cout << "Getting user's status to signed in, authorized, was unsuccessful.\n";
         message.reply(status_codes::NotFound);
         return;
       }
 
-      unordered_map<string, string> data_properties = unpack_json_object(signed_on_result.second);
-
-      for(auto it = data_properties.begin(); it != data_properties.end(); ++it)
-      {
-        cout << "\tData Property " << it->first << ": " << it->second << "\n"; 
-      }
-
       // If the user has an active session, get the user's friend list from DataTable, authorized.
-      string actual_friends = data_properties[friends];
+      string actual_friends = entity ? entity->friends : string {};
 
       friends_list_t j = parse_friends_list(actual_friends);
 
@@ -315,7 +1127,7 @@ void handle_get(http_request message) {
       }
 
       // After all of these, signing in is finished and successful. Return status code "OK" and the update token
-      if(signed_on_result.first == status_codes::OK)
+      if(read_status == status_codes::OK)
       {
           cout << "Getting user's friend list was successful!\n";
           value friends_json { build_json_value (friends, actual_friends) };
@@ -326,6 +1138,264 @@ void handle_get(http_request message) {
       cout << "At the end of ReadFriendList block. Nothing was done.\n";
   }
 
+  /*
+    The friends the user has in common with another user:
+    MutualFriends/<userid>/<country>/<name>. Replies with them as a
+    friends list under "Friends", as ReadFriendList does.
+   */
+  if(paths[0] == mutual_friends_op)
+  {
+      if(paths.size() < 4)
+      {
+        message.reply(status_codes::BadRequest);
+        return;
+      }
+
+      Session user_session {};
+      if(!get_user(paths[1], user_session))
+      {
+        cout << "The user never had an active session.\n";
+        message.reply(status_codes::Forbidden);
+        return;
+      }
+
+      std::shared_ptr<const FriendGraphSnapshot> graph {friend_graph.snapshot()};
+      friends_list_t mutual {};
+      uint32_t user_id {0};
+      uint32_t other_id {0};
+      // Either user being unknown to the graph, or new since the snapshot, means no friends yet
+      if(friend_graph.find_id(user_session.partition(), user_session.row(), user_id) &&
+         friend_graph.find_id(paths[2], paths[3], other_id) &&
+         user_id < graph->users() && other_id < graph->users())
+      {
+        for (uint32_t id : mutual_friends(*graph, user_id, other_id))
+          mutual.push_back(friend_graph.user_of(id));
+      }
+      message.reply(status_codes::OK, build_json_value(friends, friends_list_to_string(mutual)));
+      return;
+  }
+
+  /*
+    The people the user may know: SuggestFriends/<userid>/<count>.
+    Replies with up to count friends of the user's friends, most
+    mutual friends first, as an array under "Suggestions" of objects
+    with the person under "Friend", in friends list form, and the
+    number of mutual friends under "Mutual".
+   */
+  if(paths[0] == suggest_friends_op)
+  {
+      uint64_t count {0};
+      if(paths.size() < 3 || !parse_position(paths[2], count) || count == 0)
+      {
+        message.reply(status_codes::BadRequest);
+        return;
+      }
+      if(count > max_suggestions)
+        count = max_suggestions;
+
+      Session user_session {};
+      if(!get_user(paths[1], user_session))
+      {
+        cout << "The user never had an active session.\n";
+        message.reply(status_codes::Forbidden);
+        return;
+      }
+
+      std::shared_ptr<const FriendGraphSnapshot> graph {friend_graph.snapshot()};
+      vector<value> suggestions {};
+      uint32_t user_id {0};
+      if(friend_graph.find_id(user_session.partition(), user_session.row(), user_id) && user_id < graph->users())
+      {
+        for (const FriendSuggestion& s : suggest_friends(*graph, user_id, static_cast<std::size_t>(count)))
+        {
+          pair<string,string> person {friend_graph.user_of(s.user)};
+          suggestions.push_back(value::object(prop_vals_t {
+              make_pair(suggestion_friend_prop, value::string(person.first + pair_delimiter + person.second)),
+              make_pair(suggestion_mutual_prop, value::number(s.mutual))}));
+        }
+      }
+      message.reply(status_codes::OK, value::object(prop_vals_t {
+          make_pair(suggestions_prop, value::array(suggestions))}));
+      return;
+  }
+
+  /*
+    Read a page of the user's status feed, newest first:
+    ReadUpdates/<userid>/<count>[/<cursor>]. Replies with up to count
+    entries under "Updates" and, if there are older entries, the
+    cursor to pass for the next page under "Cursor".
+
+    The cursor is the feed position (see StatusFeed.h) just past the
+    next entry to return, so new statuses arriving between pages do
+    not shift it. Without one, reading starts at the newest entry.
+   */
+  if(paths[0] == read_updates)
+  {
+      uint64_t count {0};
+      if(paths.size() < 3 || !parse_position(paths[2], count) || count == 0)
+      {
+        message.reply(status_codes::BadRequest);
+        return;
+      }
+      if(count > max_read_updates)
+        count = max_read_updates;
+
+      Session user_session {};
+      if(!get_user(paths[1], user_session))
+      {
+        cout << "The user never had an active session.\n";
+        message.reply(status_codes::Forbidden);
+        return;
+      }
+
+      std::shared_ptr<const UserEntity> entity {};
+      if(read_entity_cached(paths[1], user_session, true, entity) != status_codes::OK)
+      {
+        message.reply(status_codes::NotFound);
+        return;
+      }
+
+      vector<string> ring {split_entries(entity->updates)};
+      uint64_t ring_start {entity->archived_pages * feed_page_entries};
+      uint64_t cursor {ring_start + ring.size()};
+      if(paths.size() > 3)
+      {
+        uint64_t requested {0};
+        if(!parse_position(paths[3], requested))
+        {
+          message.reply(status_codes::BadRequest);
+          return;
+        }
+        if(requested < cursor)
+          cursor = requested;
+      }
+
+      // Walk back from the cursor, through the ring and then the archived pages
+      vector<value> entries {};
+      vector<string> page {};
+      uint64_t page_number {0};
+      bool have_page {false};
+      while(cursor > 0 && entries.size() < count)
+      {
+        uint64_t position {cursor - 1};
+        if(position >= ring_start)
+        {
+          entries.push_back(value::string(ring[position - ring_start]));
+        }
+        else
+        {
+          if(!have_page || page_number != position / feed_page_entries)
+          {
+            page_number = position / feed_page_entries;
+            pair<status_code, value> page_result
+            {
+              do_request(methods::GET, basic_url + read_entity + "/" + updates_archive_table + "/" +
+                         user_session.partition() + "/" + archive_row(user_session.row(), page_number))
+            };
+            if(page_result.first != status_codes::OK)
+            {
+              cout << "Archive page " << page_number << " could not be read: " << page_result.first << endl;
+              break;
+            }
+            page = split_entries(get_json_object_prop(page_result.second, updates));
+            have_page = true;
+          }
+          uint64_t offset {position % feed_page_entries};
+          if(offset >= page.size())
+            break;
+          entries.push_back(value::string(page[offset]));
+        }
+        cursor--;
+      }
+
+      message.reply(status_codes::OK, value::object(prop_vals_t {
+          make_pair(updates, value::array(entries)),
+          make_pair(read_updates_cursor_prop, value::string(cursor > 0 ? std::to_string(cursor) : string {}))}));
+      return;
+  }
+
+  /*
+    Read a page of the user's feed (see StatusFeed.h), newest first:
+    GetFeed/<userid>/<count>[/<cursor>]. Replies with up to count
+    {"Status", "Poster", "Time"} objects under "Updates", Time being
+    when the status was posted in microseconds since the Unix epoch,
+    and, if the page is full, the cursor for the next page under
+    "Cursor".
+
+    The feed is the user's FeedTable entries merged with the outboxes
+    of the outbox authors on their friends list. Every source is read
+    newest first, so a heap-based k-way merge (FeedStream) gives the
+    page, reading each source a batch at a time only as the merge
+    reaches it. The cursor is the feed key of the last entry returned;
+    it resumes every source just past it, so paging never re-reads
+    entries already returned.
+   */
+  if(paths[0] == get_feed)
+  {
+      uint64_t count {0};
+      if(paths.size() < 3 || !parse_position(paths[2], count) || count == 0)
+      {
+        message.reply(status_codes::BadRequest);
+        return;
+      }
+      if(count > max_read_updates)
+        count = max_read_updates;
+
+      Session user_session {};
+      if(!get_user(paths[1], user_session))
+      {
+        cout << "The user never had an active session.\n";
+        message.reply(status_codes::Forbidden);
+        return;
+      }
+
+      string after {paths.size() > 3 ? paths[3] : string {}};
+      bool failed {false};
+      FeedStream stream {};
+      stream.add_source(feed_source(feed_table, user_session.partition(), user_session.row(),
+                                    after, count, count, failed));
+
+      friends_list_t authors {outbox_authors()};
+      if(!authors.empty())
+      {
+        std::shared_ptr<const UserEntity> entity {};
+        if(read_entity_cached(paths[1], user_session, false, entity) != status_codes::OK)
+        {
+          message.reply(status_codes::NotFound);
+          return;
+        }
+        FriendSet friend_set {entity->friends};
+        for(const auto& a : authors)
+        {
+          if(friend_set.contains(a.first, a.second))
+            stream.add_source(feed_source(outbox_table, a.first, a.second,
+                                          after, std::min(count, feed_outbox_batch), count, failed));
+        }
+      }
+
+      vector<value> entries {};
+      string cursor {};
+      FeedItem item {};
+      std::size_t source {0};
+      while(entries.size() < count && stream.next(item, source))
+      {
+        entries.push_back(item.entry);
+        cursor = item.key;
+      }
+      if(failed)
+      {
+        message.reply(status_codes::ServiceUnavailable);
+        return;
+      }
+      if(entries.size() < count)
+        cursor.clear();
+
+      message.reply(status_codes::OK, value::object(prop_vals_t {
+          make_pair(updates, value::array(entries)),
+          make_pair(read_updates_cursor_prop, value::string(cursor))}));
+      return;
+  }
+
   // If the message gave a malformed request, return a BadRequest
   message.reply(status_codes::BadRequest);
   return;
@@ -424,12 +1494,23 @@ void handle_post(http_request message) {
       string partition = data_properties[auth_table_partition_prop];
       string row = data_properties[auth_table_row_prop];
 
-      // If GetUpdateToken was successful, check if entry exists in BasicServer
+      // AuthServer returns the user's DataTable entry along with the token,
+      // which shows it exists. Only if it did not, check with BasicServer.
+      string etag {};
       pair<status_code, value> basic_result
       {
-        do_request (methods::GET,
-                    basic_url + read_entity + "/" + data_table_name + "/" + partition + "/" + row)
+        status_codes::OK, get_json_object_prop_val(auth_result.second, update_data_entity_prop)
       };
+      if (basic_result.second.is_object())
+      {
+        etag = get_json_object_prop(auth_result.second, update_data_etag_prop);
+      }
+      else
+      {
+        basic_result = do_conditional_request (methods::GET,
+                                               basic_url + read_entity + "/" + data_table_name + "/" + partition + "/" + row,
+                                               value {}, "", "", etag);
+      }
       cout << "BasicServer entry response " << basic_result.first << endl;
 
       if(basic_result.first == status_codes::NotFound)
@@ -439,15 +1520,13 @@ void handle_post(http_request message) {
         return;
       }
 
-      // If the entry is found in both AuthServer and BasicServer, check if the user is already in the list
-      // of active users. If he is, do nothing. If not, add the user in.
-      std::unordered_map<string, tuple<string, string, string>>::iterator active_user = active_users.find(username);
+      // If the entry is found in both AuthServer and BasicServer, add the user to the list
+      // of active users. If he is already there, his existing session is kept.
+      add_user(username, token, partition, row);
 
-      if(active_user == active_users.end())
-      {
-        cout << "The user never had an active session. He will be added to the list of active users.\n";
-        add_user(username, token, partition, row);
-      }
+      // Keep the entity just read, so the user's first change need not read it again
+      if(basic_result.first == status_codes::OK)
+        cache_entity(username, basic_result.second, etag);
 
       // After all of these, signing in is finished and successful. Return status code "OK" and the update token
       if(auth_result.first == status_codes::OK && basic_result.first == status_codes::OK)
@@ -480,10 +1559,8 @@ void handle_post(http_request message) {
 
       string username = paths[1];
 
-      // Find the user in the list of active users.
-      std::unordered_map<string, tuple<string, string, string>>::iterator active_user = active_users.find(username);
-
-      if(active_user == active_users.end())
+      // Remove the user from the list of active users, if he is there.
+      if(!remove_user(username))
       {
         cout << "The user never had an active session.\n";
         message.reply(status_codes::NotFound);
@@ -491,7 +1568,6 @@ void handle_post(http_request message) {
       }
       else
       {
-        remove_user(username);
         cout << "Signing Off was successful!\n";
         message.reply(status_codes::OK);
         return;
@@ -536,86 +1612,55 @@ void handle_put(http_request message) {
         string friend_country {paths[2]};
         string friend_name {paths[3]};
 
-        std::unordered_map<string, tuple<string, string, string>>::iterator active_user = active_users.find(user_name);
+        Session user_session {};
 
-        if(active_user == active_users.end()) {
+        if(!get_user(user_name, user_session)) {
             cout << "The user never had an active session.\n";
             message.reply(status_codes::Forbidden);
             return;
         }
 
-        tuple<string, string, string> user_properties = get_user(user_name);
-        cout << "\tUser token: " << get<0>(user_properties) << endl;
-        cout << "\tUser partition: " << get<1>(user_properties) << endl;
-        cout << "\tUser row: " << get<2>(user_properties) << endl;
+        string user_token = user_session.token();
+        string user_partition = user_session.partition();
+        string user_row = user_session.row();
+        cout << "\tUser token: " << user_token << endl;
+        cout << "\tUser partition: " << user_partition << endl;
+        cout << "\tUser row: " << user_row << endl;
 
-        string user_token = get<0>(user_properties);
-        string user_partition = get<1>(user_properties);
-        string user_row = get<2>(user_properties);
 
+        // If the user has an active session, add a friend to their friends list
+        bool added {false};
+        std::shared_ptr<const UserEntity> entity {};
+        status_code friend_result {change_entity(user_name, user_session,
+          [&friend_country, &friend_name, &added] (const UserEntity& current, prop_str_vals_t& props) -> bool
+          {
+            FriendSet friend_set {current.friends};
+            added = friend_set.add(friend_country, friend_name);
+            if (!added) {
+                cout << "Friend " + friend_name + " is already on friends list\n";
+                return false;
+            }
+            cout << "Friend was not on list -- added friend, now " << friend_set.size() << " friends\n";
 
-        pair<status_code, value> signed_on_result
-        {
-        do_request (methods::GET,
-                    basic_url + read_entity_auth + "/" + data_table_name + "/" + user_token + "/" + user_partition + "/" + user_row)
-        };
-        cout << "BasicServer access response " << signed_on_result.first << endl;
+            // Update the user's friend list
+            cout << "Adding friend: " << friend_country << ";" << friend_name << endl;
+            props.push_back(make_pair(friends, friend_set.to_string()));
+            return true;
+          }, entity)};
 
-        if(signed_on_result.first == status_codes::BadRequest || signed_on_result.first == status_codes::NotFound) {
-            cout << "Getting user's status to signed in, authorized, was unsuccessful.\n";
+        if(friend_result == status_codes::NotFound) {
             message.reply(status_codes::NotFound);
             return;
         }
 
-        unordered_map<string, string> data_properties = unpack_json_object(signed_on_result.second);
-
-        for(auto it = data_properties.begin(); it != data_properties.end(); ++it) {
-            cout << "\tData Property " << it->first << ": " << it->second << "\n"; 
-        }
-
-        // If the user has an active session, get the user's friend list from DataTable, authorized.
-        string friend_list = data_properties[friends];
-
-        //If the user has an active session, add a friend to their friends list
-        auto compare = make_pair(friend_country, friend_name);
-
-        vector<pair<string, string>> friend_vector = parse_friends_list(friend_list);
-
-        bool friend_found = false;
-        for(auto it = friend_vector.begin(); it != friend_vector.end(); ++it) {
-            if (it->first == friend_country && it->second == friend_name) {
-
-                cout << "Friend " + it-> second + " is already on friends list\n";
-                friend_found = true;
-                message.reply(status_codes::OK);
-                return;
-            }
-        }
-
-        if(!friend_found) {
-            cout<< "Friend was not on list -- adding friend to vector\n";
-            friend_vector.push_back(make_pair(friend_country, friend_name));
-            cout << "Current friends in vector :" << endl;
-            for(auto it = friend_vector.begin(); it != friend_vector.end(); ++it) {
-                cout << "\t" + it->first + ";" + it->second << endl;
+        if(friend_result == status_codes::OK) {
+            if (added) {
+                note_friends_changed(user_partition, user_row, entity->friends);
+                if (!update_followers(FollowerChange {0, add_to_set, friend_country, friend_name, user_partition, user_row})) {
+                    message.reply(status_codes::ServiceUnavailable);
+                    return;
+                }
             }
-        }
-
-
-        friend_list = friends_list_to_string(friend_vector);
-        value updates_friend {build_json_value(friends, friend_list)};
-        
-        // Update the user's friend list
-        cout << "Adding friend: " << friend_country << ";" << friend_name << endl;
-
-        pair<status_code, value> friend_result
-        {
-          do_request(methods::PUT,
-                basic_url + update_entity + "/" + data_table_name + "/" + user_partition + "/" + user_row,updates_friend)
-        };
-        cout << "BasicServer access response: " << friend_result.first << endl;
-
-        if(friend_result.first == status_codes::OK) {
             cout << "Adding friend " + friend_name + " was successful\n";
             message.reply(status_codes::OK);
             return;
@@ -642,110 +1687,160 @@ void handle_put(http_request message) {
         string friend_country {paths[2]};
         string friend_name {paths[3]};
 
-        std::unordered_map<string, tuple<string, string, string>>::iterator active_user = active_users.find(user_name);
+        Session user_session {};
 
-        if(active_user == active_users.end()) {
+        if(!get_user(user_name, user_session)) {
             cout << "The user never had an active session.\n";
             message.reply(status_codes::Forbidden);
             return;
         }
 
-        tuple<string, string, string> user_properties = get_user(user_name);
-        cout << "\tUser token: " << get<0>(user_properties) << endl;
-        cout << "\tUser partition: " << get<1>(user_properties) << endl;
-        cout << "\tUser row: " << get<2>(user_properties) << endl;
+        string user_token = user_session.token();
+        string user_partition = user_session.partition();
+        string user_row = user_session.row();
+        cout << "\tUser token: " << user_token << endl;
+        cout << "\tUser partition: " << user_partition << endl;
+        cout << "\tUser row: " << user_row << endl;
 
-        string user_token = get<0>(user_properties);
-        string user_partition = get<1>(user_properties);
-        string user_row = get<2>(user_properties);
+        // Parse through the friend list and erase friend properties if found
+        bool removed {false};
+        std::shared_ptr<const UserEntity> entity {};
+        status_code friend_result {change_entity(user_name, user_session,
+          [&friend_country, &friend_name, &removed] (const UserEntity& current, prop_str_vals_t& props) -> bool
+          {
+            FriendSet friend_set {current.friends};
+            removed = friend_set.remove(friend_country, friend_name);
+            if (!removed) {
+              cout << "Friend was not on friend list to begin with\n";
+              return false;
+            }
+            cout << "Friend found -- removed friend, now " << friend_set.size() << " friends\n";
 
-        pair<status_code, value> signed_on_result
-        {
-        do_request (methods::GET,
-                    basic_url + read_entity_auth + "/" + data_table_name + "/" + user_token + "/" + user_partition + "/" + user_row)
-        };
-        cout << "BasicServer access response " << signed_on_result.first << endl;
+            // Update the user's friend list
+            cout << "Removing friend " << friend_country << ";" << friend_name << endl;
+            props.push_back(make_pair(friends, friend_set.to_string()));
+            return true;
+          }, entity)};
 
-        if(signed_on_result.first == status_codes::BadRequest || signed_on_result.first == status_codes::NotFound) {
-            cout << "Getting user's status to signed in, authorized, was unsuccessful.\n";
+        if(friend_result == status_codes::NotFound) {
             message.reply(status_codes::NotFound);
             return;
         }
 
-        unordered_map<string, string> data_properties = unpack_json_object(signed_on_result.second);
-
-        for(auto it = data_properties.begin(); it != data_properties.end(); ++it) {
-            cout << "\tData Property " << it->first << ": " << it->second << "\n"; 
+        if(friend_result == status_codes::OK) {
+            if (removed) {
+                note_friends_changed(user_partition, user_row, entity->friends);
+                if (!update_followers(FollowerChange {0, remove_from_set, friend_country, friend_name, user_partition, user_row})) {
+                    message.reply(status_codes::ServiceUnavailable);
+                    return;
+                }
+            }
+            cout << "Removing friend " + friend_name + " was successful\n";
+            message.reply(status_codes::OK);
+            return;
         }
+    }
 
-        // If the user has an active session, get the user's friend list from DataTable, authorized.
-        string friend_list = data_properties[friends];
-
-        // Parse through the friend list and erase friend properties if found
-        vector<pair<string, string>> friend_vector {parse_friends_list(friend_list)};
+    ////////////////////////////////////////////////////////////////
+    //                                                            //
+    //                       ASSIGNMENT # 3                       //
+    //                End of Angel's code - UnFriend              //
+    //                                                            //
+    ////////////////////////////////////////////////////////////////
 
-        //Output all the friends from the vector
-        cout << "Initial vector of friends" << endl;
-        for(auto it = friend_vector.begin(); it != friend_vector.end(); ++it) {
-          cout << "\tFriend: " << it->second << " from " << it->first << endl;
+    /*
+      Add and remove many friends at once, e.g. to import a contact list.
+      The JSON body has friends lists (in the Friends format) to
+      remove under "Remove" and to add under "Add"; either may be
+      omitted. Removals are applied before additions, and the whole
+      batch is written in one conditional write. Replies with the
+      number of friends actually added and removed.
+     */
+    if (paths[0] == bulk_friends) {
+
+        if (paths.size() < 2) {
+            message.reply(status_codes::BadRequest);
+            return;
         }
+        string user_name {paths[1]};
 
-        bool friend_is_found = false;
-        for(auto it = friend_vector.begin(); it != friend_vector.end(); ++it) {
-            if (it->first == friend_country && it->second == friend_name) {
-                cout << "Friend found\n";
-                friend_vector.erase(it);
-                friend_is_found = true;
-                break;
-            }
-        }
-        if(!friend_is_found)
-        {
-          cout << "Friend was not on friend list to begin with\n";
-          message.reply(status_codes::OK);
-          return;
-        }
+        Session user_session {};
 
-        //Output all the friends from the vector
-        cout << "Final vector of friends" << endl;
-        for(auto it = friend_vector.begin(); it != friend_vector.end(); ++it) {
-          cout << "\tFriend: " << it->second << " from " << it->first << endl;
+        if(!get_user(user_name, user_session)) {
+            cout << "The user never had an active session.\n";
+            message.reply(status_codes::Forbidden);
+            return;
         }
 
-        friend_list = friends_list_to_string(friend_vector);
-
-        cout << "Final string of friends: " << friend_list << endl;
-
-
-        value updates_friend {build_json_value(friends, friend_list)};
+        unordered_map<string, string> batch = get_json_body(message);
+        friends_list_t to_add {};
+        friends_list_t to_remove {};
+        try {
+            to_add = parse_friends_list(batch[bulk_add_prop]);
+            to_remove = parse_friends_list(batch[bulk_remove_prop]);
+        }
+        catch (const std::invalid_argument& e) {
+            cout << e.what() << endl;
+            message.reply(status_codes::BadRequest);
+            return;
+        }
 
-        // Update the user's friend list
+        friends_list_t added {};
+        friends_list_t removed {};
+        std::shared_ptr<const UserEntity> entity {};
+        status_code bulk_result {change_entity(user_name, user_session,
+          [&to_add, &to_remove, &added, &removed] (const UserEntity& current, prop_str_vals_t& props) -> bool
+          {
+            // Collected afresh on every attempt, since a retry starts from a newer entity
+            added.clear();
+            removed.clear();
+            FriendSet friend_set {current.friends};
+            for (const auto& f : to_remove) {
+                if (friend_set.remove(f.first, f.second))
+                    removed.push_back(f);
+            }
+            for (const auto& f : to_add) {
+                if (friend_set.add(f.first, f.second))
+                    added.push_back(f);
+            }
+            cout << "Bulk change: " << added.size() << " added, " << removed.size() << " removed, now "
+                 << friend_set.size() << " friends\n";
+            if (added.empty() && removed.empty())
+                return false;
+            props.push_back(make_pair(friends, friend_set.to_string()));
+            return true;
+          }, entity)};
 
-        cout << "Removing friend " << friend_country << ";" << friend_name << endl;
-        pair<status_code, value> friend_result
-        {
-            do_request(methods::PUT,
-                        basic_url + update_entity + "/" + data_table_name + "/" + user_partition + "/" + user_row,updates_friend)
-        };
-        cout << "BasicServer access response: " << friend_result.first << endl;
+        if(bulk_result == status_codes::NotFound) {
+            message.reply(status_codes::NotFound);
+            return;
+        }
 
-        if(friend_result.first == status_codes::OK) {
-            cout << "Removing friend " + friend_name + " was successful\n";
-            message.reply(status_codes::OK);
+        if(bulk_result == status_codes::OK) {
+            if (!added.empty() || !removed.empty())
+                note_friends_changed(user_session.partition(), user_session.row(), entity->friends);
+            // A friend both removed and added ends up on the list, so needs only the add
+            std::set<pair<string,string>> added_set {added.begin(), added.end()};
+            vector<FollowerChange> changes {};
+            for (const auto& f : removed) {
+                if (added_set.count(f) == 0)
+                    changes.push_back(FollowerChange {0, remove_from_set, f.first, f.second,
+                                                      user_session.partition(), user_session.row()});
+            }
+            for (const auto& f : added)
+                changes.push_back(FollowerChange {0, add_to_set, f.first, f.second,
+                                                  user_session.partition(), user_session.row()});
+            if (!update_followers_bulk(changes)) {
+                message.reply(status_codes::ServiceUnavailable);
+                return;
+            }
+            message.reply(status_codes::OK, value::object(prop_vals_t {
+                make_pair(bulk_add_prop, value::number(static_cast<uint64_t>(added.size()))),
+                make_pair(bulk_remove_prop, value::number(static_cast<uint64_t>(removed.size())))}));
             return;
         }
-        // find friend that is to be removed in list and remove from vector
-        // call friends_list_to_string and convert back into string
-        // return the new friend list string
     }
 
-    ////////////////////////////////////////////////////////////////
-    //                                                            //
-    //                       ASSIGNMENT # 3                       //
-    //                End of Angel's code - UnFriend              //
-    //                                                            //
-    ////////////////////////////////////////////////////////////////
-
     ////////////////////////////////////////////////////////////////
     //                                                            //
     //                       ASSIGNMENT # 3                       //
@@ -758,88 +1853,70 @@ void handle_put(http_request message) {
         string user_name {paths[1]};
         string status_up {paths[2]};
 
-        std::unordered_map<string, tuple<string, string, string>>::iterator active_user = active_users.find(user_name);
+        Session user_session {};
 
-        if(active_user == active_users.end()) {
+        if(!get_user(user_name, user_session)) {
             cout << "The user never had an active session.\n";
             message.reply(status_codes::Forbidden);
             return;
         }
 
-        tuple<string, string, string> user_properties = get_user(user_name);
-        cout << "\tUser token: " << get<0>(user_properties) << endl;
-        cout << "\tUser partition: " << get<1>(user_properties) << endl;
-        cout << "\tUser row: " << get<2>(user_properties) << endl;
-
-        string user_token = get<0>(user_properties);
-        string user_partition = get<1>(user_properties);
-        string user_row = get<2>(user_properties);
-
-        pair<status_code, value> signed_on_result
-        {
-        do_request (methods::GET,
-                    basic_url + read_entity_auth + "/" + data_table_name + "/" + user_token + "/" + user_partition + "/" + user_row)
-        };
-        cout << "BasicServer access response " << signed_on_result.first << endl;
+        string user_token = user_session.token();
+        string user_partition = user_session.partition();
+        string user_row = user_session.row();
+        cout << "\tUser token: " << user_token << endl;
+        cout << "\tUser partition: " << user_partition << endl;
+        cout << "\tUser row: " << user_row << endl;
+
+        // Append the status to the user's updates and set it as their status, in one write.
+        // Pages spilled from the updates ring are archived before the write that drops them.
+        bool archive_failed {false};
+        std::shared_ptr<const UserEntity> entity {};
+        status_code update_stat_res {change_entity(user_name, user_session,
+          [&status_up, &user_partition, &user_row, &archive_failed] (const UserEntity& current, prop_str_vals_t& props) -> bool
+          {
+            FeedAppend feed {append_status(current.updates, status_up)};
+            if (!feed.pages.empty()) {
+                if (!archive_feed_pages(user_partition, user_row, current.archived_pages, feed.pages)) {
+                    archive_failed = true;
+                    return false;
+                }
+                props.push_back(make_pair(updates_archived_prop,
+                                          std::to_string(current.archived_pages + feed.pages.size())));
+            }
+            props.push_back(make_pair(updates, feed.updates));
+            props.push_back(make_pair(status, status_up));
+            return true;
+          }, entity)};
 
-        if(signed_on_result.first == status_codes::BadRequest || signed_on_result.first == status_codes::NotFound) {
-            cout << "Getting user's status to signed in, authorized, was unsuccessful.\n";
+        if(update_stat_res == status_codes::NotFound) {
             message.reply(status_codes::NotFound);
             return;
         }
 
-        unordered_map<string, string> data_properties = unpack_json_object(signed_on_result.second);
-
-        for(auto it = data_properties.begin(); it != data_properties.end(); ++it) {
-            cout << "\tData Property " << it->first << ": " << it->second << "\n"; 
+        if(archive_failed) {
+            message.reply(status_codes::ServiceUnavailable);
+            return;
         }
 
-        // Update the status of the user.
-        value update_stat {build_json_value(status, status_up)};
-        value friends_json {build_json_value(friends, data_properties[friends])};
-
-        string update_string {data_properties[updates]};
-        update_string += status_up + "\n";
-
-        value updateString {build_json_value(updates, update_string)};
-
-        pair<status_code, value> update_res
-        {
-            do_request(methods::PUT,
-                        basic_url + update_entity + "/" + data_table_name + "/" + user_partition + "/" + user_row,updateString)
-        };
-        cout << "BasicServer access response: " << update_res.first << endl;
-
-        pair<status_code, value> update_stat_res
-        {
-            do_request(methods::PUT,
-                        basic_url + update_entity + "/" + data_table_name + "/" + user_partition + "/" + user_row,update_stat)
-        };
-        cout << "BasicServer access response: " << update_stat_res.first << endl;
-
-        pair<status_code, value> push_up_stat_res {};
-
-        // Call PushServer to push the user's status to all his/her friends.
-        try 
-        {
-            push_up_stat_res = 
-            do_request(methods::POST,
-                        push_url + push_status + "/" + user_partition + "/" + user_row + "/" + status_up, friends_json)
-            ;
-            cout << "PushServer access response: " << push_up_stat_res.first << endl;
-        } 
-        catch (const web::uri_exception& e) 
-        {
-            message.reply(status_codes::ServiceUnavailable);
+        // A status that was not stored must not reach anyone's friends
+        if(update_stat_res != status_codes::OK) {
+            message.reply(update_stat_res);
             return;
         }
 
-        if(update_stat_res.first == status_codes::OK && push_up_stat_res.first == status_codes::OK) {
-            cout << "Update Status " + status_up + " was successful\n";
-            message.reply(status_codes::OK);
+        // Hand the push to all his/her friends to PushServer, which
+        // accepts it at once and pushes it in the background, or
+        // spool it until PushServer can take it.
+        if(!hand_off_push(user_partition, user_row, status_up, entity ? entity->friends : string {})) {
+            message.reply(status_codes::ServiceUnavailable);
             return;
         }
 
+        cout << "Update Status " + status_up + " was successful\n";
+        message.reply(status_codes::OK);
+        return;
+
     }
 
     ////////////////////////////////////////////////////////////////
@@ -874,9 +1951,37 @@ void handle_delete(http_request message) {
   Wait for a carriage return, then shut the server down.
  */
 int main (int argc, char const * argv[]) {
+  for (int i {1}; i < argc; i++) {
+    string arg {argv[i]};
+    if (arg == "--compact-friends")
+      compact_friends_mode = true;
+    else {
+      cout << "Usage: UserServer [--compact-friends]" << endl;
+      return 1;
+    }
+  }
+  if (compact_friends_mode)
+    cout << "UserServer: Writing friends lists in the compact form" << endl;
+
   cout << "UserServer: Parsing connection string" << endl;
   //table_cache.init (storage_connection_string);
 
+  std::size_t restored {active_users.load(session_file, SessionStore::unix_now())};
+  cout << "UserServer: Restored " << restored << " session(s) from " << session_file << endl;
+
+  vector<PushJob> unsent {};
+  if (!push_spool.open(unsent)) {
+    cout << "UserServer: Cannot use push spool directory " << push_spool_dir << endl;
+    return 1;
+  }
+  spooled_pushes.assign(unsent.begin(), unsent.end());
+  cout << "UserServer: " << unsent.size() << " spooled push(es) waiting for PushServer" << endl;
+
+  if (!open_follower_spool()) {
+    cout << "UserServer: Cannot use follower spool directory " << follower_spool_dir << endl;
+    return 1;
+  }
+
   cout << "UserServer: Opening listener" << endl;
   http_listener listener {user_url};
   listener.support(methods::GET, &handle_get);
@@ -885,11 +1990,85 @@ int main (int argc, char const * argv[]) {
   //listener.support(methods::DEL, &handle_delete);
   listener.open().wait(); // Wait for listener to complete starting
 
+  /*
+    Evict sessions whose tokens have lapsed, once a second, so the
+    session list does not grow with users who never sign off.
+    Checkpoint the sessions every session_checkpoint_secs.
+   */
+  std::mutex expiry_mutex;
+  std::condition_variable expiry_cv;
+  bool stopping {false};
+  std::thread expiry_thread {[&] ()
+  {
+    std::unique_lock<std::mutex> lock {expiry_mutex};
+    int secs_since_checkpoint {0};
+    while (!stopping) {
+      expiry_cv.wait_for(lock, std::chrono::seconds(1));
+      std::size_t evicted {active_users.expire(SessionStore::unix_now())};
+      if (evicted > 0)
+        cout << "UserServer: " << evicted << " session(s) expired" << endl;
+      if (++secs_since_checkpoint >= session_checkpoint_secs) {
+        checkpoint_sessions();
+        secs_since_checkpoint = 0;
+      }
+    }
+  }};
+
+  // Offer spooled pushes to PushServer, and make spooled follower index changes, every push_spool_retry_secs
+  std::thread push_spool_thread {[&] ()
+  {
+    std::unique_lock<std::mutex> lock {expiry_mutex};
+    while (!stopping) {
+      expiry_cv.wait_for(lock, std::chrono::seconds(push_spool_retry_secs));
+      if (stopping)
+        break;
+      lock.unlock();
+      replay_spooled_pushes();
+      replay_follower_changes();
+      lock.lock();
+    }
+  }};
+
+  // Load the friend graph now, then reload it every friend_graph_reload_secs
+  std::thread friend_graph_thread {[&] ()
+  {
+    std::unique_lock<std::mutex> lock {expiry_mutex};
+    int64_t wait_secs {0};
+    int64_t retry_secs {0};
+    while (!stopping) {
+      if (wait_secs > 0) {
+        expiry_cv.wait_for(lock, std::chrono::seconds(wait_secs));
+        if (stopping)
+          break;
+      }
+      lock.unlock();
+      bool loaded {load_friend_graph()};
+      lock.lock();
+      if (loaded) {
+        retry_secs = 0;
+        wait_secs = friend_graph_reload_secs;
+      }
+      else {
+        retry_secs = retry_secs == 0 ? friend_graph_retry_secs : std::min(2 * retry_secs, friend_graph_reload_secs);
+        wait_secs = retry_secs;
+      }
+    }
+  }};
+
   cout << "Enter carriage return to stop UserServer." << endl;
   string line;
   getline(std::cin, line);
 
   // Shut it down
   listener.close().wait();
+  {
+    std::lock_guard<std::mutex> lock {expiry_mutex};
+    stopping = true;
+  }
+  expiry_cv.notify_all();
+  expiry_thread.join();
+  push_spool_thread.join();
+  friend_graph_thread.join();
+  checkpoint_sessions();
   cout << "UserServer closed" << endl;
 }
\ No newline at end of file
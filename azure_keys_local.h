@@ -0,0 +1,20 @@
+#ifndef AZURE_KEYS_H
+#define AZURE_KEYS_H
+
+#include <string>
+
+/*
+  Keys for running against LocalTableServer instead of a real
+  Azure storage account. Copy this file to azure_keys.h to use it.
+
+  The account name and key are the well-known storage emulator
+  credentials, which LocalTableServer uses by default.
+ */
+const std::string storage_connection_string {"DefaultEndpointsProtocol=http;"
+	"AccountName=devstoreaccount1;"
+	"AccountKey=Eby8vdM02xNOcqFlqUwJPLlmEtlCDXJ1OUzFT50uSRZ6IFsuFq2UVErCz4I6tq/K1SZFPTOtr/KBHBeksoGMGw==;"
+	"TableEndpoint=http://127.0.0.1:10002/devstoreaccount1"};
+
+const std::string tables_endpoint {"http://127.0.0.1:10002/devstoreaccount1"};
+
+#endif
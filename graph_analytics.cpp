@@ -0,0 +1,595 @@
+/*
+  Offline analytics over the friend graph in DataTable.
+
+  Reads DataTable straight from table storage, a segment of up to
+  --segment entities at a time, and reports:
+
+    - users and edges (a friend on a user's list is an edge from the
+      user), self-friendships and malformed friends lists
+    - the out- and in-degree distributions, in power-of-two buckets
+    - reciprocity: the share of edges whose reverse is also an edge
+    - connected components of the graph taken as undirected: how
+      many, the largest, and their size distribution
+    - the time each phase took and the throughput in edges per second
+
+  The work is spread over --threads threads. While the main thread
+  fetches the next segment, the threads parse the segments already
+  fetched, giving each user a dense integer id from a sharded table.
+  The graph is then laid out in compressed sparse rows, and the
+  threads take blocks of users in turn to count in-degrees and
+  reciprocal edges and to join components with a lock-free
+  union-find.
+
+  Usage:
+    graph_analytics [--threads T] [--segment N] [--report FILE]
+
+  The report (default graph_analytics.report) is one "name value"
+  line per figure; a distribution is a line of bucket:count pairs,
+  where bucket 0 counts zeros and bucket k counts values from 2^(k-1)
+  to 2^k - 1.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <was/common.h>
+#include <was/storage_account.h>
+#include <was/table.h>
+
+#include "ClientUtils.h"
+#include "FriendsCodec.h"
+
+#include "azure_keys.h"
+
+using azure::storage::cloud_storage_account;
+using azure::storage::cloud_table;
+using azure::storage::cloud_table_client;
+using azure::storage::continuation_token;
+using azure::storage::storage_exception;
+using azure::storage::table_entity;
+using azure::storage::table_query;
+using azure::storage::table_query_segment;
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::vector;
+
+using steady_clock = std::chrono::steady_clock;
+
+const string data_table_name {"DataTable"};
+const string friends {"Friends"};
+
+// Users handed to a thread at a time in the analysis passes
+constexpr uint32_t analysis_block {1024};
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                     User ids                    //
+//                                                 //
+/////////////////////////////////////////////////////
+
+/*
+  Dense ids for "Partition;Row" keys, handed out in the order keys
+  are first seen. The keys are split by hash over shards, each with
+  its own lock, so parser threads seldom wait on one another.
+ */
+class ShardedIds {
+private:
+  static constexpr std::size_t shards {64};
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_map<string,uint32_t> ids;
+  };
+
+  vector<Shard> table;
+  std::atomic<uint32_t> next_id;
+
+public:
+  ShardedIds () :
+    table (shards),
+    next_id {0}
+    {}
+
+  uint32_t intern (const string& key) {
+    Shard& shard (table[std::hash<string> {}(key) % shards]);
+    std::lock_guard<std::mutex> lock {shard.mutex};
+    auto it (shard.ids.find(key));
+    if (it != shard.ids.end())
+      return it->second;
+    uint32_t id {next_id.fetch_add(1)};
+    shard.ids.emplace(key, id);
+    return id;
+  }
+
+  uint32_t size () const { return next_id.load(); }
+};
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                 Streaming parse                 //
+//                                                 //
+/////////////////////////////////////////////////////
+
+// One user's entity, as much of it as the analysis reads
+struct UserRecord {
+  string partition;
+  string row;
+  string friends_list;
+};
+
+/*
+  Segments fetched and waiting to be parsed. The queue is bounded, so
+  a fetch that outruns the parsers waits rather than holding the
+  whole table in memory.
+ */
+class SegmentQueue {
+private:
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<vector<UserRecord>> segments;
+  std::size_t capacity;
+  bool closed;
+
+public:
+  explicit SegmentQueue (std::size_t cap) :
+    mutex {},
+    changed {},
+    segments {},
+    capacity {cap},
+    closed {false}
+    {}
+
+  void push (vector<UserRecord> segment) {
+    std::unique_lock<std::mutex> lock {mutex};
+    changed.wait(lock, [this] { return segments.size() < capacity; });
+    segments.push_back(std::move(segment));
+    changed.notify_all();
+  }
+
+  // No more segments will be pushed
+  void close () {
+    std::lock_guard<std::mutex> lock {mutex};
+    closed = true;
+    changed.notify_all();
+  }
+
+  // False once the queue is closed and empty
+  bool pop (vector<UserRecord>& segment) {
+    std::unique_lock<std::mutex> lock {mutex};
+    changed.wait(lock, [this] { return closed || ! segments.empty(); });
+    if (segments.empty())
+      return false;
+    segment = std::move(segments.front());
+    segments.pop_front();
+    changed.notify_all();
+    return true;
+  }
+};
+
+// A user's friends as ids, sorted and without duplicates
+struct ParsedRow {
+  uint32_t user;
+  vector<uint32_t> friends;
+};
+
+// What one parser thread produced
+struct ParseResult {
+  vector<ParsedRow> rows;
+  uint64_t edges;
+  uint64_t malformed;
+};
+
+string user_key (const string& partition, const string& row) {
+  string key {partition};
+  key.push_back(pair_delimiter);
+  key.append(row);
+  return key;
+}
+
+void parse_worker (SegmentQueue& queue, ShardedIds& ids, ParseResult& result) {
+  vector<UserRecord> segment {};
+  while (queue.pop(segment)) {
+    for (const UserRecord& r : segment) {
+      ParsedRow parsed {ids.intern(user_key(r.partition, r.row)), {}};
+      try {
+        // Lists written in the compact form (see FriendsCodec.h) are read in the text form
+        string decoded {};
+        const string& friends_list (is_compact_friends(r.friends_list) ? (decoded = friends_to_text(r.friends_list)) : r.friends_list);
+        // A friend's country, delimiter and name lie together in the list, which is just their key
+        for (const auto& f : parse_friends_view(friends_list))
+          parsed.friends.push_back(ids.intern(string (f.first.data, f.second.data + f.second.size - f.first.data)));
+      }
+      catch (const std::invalid_argument&) {
+        result.malformed++;
+        parsed.friends.clear();
+      }
+      std::sort(parsed.friends.begin(), parsed.friends.end());
+      parsed.friends.erase(std::unique(parsed.friends.begin(), parsed.friends.end()), parsed.friends.end());
+      result.edges += parsed.friends.size();
+      result.rows.push_back(std::move(parsed));
+    }
+  }
+}
+
+/*
+  Fetch DataTable a segment at a time into queue, closing it at the
+  end. Returns the number of entities read, or throws
+  storage_exception if the table cannot be read.
+ */
+uint64_t stream_table (cloud_table& table, int segment_size, SegmentQueue& queue) {
+  table_query query {};
+  query.set_take_count(segment_size);
+  query.set_select_columns(vector<utility::string_t> {friends});
+
+  uint64_t entities {0};
+  continuation_token token {};
+  try {
+    do {
+      table_query_segment segment {table.execute_query_segmented(query, token)};
+      vector<UserRecord> records {};
+      records.reserve(segment.results().size());
+      for (const table_entity& e : segment.results()) {
+        auto prop (e.properties().find(friends));
+        records.push_back(UserRecord {e.partition_key(), e.row_key(),
+                                      prop == e.properties().end() ? string {} : prop->second.string_value()});
+      }
+      entities += records.size();
+      queue.push(std::move(records));
+      token = segment.continuation_token();
+    } while (! token.empty());
+  }
+  catch (...) {
+    queue.close();
+    throw;
+  }
+  queue.close();
+  return entities;
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                     Analysis                    //
+//                                                 //
+/////////////////////////////////////////////////////
+
+/*
+  The friend graph in compressed sparse row form: the friends of
+  user u are targets[offsets[u]] .. targets[offsets[u + 1] - 1],
+  sorted ascending
+ */
+struct CsrGraph {
+  vector<uint64_t> offsets;
+  vector<uint32_t> targets;
+
+  uint32_t users () const { return static_cast<uint32_t>(offsets.size() - 1); }
+};
+
+/*
+  Lay the parsed rows out as one CSR graph over users ids. Each
+  thread copies the rows it parsed, into places fixed beforehand by
+  the out-degrees.
+ */
+CsrGraph build_csr (vector<ParseResult>& results, uint32_t users) {
+  CsrGraph g {vector<uint64_t>(static_cast<std::size_t>(users) + 1, 0), {}};
+  for (const ParseResult& r : results)
+    for (const ParsedRow& row : r.rows)
+      g.offsets[row.user + 1] = row.friends.size();
+  for (uint32_t u {0}; u < users; u++)
+    g.offsets[u + 1] += g.offsets[u];
+  g.targets.resize(g.offsets[users]);
+
+  vector<std::thread> threads {};
+  for (ParseResult& r : results)
+    threads.push_back(std::thread {[&g, &r] {
+          for (ParsedRow& row : r.rows) {
+            std::copy(row.friends.begin(), row.friends.end(), g.targets.begin() + g.offsets[row.user]);
+            vector<uint32_t> {}.swap(row.friends);
+          }
+        }});
+  for (auto& t : threads)
+    t.join();
+  return g;
+}
+
+/*
+  Union-find whose operations may run concurrently on many threads
+  without a lock. A root is only ever linked, by compare-and-swap,
+  under a root with a smaller id, so no cycle can form; finds halve
+  the paths they walk.
+ */
+class ConcurrentUnionFind {
+private:
+  vector<std::atomic<uint32_t>> parent;
+
+public:
+  explicit ConcurrentUnionFind (uint32_t n) :
+    parent (n)
+  {
+    for (uint32_t i {0}; i < n; i++)
+      parent[i].store(i, std::memory_order_relaxed);
+  }
+
+  uint32_t find (uint32_t x) {
+    while (true) {
+      uint32_t p {parent[x].load(std::memory_order_relaxed)};
+      if (p == x)
+        return x;
+      uint32_t gp {parent[p].load(std::memory_order_relaxed)};
+      if (gp != p)
+        parent[x].compare_exchange_weak(p, gp, std::memory_order_relaxed);
+      x = gp;
+    }
+  }
+
+  void unite (uint32_t a, uint32_t b) {
+    while (true) {
+      a = find(a);
+      b = find(b);
+      if (a == b)
+        return;
+      if (a < b)
+        std::swap(a, b);
+      uint32_t expected {a};
+      if (parent[a].compare_exchange_strong(expected, b, std::memory_order_relaxed))
+        return;
+    }
+  }
+};
+
+// Counts in power-of-two buckets: bucket 0 holds zeros, bucket k values in [2^(k-1), 2^k)
+struct Distribution {
+  vector<uint64_t> buckets;
+  uint64_t max;
+  uint64_t total;
+
+  Distribution () : buckets (65, 0), max {0}, total {0} {}
+
+  void add (uint64_t v) {
+    int bucket {0};
+    for (uint64_t x {v}; x != 0; x >>= 1)
+      bucket++;
+    buckets[bucket]++;
+    max = std::max(max, v);
+    total += v;
+  }
+
+  void merge (const Distribution& other) {
+    for (std::size_t b {0}; b < buckets.size(); b++)
+      buckets[b] += other.buckets[b];
+    max = std::max(max, other.max);
+    total += other.total;
+  }
+
+  string to_string () const {
+    string s {};
+    for (std::size_t b {0}; b < buckets.size(); b++) {
+      if (buckets[b] == 0)
+        continue;
+      if (! s.empty())
+        s.push_back(' ');
+      s += std::to_string(b) + ":" + std::to_string(buckets[b]);
+    }
+    return s;
+  }
+};
+
+struct GraphStats {
+  Distribution out_degree;
+  Distribution in_degree;
+  Distribution component_size;
+  uint64_t reciprocal_edges;
+  uint64_t self_edges;
+  uint64_t components;
+  uint64_t largest_component;
+};
+
+/*
+  Run fn (first, end) over blocks of users, handed out to nthreads
+  threads in turn, then join them
+ */
+void for_user_blocks (uint32_t users, unsigned int nthreads, const std::function<void(unsigned int, uint32_t, uint32_t)>& fn) {
+  std::atomic<uint32_t> next_block {0};
+  vector<std::thread> threads {};
+  for (unsigned int t {0}; t < nthreads; t++)
+    threads.push_back(std::thread {[&, t] {
+          while (true) {
+            uint64_t first {static_cast<uint64_t>(next_block.fetch_add(1)) * analysis_block};
+            if (first >= users)
+              return;
+            fn(t, static_cast<uint32_t>(first), static_cast<uint32_t>(std::min<uint64_t>(first + analysis_block, users)));
+          }
+        }});
+  for (auto& t : threads)
+    t.join();
+}
+
+GraphStats analyze (const CsrGraph& g, unsigned int nthreads) {
+  uint32_t users {g.users()};
+  vector<std::atomic<uint32_t>> in_degree (users);
+  for (auto& d : in_degree)
+    d.store(0, std::memory_order_relaxed);
+  ConcurrentUnionFind components {users};
+
+  // Each thread keeps its own tallies, merged once all are done
+  vector<Distribution> out_degrees (nthreads);
+  vector<uint64_t> reciprocal (nthreads, 0);
+  vector<uint64_t> self (nthreads, 0);
+
+  for_user_blocks(users, nthreads, [&] (unsigned int t, uint32_t first, uint32_t end) {
+      for (uint32_t u {first}; u < end; u++) {
+        const uint32_t* begin {g.targets.data() + g.offsets[u]};
+        const uint32_t* stop {g.targets.data() + g.offsets[u + 1]};
+        out_degrees[t].add(static_cast<uint64_t>(stop - begin));
+        for (const uint32_t* v {begin}; v != stop; ++v) {
+          in_degree[*v].fetch_add(1, std::memory_order_relaxed);
+          if (*v == u) {
+            self[t]++;
+            continue;
+          }
+          const uint32_t* back_begin {g.targets.data() + g.offsets[*v]};
+          const uint32_t* back_end {g.targets.data() + g.offsets[*v + 1]};
+          if (std::binary_search(back_begin, back_end, u))
+            reciprocal[t]++;
+          components.unite(u, *v);
+        }
+      }
+    });
+
+  GraphStats stats {};
+  for (unsigned int t {0}; t < nthreads; t++) {
+    stats.out_degree.merge(out_degrees[t]);
+    stats.reciprocal_edges += reciprocal[t];
+    stats.self_edges += self[t];
+  }
+
+  vector<uint32_t> sizes (users, 0);
+  for (uint32_t u {0}; u < users; u++) {
+    stats.in_degree.add(in_degree[u].load(std::memory_order_relaxed));
+    sizes[components.find(u)]++;
+  }
+  for (uint32_t size : sizes) {
+    if (size == 0)
+      continue;
+    stats.components++;
+    stats.largest_component = std::max<uint64_t>(stats.largest_component, size);
+    stats.component_size.add(size);
+  }
+  return stats;
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                      Main                       //
+//                                                 //
+/////////////////////////////////////////////////////
+
+double seconds_since (steady_clock::time_point start) {
+  return std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+int main (int argc, const char* argv[]) {
+  unsigned int nthreads {std::max(1u, std::thread::hardware_concurrency())};
+  int segment_size {1000};
+  string report_path {"graph_analytics.report"};
+
+  for (int i {1}; i < argc; i++) {
+    string arg {argv[i]};
+    bool has_val {i + 1 < argc};
+    if (arg == "--threads" && has_val)
+      nthreads = std::atoi(argv[++i]);
+    else if (arg == "--segment" && has_val)
+      segment_size = std::atoi(argv[++i]);
+    else if (arg == "--report" && has_val)
+      report_path = argv[++i];
+    else {
+      cerr << "Usage: graph_analytics [--threads T] [--segment N] [--report FILE]" << endl;
+      return 1;
+    }
+  }
+  // The table service returns at most 1000 entities a segment
+  if (nthreads == 0 || segment_size <= 0 || segment_size > 1000) {
+    cerr << "Need at least one thread and a segment of 1 to 1000 entities" << endl;
+    return 1;
+  }
+
+  cloud_table_client client {cloud_storage_account::parse(storage_connection_string).create_cloud_table_client()};
+  cloud_table table {client.get_table_reference(data_table_name)};
+
+  // Fetch on this thread while the parsers work through what has arrived
+  steady_clock::time_point start {steady_clock::now()};
+  ShardedIds ids {};
+  SegmentQueue queue {2 * static_cast<std::size_t>(nthreads)};
+  vector<ParseResult> results (nthreads, ParseResult {{}, 0, 0});
+  vector<std::thread> parsers {};
+  for (unsigned int t {0}; t < nthreads; t++)
+    parsers.push_back(std::thread {parse_worker, std::ref(queue), std::ref(ids), std::ref(results[t])});
+
+  uint64_t entities {0};
+  bool read_failed {false};
+  try {
+    entities = stream_table(table, segment_size, queue);
+  }
+  catch (const storage_exception& e) {
+    cerr << "Reading " << data_table_name << " failed: " << e.what() << endl;
+    read_failed = true;
+  }
+  for (auto& t : parsers)
+    t.join();
+  if (read_failed)
+    return 1;
+  double scan_secs {seconds_since(start)};
+
+  uint64_t edges {0};
+  uint64_t malformed {0};
+  for (const ParseResult& r : results) {
+    edges += r.edges;
+    malformed += r.malformed;
+  }
+
+  steady_clock::time_point build_start {steady_clock::now()};
+  CsrGraph graph {build_csr(results, ids.size())};
+  double build_secs {seconds_since(build_start)};
+
+  steady_clock::time_point analyze_start {steady_clock::now()};
+  GraphStats stats {analyze(graph, nthreads)};
+  double analyze_secs {seconds_since(analyze_start)};
+  double total_secs {seconds_since(start)};
+
+  uint64_t non_self_edges {edges - stats.self_edges};
+  vector<pair<string,string>> report {
+    make_pair("entities", std::to_string(entities)),
+    make_pair("users", std::to_string(graph.users())),
+    make_pair("edges", std::to_string(edges)),
+    make_pair("self_edges", std::to_string(stats.self_edges)),
+    make_pair("malformed_lists", std::to_string(malformed)),
+    make_pair("reciprocal_edges", std::to_string(stats.reciprocal_edges)),
+    make_pair("reciprocity", std::to_string(non_self_edges == 0 ? 0.0 :
+                                            static_cast<double>(stats.reciprocal_edges) / non_self_edges)),
+    make_pair("out_degree_max", std::to_string(stats.out_degree.max)),
+    make_pair("out_degree_mean", std::to_string(graph.users() == 0 ? 0.0 :
+                                                static_cast<double>(edges) / graph.users())),
+    make_pair("out_degree_dist", stats.out_degree.to_string()),
+    make_pair("in_degree_max", std::to_string(stats.in_degree.max)),
+    make_pair("in_degree_dist", stats.in_degree.to_string()),
+    make_pair("components", std::to_string(stats.components)),
+    make_pair("largest_component", std::to_string(stats.largest_component)),
+    make_pair("component_size_dist", stats.component_size.to_string()),
+    make_pair("threads", std::to_string(nthreads)),
+    make_pair("scan_secs", std::to_string(scan_secs)),
+    make_pair("build_secs", std::to_string(build_secs)),
+    make_pair("analyze_secs", std::to_string(analyze_secs)),
+    make_pair("total_secs", std::to_string(total_secs)),
+    make_pair("scan_edges_per_sec", std::to_string(scan_secs > 0 ? edges / scan_secs : 0.0)),
+    make_pair("edges_per_sec", std::to_string(total_secs > 0 ? edges / total_secs : 0.0))};
+
+  std::ofstream out {report_path};
+  if (! out) {
+    cerr << "Cannot open " << report_path << endl;
+    return 1;
+  }
+  for (const auto& line : report) {
+    out << line.first << " " << line.second << "\n";
+    cout << line.first << " " << line.second << endl;
+  }
+}
@@ -0,0 +1,501 @@
+/*
+  Closed-loop load generator for the UserServer social workflows.
+
+  Provisions N synthetic users in AuthTable and DataTable through
+  BasicServer's UpdateEntityAdmin, then runs a pool of worker threads
+  that each drive a weighted mix of SignOn, AddFriend, UnFriend,
+  UpdateStatus, ReadFriendList and SignOff against UserServer at a
+  target aggregate rate.
+
+  At the end, the throughput and the p50/p99/p999 latency of each
+  operation are printed.
+
+  Usage:
+    loadgen [--users N] [--threads T] [--rate OPS_PER_SEC] [--duration SECS]
+            [--mix SignOn=5,AddFriend=20,...] [--keep]
+
+  A rate of 0 runs every thread flat out. Latency is measured from the
+  time an operation was *scheduled* to start, so a server that falls
+  behind the target rate is charged for the queueing delay it causes.
+
+  Unless --keep is given, the synthetic users are deleted afterwards.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_client.h>
+#include <cpprest/json.h>
+
+#include <pplx/pplxtasks.h>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::vector;
+
+using web::http::http_request;
+using web::http::http_response;
+using web::http::method;
+using web::http::methods;
+using web::http::status_code;
+using web::http::status_codes;
+
+using web::http::client::http_client;
+
+using web::json::value;
+
+using steady_clock = std::chrono::steady_clock;
+
+constexpr const char* basic_url = "http://localhost:34568/";
+constexpr const char* user_url = "http://localhost:34572/";
+
+const string update_entity_admin {"UpdateEntityAdmin"};
+const string delete_entity_admin {"DeleteEntityAdmin"};
+
+const string auth_table_name {"AuthTable"};
+const string data_table_name {"DataTable"};
+const string auth_table_partition {"Userid"};
+
+// For UserServer
+const string sign_on {"SignOn"};
+const string sign_off {"SignOff"};
+const string add_friend {"AddFriend"};
+const string unfriend {"UnFriend"};
+const string update_status {"UpdateStatus"};
+const string read_friend_list {"ReadFriendList"};
+
+const vector<string> countries {"Canada", "Korea", "ThePhilippines", "USA"};
+
+/*
+  Operations the generator can issue, in report order
+ */
+enum op_t { op_sign_on, op_add_friend, op_unfriend, op_update_status,
+            op_read_friend_list, op_sign_off, op_count };
+
+const vector<string> op_names {sign_on, add_friend, unfriend, update_status,
+                               read_friend_list, sign_off};
+
+/*
+  Latency histogram with bounded relative error
+
+  Values (in microseconds) are bucketed by their highest set bit and
+  then linearly into sub_buckets within that power of two, so every
+  recorded value is reported with at most 1/sub_buckets relative error
+  and the histogram uses a fixed amount of memory however many
+  samples are recorded.
+ */
+class LatencyHistogram {
+private:
+  static constexpr int sub_bits {6};
+  static constexpr int sub_buckets {1 << sub_bits};
+  static constexpr int magnitudes {40};
+  vector<uint64_t> counts;
+  uint64_t total;
+  uint64_t max_value;
+
+  static int bucket_of (uint64_t v) {
+    if (v < sub_buckets)
+      return static_cast<int>(v);
+    int msb {63 - __builtin_clzll(v)};
+    int shift {msb - sub_bits};
+    return (shift + 1) * sub_buckets + static_cast<int>((v >> shift) - sub_buckets);
+  }
+
+  static uint64_t value_of (int bucket) {
+    if (bucket < sub_buckets)
+      return bucket;
+    int shift {bucket / sub_buckets - 1};
+    uint64_t sub {static_cast<uint64_t>(bucket % sub_buckets) + sub_buckets};
+    // Report the upper edge of the bucket
+    return ((sub + 1) << shift) - 1;
+  }
+
+public:
+  LatencyHistogram () :
+    counts (magnitudes * sub_buckets, 0),
+    total {0},
+    max_value {0}
+    {};
+
+  void record (uint64_t micros) {
+    int b {std::min(bucket_of(micros), static_cast<int>(counts.size()) - 1)};
+    counts[b]++;
+    total++;
+    max_value = std::max(max_value, micros);
+  }
+
+  void merge (const LatencyHistogram& other) {
+    for (vector<uint64_t>::size_type i {0}; i < counts.size(); i++)
+      counts[i] += other.counts[i];
+    total += other.total;
+    max_value = std::max(max_value, other.max_value);
+  }
+
+  uint64_t count () const { return total; }
+
+  uint64_t percentile (double p) const {
+    if (total == 0)
+      return 0;
+    uint64_t rank {static_cast<uint64_t>(std::ceil(p / 100.0 * total))};
+    if (rank == 0)
+      rank = 1;
+    uint64_t seen {0};
+    for (vector<uint64_t>::size_type i {0}; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= rank)
+        return std::min(value_of(static_cast<int>(i)), max_value);
+    }
+    return max_value;
+  }
+};
+
+/*
+  Per-thread results, merged once all workers have finished
+ */
+struct op_stats {
+  vector<LatencyHistogram> latency;
+  vector<uint64_t> errors;
+  op_stats () : latency (op_count), errors (op_count, 0) {};
+};
+
+/*
+  A synthetic user, as provisioned in AuthTable and DataTable
+ */
+struct synth_user {
+  string userid;
+  string password;
+  string partition;
+  string row;
+  bool signed_on;
+};
+
+/*
+  UserServer only accepts alphabetic user ids, so the index
+  of each synthetic user is spelled out in base 26.
+ */
+string alpha_suffix (unsigned int n) {
+  string s {};
+  do {
+    s += static_cast<char>('a' + n % 26);
+    n /= 26;
+  } while (n > 0);
+  return s;
+}
+
+vector<synth_user> make_users (unsigned int n) {
+  vector<synth_user> users {};
+  users.reserve(n);
+  for (unsigned int i {0}; i < n; i++) {
+    string suffix {alpha_suffix(i)};
+    users.push_back(synth_user {"Load" + suffix,
+                                "pw" + suffix,
+                                countries[i % countries.size()],
+                                "User" + suffix + ",Load",
+                                false});
+  }
+  return users;
+}
+
+/*
+  Issue one request and return its status code, discarding any body.
+
+  Unlike do_request () in ClientUtils, this does not log anything, so
+  that console output does not dominate the measurement. Connection
+  failures are reported as status code 0.
+ */
+status_code quiet_request (http_client& client, const method& http_method,
+                           const string& path, const value& body = value {}) {
+  http_request request {http_method};
+  request.set_request_uri(path);
+  if (body != value {})
+    request.set_body(body);
+  try {
+    http_response response {client.request(request).get()};
+    // Drain the body so the connection can be reused
+    response.content_ready().wait();
+    return response.status_code();
+  }
+  catch (const std::exception& e) {
+    return 0;
+  }
+}
+
+value string_object (const vector<pair<string,string>>& props) {
+  vector<pair<string,value>> vals {};
+  for (const auto& p : props)
+    vals.push_back(make_pair(p.first, value::string(p.second)));
+  return value::object(vals);
+}
+
+/*
+  Create (or reset) every synthetic user's AuthTable and DataTable entities
+ */
+bool provision_users (const vector<synth_user>& users) {
+  http_client basic {basic_url};
+  for (const auto& u : users) {
+    status_code code {quiet_request(basic, methods::PUT,
+                                    update_entity_admin + "/" + auth_table_name + "/" +
+                                    auth_table_partition + "/" + u.userid,
+                                    string_object({make_pair("Password", u.password),
+                                                   make_pair("DataPartition", u.partition),
+                                                   make_pair("DataRow", u.row)}))};
+    if (code != status_codes::OK) {
+      cerr << "Could not provision AuthTable entry for " << u.userid << ": " << code << endl;
+      return false;
+    }
+    code = quiet_request(basic, methods::PUT,
+                         update_entity_admin + "/" + data_table_name + "/" +
+                         u.partition + "/" + u.row,
+                         string_object({make_pair("Friends", ""),
+                                        make_pair("Status", ""),
+                                        make_pair("Updates", "")}));
+    if (code != status_codes::OK) {
+      cerr << "Could not provision DataTable entry for " << u.userid << ": " << code << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+void remove_users (const vector<synth_user>& users) {
+  http_client basic {basic_url};
+  for (const auto& u : users) {
+    quiet_request(basic, methods::DEL,
+                  delete_entity_admin + "/" + auth_table_name + "/" + auth_table_partition + "/" + u.userid);
+    quiet_request(basic, methods::DEL,
+                  delete_entity_admin + "/" + data_table_name + "/" + u.partition + "/" + u.row);
+  }
+}
+
+/*
+  Run one operation for user u, returning the operation actually
+  performed (a user who is not signed on is signed on first) and
+  whether the server accepted it.
+ */
+pair<op_t,bool> run_op (http_client& client, op_t op, synth_user& u,
+                        const vector<synth_user>& users, std::mt19937& rng) {
+  if (op != op_sign_on && ! u.signed_on)
+    op = op_sign_on;
+
+  status_code code {0};
+  switch (op) {
+  case op_sign_on:
+    code = quiet_request(client, methods::POST, sign_on + "/" + u.userid,
+                         string_object({make_pair("Password", u.password)}));
+    if (code == status_codes::OK)
+      u.signed_on = true;
+    break;
+  case op_sign_off:
+    code = quiet_request(client, methods::POST, sign_off + "/" + u.userid);
+    u.signed_on = false;
+    break;
+  case op_add_friend:
+  case op_unfriend: {
+    const synth_user& f (users[std::uniform_int_distribution<size_t>(0, users.size() - 1)(rng)]);
+    code = quiet_request(client, methods::PUT,
+                         (op == op_add_friend ? add_friend : unfriend) + "/" +
+                         u.userid + "/" + f.partition + "/" + f.row);
+    break;
+  }
+  case op_update_status:
+    code = quiet_request(client, methods::PUT,
+                         update_status + "/" + u.userid + "/" +
+                         "Load" + alpha_suffix(static_cast<unsigned int>(rng())));
+    break;
+  case op_read_friend_list:
+    code = quiet_request(client, methods::GET, read_friend_list + "/" + u.userid);
+    break;
+  default:
+    break;
+  }
+  return make_pair(op, code == status_codes::OK);
+}
+
+/*
+  Closed-loop worker: each thread owns the users whose index is
+  congruent to its own index, so per-user session state never
+  needs to be shared between threads.
+ */
+void worker (unsigned int index, unsigned int nthreads, vector<synth_user>& users,
+             const vector<double>& mix, double rate_per_thread,
+             steady_clock::time_point stop_at, op_stats& stats) {
+  http_client client {user_url};
+  std::mt19937 rng {index * 7919u + 17u};
+  std::discrete_distribution<int> pick_op (mix.begin(), mix.end());
+
+  vector<size_t> mine {};
+  for (size_t i {index}; i < users.size(); i += nthreads)
+    mine.push_back(i);
+  if (mine.empty())
+    return;
+  std::uniform_int_distribution<size_t> pick_user (0, mine.size() - 1);
+
+  const steady_clock::duration interval {
+    rate_per_thread > 0
+      ? std::chrono::duration_cast<steady_clock::duration>(std::chrono::duration<double>(1.0 / rate_per_thread))
+      : steady_clock::duration::zero()};
+  steady_clock::time_point scheduled {steady_clock::now()};
+
+  while (scheduled < stop_at) {
+    if (interval != steady_clock::duration::zero())
+      std::this_thread::sleep_until(scheduled);
+    else
+      scheduled = steady_clock::now();
+
+    synth_user& u (users[mine[pick_user(rng)]]);
+    pair<op_t,bool> res {run_op(client, static_cast<op_t>(pick_op(rng)), u, users, rng)};
+    uint64_t micros {static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::microseconds>(steady_clock::now() - scheduled).count())};
+    stats.latency[res.first].record(micros);
+    if (! res.second)
+      stats.errors[res.first]++;
+
+    scheduled += interval;
+  }
+}
+
+/*
+  Parse a mix specification such as "SignOn=5,AddFriend=20"
+  into one weight per operation. Operations that are not
+  mentioned get weight 0.
+ */
+bool parse_mix (const string& spec, vector<double>& mix) {
+  mix.assign(op_count, 0.0);
+  string::size_type start {0};
+  while (start < spec.size()) {
+    string::size_type end {spec.find(',', start)};
+    if (end == string::npos)
+      end = spec.size();
+    string item {spec.substr(start, end - start)};
+    string::size_type eq {item.find('=')};
+    if (eq == string::npos)
+      return false;
+    auto name (std::find(op_names.begin(), op_names.end(), item.substr(0, eq)));
+    if (name == op_names.end())
+      return false;
+    mix[name - op_names.begin()] = std::atof(item.substr(eq + 1).c_str());
+    start = end + 1;
+  }
+  return std::any_of(mix.begin(), mix.end(), [] (double w) { return w > 0; });
+}
+
+void print_report (const op_stats& total, double seconds) {
+  cout << endl << std::left << std::setw(16) << "Operation"
+       << std::right << std::setw(10) << "Count"
+       << std::setw(10) << "Errors"
+       << std::setw(12) << "Ops/sec"
+       << std::setw(12) << "p50 (ms)"
+       << std::setw(12) << "p99 (ms)"
+       << std::setw(12) << "p999 (ms)" << endl;
+
+  LatencyHistogram all {};
+  uint64_t all_errors {0};
+  cout << std::fixed << std::setprecision(2);
+  for (int op {0}; op <= op_count; op++) {
+    const LatencyHistogram& h (op < op_count ? total.latency[op] : all);
+    uint64_t errors {op < op_count ? total.errors[op] : all_errors};
+    if (op < op_count) {
+      all.merge(h);
+      all_errors += errors;
+    }
+    cout << std::left << std::setw(16) << (op < op_count ? op_names[op] : string {"All"})
+         << std::right << std::setw(10) << h.count()
+         << std::setw(10) << errors
+         << std::setw(12) << h.count() / seconds
+         << std::setw(12) << h.percentile(50.0) / 1000.0
+         << std::setw(12) << h.percentile(99.0) / 1000.0
+         << std::setw(12) << h.percentile(99.9) / 1000.0 << endl;
+  }
+}
+
+int main (int argc, const char* argv[]) {
+  unsigned int nusers {100};
+  unsigned int nthreads {std::max(1u, std::thread::hardware_concurrency())};
+  double rate {0};
+  double duration {30};
+  bool keep {false};
+  vector<double> mix {};
+  parse_mix("SignOn=5,AddFriend=20,UnFriend=10,UpdateStatus=25,ReadFriendList=35,SignOff=5", mix);
+
+  for (int i {1}; i < argc; i++) {
+    string arg {argv[i]};
+    bool has_val {i + 1 < argc};
+    if (arg == "--users" && has_val)
+      nusers = std::atoi(argv[++i]);
+    else if (arg == "--threads" && has_val)
+      nthreads = std::atoi(argv[++i]);
+    else if (arg == "--rate" && has_val)
+      rate = std::atof(argv[++i]);
+    else if (arg == "--duration" && has_val)
+      duration = std::atof(argv[++i]);
+    else if (arg == "--mix" && has_val) {
+      if (! parse_mix(argv[++i], mix)) {
+        cerr << "Malformed --mix " << argv[i] << endl;
+        return 1;
+      }
+    }
+    else if (arg == "--keep")
+      keep = true;
+    else {
+      cerr << "Usage: loadgen [--users N] [--threads T] [--rate OPS_PER_SEC] "
+           << "[--duration SECS] [--mix Op=weight,...] [--keep]" << endl;
+      return 1;
+    }
+  }
+  if (nusers == 0 || nthreads == 0) {
+    cerr << "Need at least one user and one thread" << endl;
+    return 1;
+  }
+
+  vector<synth_user> users {make_users(nusers)};
+  cout << "Provisioning " << nusers << " users" << endl;
+  if (! provision_users(users))
+    return 1;
+
+  cout << "Running " << nthreads << " threads for " << duration << " s at "
+       << (rate > 0 ? std::to_string(rate) + " ops/sec" : string {"maximum rate"}) << endl;
+
+  vector<op_stats> stats (nthreads);
+  vector<std::thread> threads {};
+  steady_clock::time_point start {steady_clock::now()};
+  steady_clock::time_point stop_at {start + std::chrono::duration_cast<steady_clock::duration>(
+      std::chrono::duration<double>(duration))};
+  for (unsigned int t {0}; t < nthreads; t++)
+    threads.push_back(std::thread {worker, t, nthreads, std::ref(users), std::cref(mix),
+                                   rate / nthreads, stop_at, std::ref(stats[t])});
+  for (auto& t : threads)
+    t.join();
+  double elapsed {std::chrono::duration<double>(steady_clock::now() - start).count()};
+
+  op_stats total {};
+  for (const auto& s : stats)
+    for (int op {0}; op < op_count; op++) {
+      total.latency[op].merge(s.latency[op]);
+      total.errors[op] += s.errors[op];
+    }
+  print_report(total, elapsed);
+
+  // Leave no sessions behind for the users we are about to delete
+  http_client client {user_url};
+  for (auto& u : users)
+    if (u.signed_on)
+      quiet_request(client, methods::POST, sign_off + "/" + u.userid);
+  if (! keep)
+    remove_users(users);
+}
@@ -0,0 +1,941 @@
+/*
+  Microbenchmarks for the ClientUtils and ServerUtils helpers that
+  run on every request.
+
+  Each benchmark is run with enough iterations to take at least
+  --min-time seconds (default 0.2) and reports nanoseconds,
+  heap allocations and heap bytes allocated per operation.
+  Allocations are counted by replacing the global operator new.
+
+  Usage:
+    microbench [--filter SUBSTRING] [--min-time SECS]
+               [--json FILE] [--label LABEL] [--sizes]
+
+  --json appends one JSON object per benchmark (JSON Lines) to FILE,
+  tagged with LABEL (typically a commit id), so that results from
+  different commits can be compared mechanically.
+
+  The session_store cases measure SessionStore throughput against
+  thread count; their ns/op is wall time divided by the operations
+  completed across all threads.
+
+  The feed_merge cases merge a page of a user's feed from several
+  sorted sources, as GetFeed does.
+
+  The friend_graph cases walk friends of friends over a FriendGraph
+  snapshot, against the same walk over stored friends lists, and
+  time refreshing the snapshot after one user's list changes. The
+  intersect cases intersect two friend rows of the given size, half
+  of whose elements are shared, with intersect_sorted () and with the
+  one-at-a-time merge; friend_suggest ranks a user's friends of
+  friends.
+
+  The decode_friends_compact, friends_to_text and compact_friends
+  cases time the compact friends list form (see FriendsCodec.h)
+  against the parse_friends cases on the same lists; --sizes prints
+  the stored size of those lists in each form instead of timing.
+
+  The timing_wheel and session_expire cases are run against
+  increasing numbers of pending timers or sessions, to show that
+  their cost per operation does not grow with the population.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <cpprest/http_listener.h>
+#include <cpprest/json.h>
+
+#include <was/table.h>
+
+#include "ClientUtils.h"
+#include "FriendGraph.h"
+#include "FriendQueries.h"
+#include "FriendSet.h"
+#include "FriendsCodec.h"
+#include "KWayMerge.h"
+#include "ServerUtils.h"
+#include "SessionStore.h"
+#include "SortedIntersect.h"
+#include "TimingWheel.h"
+
+using azure::storage::entity_property;
+using azure::storage::table_entity;
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::make_pair;
+using std::pair;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+using web::http::http_request;
+using web::http::methods;
+
+using web::json::value;
+
+using steady_clock = std::chrono::steady_clock;
+
+/////////////////////////////////////////////////////
+//                                                 //
+//               Allocation counting               //
+//                                                 //
+/////////////////////////////////////////////////////
+
+static std::atomic<uint64_t> alloc_count {0};
+static std::atomic<uint64_t> alloc_bytes {0};
+
+// Turned off for multithreaded cases, where the shared counters would dominate
+static std::atomic<bool> counting_allocs {true};
+
+void* operator new (std::size_t size) {
+  if (counting_allocs.load(std::memory_order_relaxed)) {
+    alloc_count.fetch_add(1, std::memory_order_relaxed);
+    alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+  }
+  void* p {std::malloc(size == 0 ? 1 : size)};
+  if (p == nullptr)
+    throw std::bad_alloc {};
+  return p;
+}
+
+void operator delete (void* p) noexcept {
+  std::free(p);
+}
+
+void* operator new[] (std::size_t size) {
+  return operator new (size);
+}
+
+void operator delete[] (void* p) noexcept {
+  operator delete (p);
+}
+
+/*
+  Prevent the compiler from discarding a result we never use
+ */
+template<typename T>
+void keep (const T& v) {
+  asm volatile ("" : : "g"(&v) : "memory");
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                  The harness                    //
+//                                                 //
+/////////////////////////////////////////////////////
+
+/*
+  A benchmark case. setup() builds the inputs outside the timed
+  region and returns the body, which must perform its operation
+  the given number of times.
+
+  threaded cases run their body on several threads; allocations
+  are not counted for them and are reported as -1.
+ */
+struct bench_case {
+  string name;
+  string param;
+  std::function<std::function<void(uint64_t)>()> setup;
+  bool threaded;
+};
+
+struct bench_result {
+  uint64_t iterations;
+  double ns_per_op;
+  double allocs_per_op;
+  double bytes_per_op;
+};
+
+bench_result run_case (const bench_case& bc, double min_time) {
+  std::function<void(uint64_t)> body {bc.setup()};
+  uint64_t iters {1};
+  counting_allocs = ! bc.threaded;
+  while (true) {
+    uint64_t count0 {alloc_count.load()};
+    uint64_t bytes0 {alloc_bytes.load()};
+    steady_clock::time_point start {steady_clock::now()};
+    body(iters);
+    double elapsed {std::chrono::duration<double>(steady_clock::now() - start).count()};
+    uint64_t count1 {alloc_count.load()};
+    uint64_t bytes1 {alloc_bytes.load()};
+    if (elapsed >= min_time || iters >= (uint64_t {1} << 40)) {
+      counting_allocs = true;
+      if (bc.threaded)
+        return bench_result {iters, elapsed * 1e9 / iters, -1, -1};
+      return bench_result {iters,
+                           elapsed * 1e9 / iters,
+                           static_cast<double>(count1 - count0) / iters,
+                           static_cast<double>(bytes1 - bytes0) / iters};
+    }
+    // Aim a little past min_time so the next round is usually the last
+    double scale {elapsed > 0 ? 1.2 * min_time / elapsed : 10.0};
+    iters = std::max(iters * 2, static_cast<uint64_t>(iters * std::min(scale, 100.0)));
+  }
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                   Input builders                //
+//                                                 //
+/////////////////////////////////////////////////////
+
+const vector<int> friend_counts {10, 100, 1000, 10000, 100000};
+const vector<int> property_counts {1, 10, 50, 200};
+
+friends_list_t make_friends (int n) {
+  friends_list_t list {};
+  list.reserve(n);
+  for (int i {0}; i < n; i++)
+    list.push_back(make_pair("Country" + std::to_string(i % 20),
+                             "Last" + std::to_string(i) + ",First" + std::to_string(i)));
+  return list;
+}
+
+vector<pair<string,string>> make_string_props (int n) {
+  vector<pair<string,string>> props {};
+  for (int i {0}; i < n; i++)
+    props.push_back(make_pair("Property" + std::to_string(i), "Value of property " + std::to_string(i)));
+  return props;
+}
+
+/*
+  Mostly string properties, with every fourth one an int32
+  so get_properties () exercises more than one branch.
+ */
+table_entity::properties_type make_entity_props (int n) {
+  table_entity::properties_type props {};
+  for (int i {0}; i < n; i++) {
+    if (i % 4 == 3)
+      props["Property" + std::to_string(i)] = entity_property {static_cast<int32_t>(i)};
+    else
+      props["Property" + std::to_string(i)] = entity_property {string {"Value of property "} + std::to_string(i)};
+  }
+  return props;
+}
+
+/*
+  Print the stored size of the benchmark friends lists in the text
+  and compact forms
+ */
+void print_friends_sizes () {
+  cout << std::left << std::setw(20) << "Friends"
+       << std::right << std::setw(14) << "text bytes"
+       << std::setw(14) << "compact bytes"
+       << std::setw(10) << "ratio" << endl;
+  cout << std::fixed << std::setprecision(2);
+  for (int n : friend_counts) {
+    friends_list_t list {make_friends(n)};
+    std::size_t text {friends_list_to_string(list).size()};
+    std::size_t compact {encode_friends_compact(list).size()};
+    cout << std::left << std::setw(20) << n
+         << std::right << std::setw(14) << text
+         << std::setw(14) << compact
+         << std::setw(10) << static_cast<double>(compact) / text << endl;
+  }
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                  Benchmark cases                //
+//                                                 //
+/////////////////////////////////////////////////////
+
+/*
+  parse_friends_list () as it was before parse_friends_view (): two
+  string::find calls and two substr copies per pair. Kept as the
+  baseline for the parse_friends cases.
+ */
+friends_list_t parse_friends_find (const string& friends_list) {
+  friends_list_t res {};
+  string::size_type start {0};
+  if (friends_list[start] == pair_separator)
+    start++;
+  for (string::size_type delim {friends_list.find(pair_delimiter, start)};
+       delim != string::npos;
+       delim = friends_list.find(pair_delimiter, start)) {
+    string::size_type end {friends_list.find(pair_separator, start)};
+    if (end == string::npos)
+      end = friends_list.size();
+    if (end <= delim + 1)
+      throw std::invalid_argument(string("Misformed friends list: ") + friends_list);
+    res.push_back(make_pair(friends_list.substr(start, delim - start), friends_list.substr(delim + 1, end - delim - 1)));
+    start = end + 1;
+  }
+  return res;
+}
+
+void add_client_utils_cases (vector<bench_case>& cases) {
+  for (int n : friend_counts) {
+    string param {"friends=" + std::to_string(n)};
+    cases.push_back(bench_case {"parse_friends_list", param, [n] () -> std::function<void(uint64_t)> {
+          string s {friends_list_to_string(make_friends(n))};
+          return std::function<void(uint64_t)> {[s] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++)
+                keep(parse_friends_list(s));
+            }};
+        }});
+    cases.push_back(bench_case {"parse_friends_view", param, [n] () -> std::function<void(uint64_t)> {
+          string s {friends_list_to_string(make_friends(n))};
+          return std::function<void(uint64_t)> {[s] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++)
+                keep(parse_friends_view(s));
+            }};
+        }});
+    cases.push_back(bench_case {"parse_friends_find", param, [n] () -> std::function<void(uint64_t)> {
+          string s {friends_list_to_string(make_friends(n))};
+          return std::function<void(uint64_t)> {[s] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++)
+                keep(parse_friends_find(s));
+            }};
+        }});
+    cases.push_back(bench_case {"decode_friends_compact", param, [n] () -> std::function<void(uint64_t)> {
+          string s {encode_friends_compact(make_friends(n))};
+          return std::function<void(uint64_t)> {[s] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++)
+                keep(decode_friends_compact(s));
+            }};
+        }});
+    cases.push_back(bench_case {"friends_to_text", param, [n] () -> std::function<void(uint64_t)> {
+          string s {encode_friends_compact(make_friends(n))};
+          return std::function<void(uint64_t)> {[s] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++)
+                keep(friends_to_text(s));
+            }};
+        }});
+    cases.push_back(bench_case {"compact_friends", param, [n] () -> std::function<void(uint64_t)> {
+          string s {friends_list_to_string(make_friends(n))};
+          return std::function<void(uint64_t)> {[s] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++)
+                keep(compact_friends(s));
+            }};
+        }});
+    cases.push_back(bench_case {"friends_list_to_string", param, [n] () -> std::function<void(uint64_t)> {
+          friends_list_t list {make_friends(n)};
+          return std::function<void(uint64_t)> {[list] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++)
+                keep(friends_list_to_string(list));
+            }};
+        }});
+  }
+
+  for (int n : property_counts) {
+    string param {"properties=" + std::to_string(n)};
+    cases.push_back(bench_case {"build_json_value", param, [n] () -> std::function<void(uint64_t)> {
+          vector<pair<string,string>> props {make_string_props(n)};
+          return std::function<void(uint64_t)> {[props] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++)
+                keep(build_json_value(props));
+            }};
+        }});
+    cases.push_back(bench_case {"unpack_json_object", param, [n] () -> std::function<void(uint64_t)> {
+          value v {build_json_value(make_string_props(n))};
+          return std::function<void(uint64_t)> {[v] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++)
+                keep(unpack_json_object(v));
+            }};
+        }});
+  }
+}
+
+void add_server_utils_cases (vector<bench_case>& cases) {
+  for (int n : property_counts) {
+    string param {"properties=" + std::to_string(n)};
+    cases.push_back(bench_case {"get_properties", param, [n] () -> std::function<void(uint64_t)> {
+          table_entity::properties_type props {make_entity_props(n)};
+          return std::function<void(uint64_t)> {[props] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++)
+                keep(get_properties(props));
+            }};
+        }});
+    // The request has to be rebuilt every time because its body
+    // can only be extracted once, so this includes setting the body.
+    cases.push_back(bench_case {"get_json_body", param, [n] () -> std::function<void(uint64_t)> {
+          string body {build_json_value(make_string_props(n)).serialize()};
+          return std::function<void(uint64_t)> {[body] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++) {
+                http_request request {methods::PUT};
+                request.set_body(body, "application/json");
+                keep(get_json_body(request));
+              }
+            }};
+        }});
+  }
+}
+
+/*
+  Session store throughput against thread count.
+
+  Each thread cycles through its own users, signing each one on,
+  looking it up eight times (as the PUT handlers do) and signing it
+  off again, against a store pre-loaded with idle sessions. The
+  same workload is also run against an unordered_map behind one
+  global mutex, the simplest correct fix for the original race.
+ */
+const vector<int> thread_counts {1, 2, 4, 8, 16};
+constexpr int session_users_per_thread {1024};
+constexpr int session_idle_users {100000};
+constexpr int session_ops_per_cycle {10};
+
+const string session_token (180, 'T');
+
+class GlobalLockSessions {
+private:
+  std::mutex lock;
+  unordered_map<string,Session> sessions;
+public:
+  GlobalLockSessions () : lock {}, sessions {} {};
+  bool insert (const string& userid, const Session& s) {
+    std::lock_guard<std::mutex> guard {lock};
+    return sessions.insert({userid, s}).second;
+  }
+  bool lookup (const string& userid, Session& s) {
+    std::lock_guard<std::mutex> guard {lock};
+    auto it (sessions.find(userid));
+    if (it == sessions.end())
+      return false;
+    s = it->second;
+    return true;
+  }
+  bool erase (const string& userid) {
+    std::lock_guard<std::mutex> guard {lock};
+    return sessions.erase(userid) == 1;
+  }
+};
+
+template<typename Store>
+std::function<void(uint64_t)> session_workload (int nthreads) {
+  std::shared_ptr<Store> store {std::make_shared<Store>()};
+  for (int i {0}; i < session_idle_users; i++)
+    store->insert("Idle" + std::to_string(i), Session {session_token, "Canada", "Idle,User" + std::to_string(i)});
+
+  std::shared_ptr<vector<vector<string>>> ids {std::make_shared<vector<vector<string>>>(nthreads)};
+  for (int t {0}; t < nthreads; t++)
+    for (int i {0}; i < session_users_per_thread; i++)
+      (*ids)[t].push_back("T" + std::to_string(t) + "U" + std::to_string(i));
+
+  return [store, ids, nthreads] (uint64_t iters) {
+    uint64_t cycles {std::max<uint64_t>(1, iters / session_ops_per_cycle / nthreads)};
+    vector<std::thread> threads {};
+    for (int t {0}; t < nthreads; t++) {
+      threads.push_back(std::thread {[store, ids, t, cycles] {
+            const vector<string>& mine ((*ids)[t]);
+            Session s {};
+            for (uint64_t c {0}; c < cycles; c++) {
+              const string& id (mine[c % mine.size()]);
+              store->insert(id, Session {session_token, "Canada", id});
+              for (int i {0}; i < session_ops_per_cycle - 2; i++)
+                keep(store->lookup(id, s));
+              store->erase(id);
+            }
+          }});
+    }
+    for (auto& th : threads)
+      th.join();
+  };
+}
+
+void add_session_store_cases (vector<bench_case>& cases) {
+  for (int n : thread_counts) {
+    string param {"threads=" + std::to_string(n)};
+    cases.push_back(bench_case {"session_store", param, [n] () -> std::function<void(uint64_t)> {
+          return session_workload<SessionStore>(n);
+        }, true});
+    cases.push_back(bench_case {"session_global_lock", param, [n] () -> std::function<void(uint64_t)> {
+          return session_workload<GlobalLockSessions>(n);
+        }, true});
+  }
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                   Friend sets                   //
+//                                                 //
+/////////////////////////////////////////////////////
+
+/*
+  add_friend_vector and add_friend_set are the whole friend-list
+  work of one AddFriend: parse the stored list, add a friend not on
+  it and produce the string to store. The first is the original
+  parse, linear scan and friends_list_to_string (); the second uses
+  FriendSet. unfriend_* do the same for UnFriend, removing a friend
+  from the middle of the list.
+
+  friend_set_add and friend_set_remove time the mutation alone, on a
+  FriendSet kept between operations, including the to_string () that
+  follows each one.
+ */
+const vector<int> friend_set_counts {10000, 100000};
+
+void add_friend_set_cases (vector<bench_case>& cases) {
+  for (int n : friend_set_counts) {
+    string param {"friends=" + std::to_string(n)};
+    cases.push_back(bench_case {"add_friend_vector", param, [n] () -> std::function<void(uint64_t)> {
+          string s {friends_list_to_string(make_friends(n))};
+          return std::function<void(uint64_t)> {[s] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++) {
+                friends_list_t list {parse_friends_list(s)};
+                bool found {false};
+                for (const auto& p : list) {
+                  if (p.first == "USA" && p.second == "New,Friend") {
+                    found = true;
+                    break;
+                  }
+                }
+                if (! found)
+                  list.push_back(make_pair("USA", "New,Friend"));
+                keep(friends_list_to_string(list));
+              }
+            }};
+        }});
+    cases.push_back(bench_case {"add_friend_set", param, [n] () -> std::function<void(uint64_t)> {
+          string s {friends_list_to_string(make_friends(n))};
+          return std::function<void(uint64_t)> {[s] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++) {
+                FriendSet set {s};
+                set.add("USA", "New,Friend");
+                keep(set.to_string());
+              }
+            }};
+        }});
+    cases.push_back(bench_case {"unfriend_vector", param, [n] () -> std::function<void(uint64_t)> {
+          friends_list_t friends {make_friends(n)};
+          pair<string,string> target {friends[n / 2]};
+          string s {friends_list_to_string(friends)};
+          return std::function<void(uint64_t)> {[s, target] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++) {
+                friends_list_t list {parse_friends_list(s)};
+                for (auto it = list.begin(); it != list.end(); ++it) {
+                  if (*it == target) {
+                    list.erase(it);
+                    break;
+                  }
+                }
+                keep(friends_list_to_string(list));
+              }
+            }};
+        }});
+    cases.push_back(bench_case {"unfriend_set", param, [n] () -> std::function<void(uint64_t)> {
+          friends_list_t friends {make_friends(n)};
+          pair<string,string> target {friends[n / 2]};
+          string s {friends_list_to_string(friends)};
+          return std::function<void(uint64_t)> {[s, target] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++) {
+                FriendSet set {s};
+                set.remove(target.first, target.second);
+                keep(set.to_string());
+              }
+            }};
+        }});
+    cases.push_back(bench_case {"friend_set_add", param, [n] () -> std::function<void(uint64_t)> {
+          std::shared_ptr<FriendSet> set {std::make_shared<FriendSet>(friends_list_to_string(make_friends(n)))};
+          std::shared_ptr<uint64_t> next {std::make_shared<uint64_t>(0)};
+          return std::function<void(uint64_t)> {[set, next] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++) {
+                set->add("USA", "Added" + std::to_string((*next)++));
+                keep(set->to_string());
+              }
+            }};
+        }});
+    cases.push_back(bench_case {"friend_set_remove", param, [n] () -> std::function<void(uint64_t)> {
+          std::shared_ptr<FriendSet> set {std::make_shared<FriendSet>(friends_list_to_string(make_friends(n)))};
+          return std::function<void(uint64_t)> {[set] (uint64_t iters) {
+              // Remove a friend and put it back, so the set keeps its size
+              for (uint64_t i {0}; i < iters; i++) {
+                set->remove("USA", "Removed");
+                keep(set->to_string());
+                set->add("USA", "Removed");
+              }
+            }};
+        }});
+  }
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                 Session expiry                  //
+//                                                 //
+/////////////////////////////////////////////////////
+
+/*
+  timing_wheel_schedule_cancel schedules and cancels one timer
+  against a wheel already holding pending timers spread over the
+  next day, as a session sign-on and sign-off would.
+
+  session_expire signs on sessions due to expire over the next
+  hour and then evicts them all, against a store already holding
+  sessions that expire tomorrow. Each operation is one insert plus
+  its share of the eviction.
+ */
+const vector<int> pending_counts {1000, 100000, 1000000};
+constexpr int expiry_window {3600};
+
+void add_session_expiry_cases (vector<bench_case>& cases) {
+  for (int n : pending_counts) {
+    string param {"pending=" + std::to_string(n)};
+
+    cases.push_back(bench_case {"timing_wheel_schedule_cancel", param, [n] () -> std::function<void(uint64_t)> {
+          uint64_t start {static_cast<uint64_t>(SessionStore::unix_now())};
+          std::shared_ptr<TimingWheel> wheel {std::make_shared<TimingWheel>(start)};
+          for (int i {0}; i < n; i++)
+            wheel->schedule("Idle" + std::to_string(i), start + 1 + (i * 7919u) % 86400);
+          std::shared_ptr<string> key {std::make_shared<string>("Session")};
+          return [wheel, key, start] (uint64_t iters) {
+            for (uint64_t i {0}; i < iters; i++)
+              keep(wheel->cancel(wheel->schedule(*key, start + 1 + i % 86400)));
+          };
+        }});
+
+    cases.push_back(bench_case {"session_expire", param, [n] () -> std::function<void(uint64_t)> {
+          int64_t start {SessionStore::unix_now()};
+          std::shared_ptr<SessionStore> store {std::make_shared<SessionStore>()};
+          const string token (16, 'T');
+          for (int i {0}; i < n; i++)
+            store->insert("Idle" + std::to_string(i),
+                          Session {token, "Canada", "Idle,User", start + 365*86400 + i % 86400});
+          // The store's clock only moves forward, so each run starts where the last ended
+          std::shared_ptr<int64_t> clock {std::make_shared<int64_t>(start)};
+          return [store, clock, token] (uint64_t iters) {
+            int64_t base {*clock};
+            for (uint64_t i {0}; i < iters; i++)
+              store->insert("Expiring" + std::to_string(i),
+                            Session {token, "Canada", "Expiring,User", base + 1 + static_cast<int64_t>(i % expiry_window)});
+            keep(store->expire(base + expiry_window));
+            *clock = base + expiry_window;
+          };
+        }});
+  }
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                   Feed merge                    //
+//                                                 //
+/////////////////////////////////////////////////////
+
+/*
+  feed_merge_stream takes the first page of a feed from a number of
+  sources, each a sorted run of feed keys read feed_page keys at a
+  time, with a KWayStream, as GetFeed does. feed_merge_sort does the
+  same by concatenating the runs and sorting the whole lot, which
+  costs time in the total size of the runs rather than in the page.
+ */
+const vector<int> feed_source_counts {1, 10, 100};
+constexpr int feed_run_length {500};
+constexpr std::size_t feed_page {50};
+
+vector<vector<string>> make_feed_runs (int sources) {
+  vector<vector<string>> runs (sources);
+  for (int i {0}; i < sources * feed_run_length; i++) {
+    string key {std::to_string(1000000000 + i * 7919 % 1000000000)};
+    runs[i % sources].push_back(key);
+  }
+  for (auto& run : runs)
+    std::sort(run.begin(), run.end());
+  return runs;
+}
+
+void add_feed_merge_cases (vector<bench_case>& cases) {
+  for (int n : feed_source_counts) {
+    string param {"sources=" + std::to_string(n)};
+
+    cases.push_back(bench_case {"feed_merge_stream", param, [n] () -> std::function<void(uint64_t)> {
+          std::shared_ptr<vector<vector<string>>> runs {std::make_shared<vector<vector<string>>>(make_feed_runs(n))};
+          return [runs] (uint64_t iters) {
+            for (uint64_t i {0}; i < iters; i++) {
+              KWayStream<string, std::less<string>> stream {};
+              for (const auto& run : *runs) {
+                std::size_t read {0};
+                stream.add_source([&run, read] (vector<string>& batch) mutable {
+                    std::size_t end {std::min(run.size(), read + feed_page)};
+                    batch.insert(batch.end(), run.begin() + read, run.begin() + end);
+                    read = end;
+                    return read < run.size();
+                  });
+              }
+              vector<string> page {};
+              string key {};
+              std::size_t source {0};
+              while (page.size() < feed_page && stream.next(key, source))
+                page.push_back(std::move(key));
+              keep(page);
+            }
+          };
+        }});
+
+    cases.push_back(bench_case {"feed_merge_sort", param, [n] () -> std::function<void(uint64_t)> {
+          std::shared_ptr<vector<vector<string>>> runs {std::make_shared<vector<vector<string>>>(make_feed_runs(n))};
+          return [runs] (uint64_t iters) {
+            for (uint64_t i {0}; i < iters; i++) {
+              vector<const string*> all {};
+              for (const auto& run : *runs)
+                for (const auto& key : run)
+                  all.push_back(&key);
+              std::sort(all.begin(), all.end(), [] (const string* a, const string* b) { return *a < *b; });
+              all.resize(std::min(all.size(), feed_page));
+              keep(all);
+            }
+          };
+        }});
+  }
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                   Friend graph                  //
+//                                                 //
+/////////////////////////////////////////////////////
+
+const vector<int> graph_user_counts {1000, 10000, 100000};
+constexpr int graph_degree {20};
+
+/*
+  users users, each with graph_degree friends picked by a fixed
+  stride, as ((partition, row), friends list) pairs
+ */
+vector<pair<pair<string,string>,friends_list_t>> make_graph_users (int users) {
+  auto user = [] (int i) {
+    return make_pair("Country" + std::to_string(i % 20), "Last" + std::to_string(i) + ",First" + std::to_string(i));
+  };
+  vector<pair<pair<string,string>,friends_list_t>> all {};
+  all.reserve(users);
+  for (int i {0}; i < users; i++) {
+    friends_list_t list {};
+    for (int k {1}; k <= graph_degree; k++)
+      list.push_back(user(static_cast<int>((i + static_cast<int64_t>(k) * 7919) % users)));
+    all.push_back(make_pair(user(i), std::move(list)));
+  }
+  return all;
+}
+
+void add_friend_graph_cases (vector<bench_case>& cases) {
+  for (int n : graph_user_counts) {
+    string param {"users=" + std::to_string(n)};
+
+    cases.push_back(bench_case {"friend_graph_two_hop", param, [n] () -> std::function<void(uint64_t)> {
+          std::shared_ptr<FriendGraph> graph {std::make_shared<FriendGraph>()};
+          graph->load(make_graph_users(n), 0);
+          std::shared_ptr<const FriendGraphSnapshot> snap {graph->snapshot()};
+          std::shared_ptr<vector<uint32_t>> seen {std::make_shared<vector<uint32_t>>(snap->users(), 0)};
+          return [graph, snap, seen] (uint64_t iters) {
+            for (uint64_t i {0}; i < iters; i++) {
+              uint32_t start {static_cast<uint32_t>(i % snap->users())};
+              uint32_t mark {static_cast<uint32_t>(i + 1)};
+              std::size_t reached {0};
+              for (const uint32_t* f {snap->friends_begin(start)}; f != snap->friends_end(start); ++f)
+                for (const uint32_t* ff {snap->friends_begin(*f)}; ff != snap->friends_end(*f); ++ff)
+                  if ((*seen)[*ff] != mark) {
+                    (*seen)[*ff] = mark;
+                    reached++;
+                  }
+              keep(reached);
+            }
+          };
+        }});
+
+    cases.push_back(bench_case {"friend_lists_two_hop", param, [n] () -> std::function<void(uint64_t)> {
+          std::shared_ptr<unordered_map<string,string>> lists {std::make_shared<unordered_map<string,string>>()};
+          std::shared_ptr<vector<string>> keys {std::make_shared<vector<string>>()};
+          for (const auto& u : make_graph_users(n)) {
+            string key {u.first.first + ";" + u.first.second};
+            (*lists)[key] = friends_list_to_string(u.second);
+            keys->push_back(key);
+          }
+          return [lists, keys] (uint64_t iters) {
+            for (uint64_t i {0}; i < iters; i++) {
+              std::unordered_set<string> reached {};
+              for (const auto& f : parse_friends_list((*lists)[(*keys)[i % keys->size()]]))
+                for (const auto& ff : parse_friends_list((*lists)[f.first + ";" + f.second]))
+                  reached.insert(ff.first + ";" + ff.second);
+              keep(reached.size());
+            }
+          };
+        }});
+
+    cases.push_back(bench_case {"friend_graph_refresh", param, [n] () -> std::function<void(uint64_t)> {
+          std::shared_ptr<FriendGraph> graph {std::make_shared<FriendGraph>()};
+          vector<pair<pair<string,string>,friends_list_t>> users {make_graph_users(n)};
+          graph->load(users, 0);
+          keep(graph->snapshot());
+          std::shared_ptr<pair<pair<string,string>,friends_list_t>> changed {
+            std::make_shared<pair<pair<string,string>,friends_list_t>>(users[n / 2])};
+          return [graph, changed] (uint64_t iters) {
+            for (uint64_t i {0}; i < iters; i++) {
+              graph->set_friends(changed->first.first, changed->first.second, changed->second);
+              keep(graph->snapshot());
+            }
+          };
+        }});
+  }
+}
+
+const vector<int> intersect_sizes {100, 1000, 10000};
+
+/*
+  Two sorted sets of n ids drawn from 4n, each id in a with even
+  odds of also being in b, so which set advances next is as hard to
+  predict as it is between real friend rows. The cases cycle through
+  intersect_pairs different pairs, so the branch predictor cannot
+  simply learn one.
+ */
+constexpr int intersect_pairs {16};
+
+pair<vector<uint32_t>,vector<uint32_t>> make_intersect_sets (int n, unsigned seed) {
+  std::mt19937 rng {seed};
+  vector<uint32_t> a {};
+  vector<uint32_t> b {};
+  for (uint32_t id {0}; a.size() < static_cast<std::size_t>(n) || b.size() < static_cast<std::size_t>(n); id++) {
+    unsigned r {static_cast<unsigned>(rng() % 8)};
+    if (r < 1 || (r < 2 && a.size() < static_cast<std::size_t>(n)))
+      a.push_back(id);
+    if (r < 1 || (r >= 2 && r < 3 && b.size() < static_cast<std::size_t>(n)))
+      b.push_back(id);
+  }
+  a.resize(n);
+  b.resize(n);
+  return make_pair(a, b);
+}
+
+void add_intersect_cases (vector<bench_case>& cases) {
+  for (int n : intersect_sizes) {
+    string param {"n=" + std::to_string(n)};
+    using intersect_t = std::size_t (*) (const uint32_t*, std::size_t, const uint32_t*, std::size_t, uint32_t*);
+    vector<pair<string,intersect_t>> variants {make_pair("intersect_sorted", &intersect_sorted),
+                                               make_pair("intersect_scalar", &intersect_sorted_scalar)};
+    for (const auto& v : variants) {
+      intersect_t intersect {v.second};
+      cases.push_back(bench_case {v.first, param, [n, intersect] () -> std::function<void(uint64_t)> {
+            std::shared_ptr<vector<pair<vector<uint32_t>,vector<uint32_t>>>> sets {
+              std::make_shared<vector<pair<vector<uint32_t>,vector<uint32_t>>>>()};
+            for (int p {0}; p < intersect_pairs; p++)
+              sets->push_back(make_intersect_sets(n, static_cast<unsigned>(p)));
+            std::shared_ptr<vector<uint32_t>> out {std::make_shared<vector<uint32_t>>(n)};
+            return [sets, out, intersect] (uint64_t iters) {
+              for (uint64_t i {0}; i < iters; i++) {
+                const auto& set (*(sets->begin() + i % intersect_pairs));
+                keep(intersect(set.first.data(), set.first.size(), set.second.data(), set.second.size(), out->data()));
+              }
+            };
+          }});
+    }
+  }
+
+  for (int n : graph_user_counts) {
+    cases.push_back(bench_case {"friend_suggest", "users=" + std::to_string(n), [n] () -> std::function<void(uint64_t)> {
+          std::shared_ptr<FriendGraph> graph {std::make_shared<FriendGraph>()};
+          graph->load(make_graph_users(n), 0);
+          std::shared_ptr<const FriendGraphSnapshot> snap {graph->snapshot()};
+          return [snap] (uint64_t iters) {
+            for (uint64_t i {0}; i < iters; i++)
+              keep(suggest_friends(*snap, static_cast<uint32_t>(i % snap->users()), 10));
+          };
+        }});
+  }
+}
+
+/////////////////////////////////////////////////////
+//                                                 //
+//                      Main                       //
+//                                                 //
+/////////////////////////////////////////////////////
+
+int main (int argc, const char* argv[]) {
+  string filter {};
+  string json_path {};
+  string label {"unlabelled"};
+  double min_time {0.2};
+  bool sizes {false};
+
+  for (int i {1}; i < argc; i++) {
+    string arg {argv[i]};
+    bool has_val {i + 1 < argc};
+    if (arg == "--filter" && has_val)
+      filter = argv[++i];
+    else if (arg == "--json" && has_val)
+      json_path = argv[++i];
+    else if (arg == "--label" && has_val)
+      label = argv[++i];
+    else if (arg == "--min-time" && has_val)
+      min_time = std::atof(argv[++i]);
+    else if (arg == "--sizes")
+      sizes = true;
+    else {
+      cerr << "Usage: microbench [--filter SUBSTRING] [--min-time SECS] [--json FILE] [--label LABEL] [--sizes]" << endl;
+      return 1;
+    }
+  }
+
+  if (sizes) {
+    print_friends_sizes();
+    return 0;
+  }
+
+  vector<bench_case> cases {};
+  add_client_utils_cases(cases);
+  add_friend_set_cases(cases);
+  add_server_utils_cases(cases);
+  add_session_store_cases(cases);
+  add_session_expiry_cases(cases);
+  add_feed_merge_cases(cases);
+  add_friend_graph_cases(cases);
+  add_intersect_cases(cases);
+
+  std::ofstream json_out {};
+  if (! json_path.empty()) {
+    json_out.open(json_path, std::ios::app);
+    if (! json_out) {
+      cerr << "Cannot open " << json_path << endl;
+      return 1;
+    }
+  }
+
+  cout << std::left << std::setw(28) << "Benchmark"
+       << std::setw(20) << "Parameter"
+       << std::right << std::setw(14) << "ns/op"
+       << std::setw(12) << "allocs/op"
+       << std::setw(14) << "bytes/op" << endl;
+  cout << std::fixed << std::setprecision(1);
+
+  for (const auto& bc : cases) {
+    string full_name {bc.name + "/" + bc.param};
+    if (! filter.empty() && full_name.find(filter) == string::npos)
+      continue;
+
+    bench_result r {run_case(bc, min_time)};
+    cout << std::left << std::setw(28) << bc.name
+         << std::setw(20) << bc.param
+         << std::right << std::setw(14) << r.ns_per_op
+         << std::setw(12) << r.allocs_per_op
+         << std::setw(14) << r.bytes_per_op << endl;
+
+    if (json_out.is_open()) {
+      json_out << "{\"label\":\"" << label << "\""
+               << ",\"benchmark\":\"" << bc.name << "\""
+               << ",\"param\":\"" << bc.param << "\""
+               << ",\"iterations\":" << r.iterations
+               << ",\"ns_per_op\":" << r.ns_per_op
+               << ",\"allocs_per_op\":" << r.allocs_per_op
+               << ",\"bytes_per_op\":" << r.bytes_per_op << "}" << endl;
+    }
+  }
+}
@@ -3,9 +3,11 @@
  */
 
 #include <algorithm>
+#include <chrono>
 #include <exception>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -47,6 +49,7 @@ const string create_table_op {"CreateTableAdmin"};
 const string delete_table_op {"DeleteTableAdmin"};
 
 const string read_entity_admin {"ReadEntityAdmin"};
+const string query_entities_admin {"QueryEntitiesAdmin"};
 const string update_entity_admin {"UpdateEntityAdmin"};
 const string delete_entity_admin {"DeleteEntityAdmin"};
 
@@ -65,6 +68,14 @@ const string add_friend {"AddFriend"};
 const string unfriend {"UnFriend"};
 const string update_status {"UpdateStatus"};
 const string read_friend_list {"ReadFriendList"};
+const string bulk_friends {"BulkFriends"};
+const string read_updates {"ReadUpdates"};
+const string get_feed {"GetFeed"};
+const string feed_table_name {"FeedTable"};
+const string followers_table_name {"FollowersTable"};
+const string friend_graph_stats {"FriendGraphStats"};
+const string mutual_friends {"MutualFriends"};
+const string suggest_friends {"SuggestFriends"};
 
 const string friends {"Friends"};
 const string status {"Status"};
@@ -72,11 +83,19 @@ const string updates {"Updates"};
 
 // For PushServer
 const string push_status {"PushStatus"};
+const string enqueue_status {"EnqueueStatus"};
+const string push_metrics {"PushMetrics"};
+const string pause_intake_admin {"PauseIntakeAdmin"};
+const string resume_intake_admin {"ResumeIntakeAdmin"};
+const string push_spool {"PushSpool"};
 
 // The two optional operations from Assignment 1
 const string add_property_admin {"AddPropertyAdmin"};
 const string update_property_admin {"UpdatePropertyAdmin"};
 
+// Appends to a feed ring property, for PushServer
+const string append_property_admin {"AppendPropertyAdmin"};
+
 const string auth_table_name {"AuthTable"};
 const string data_table_name {"DataTable"};
 
@@ -491,6 +510,45 @@ SUITE(GET) {
     cout << "Are the objects the same? " << same_objects << endl;
     CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, partition, row));
   }
+
+  /*
+    A test of GET of the entities of a partition with a row key prefix,
+    a page at a time
+  */
+  TEST_FIXTURE(BasicFixture, QueryEntitiesByRowPrefix) {
+    vector<string> rows {"Feed;3", "Feed;1", "Fee", "Feed;2"};
+    for (const string& r : rows) {
+      int put_result {put_entity (BasicFixture::addr, BasicFixture::table, BasicFixture::partition, r, "Status", r)};
+      assert (put_result == status_codes::OK);
+    }
+
+    pair<status_code,value> result {
+      do_request (methods::GET,
+                  string(BasicFixture::addr) + query_entities_admin + "/" + BasicFixture::table + "/" +
+                  BasicFixture::partition + "/" + "Feed;" + "/" + "2")};
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(2u, result.second.size());
+    CHECK_EQUAL("Feed;1", result.second[0]["Row"].as_string());
+    CHECK_EQUAL("Feed;2", result.second[1]["Row"].as_string());
+
+    //The next page starts after the last row of this one
+    result = do_request (methods::GET,
+                         string(BasicFixture::addr) + query_entities_admin + "/" + BasicFixture::table + "/" +
+                         BasicFixture::partition + "/" + "Feed;" + "/" + "2" + "/" + "Feed;2");
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL(1u, result.second.size());
+    CHECK_EQUAL("Feed;3", result.second[0]["Row"].as_string());
+    CHECK_EQUAL("Feed;3", result.second[0]["Status"].as_string());
+
+    //Missing top
+    result = do_request (methods::GET,
+                         string(BasicFixture::addr) + query_entities_admin + "/" + BasicFixture::table + "/" +
+                         BasicFixture::partition + "/" + "Feed;");
+    CHECK_EQUAL(status_codes::BadRequest, result.first);
+
+    for (const string& r : rows)
+      CHECK_EQUAL(status_codes::OK, delete_entity (BasicFixture::addr, BasicFixture::table, BasicFixture::partition, r));
+  }
 }
 
 /////////////////////////////////////////////////////////////////////
@@ -735,6 +793,46 @@ SUITE(AddPropertyToEntities) {
     }
 }
 
+SUITE(AppendProperty) {
+  /*
+    Appending to a property creates it, and each later append adds
+    one entry after the last, in a single request
+   */
+  TEST_FIXTURE(BasicFixture, AppendPropertyAppendsEntries) {
+    string append_uri {string(BasicFixture::addr) + append_property_admin + "/" + BasicFixture::table + "/"
+                       + BasicFixture::partition + "/" + BasicFixture::row};
+
+    CHECK_EQUAL(status_codes::OK,
+                do_request(methods::PUT, append_uri, build_json_object(vector<pair<string,string>> {make_pair(updates, "first")})).first);
+    CHECK_EQUAL(status_codes::OK,
+                do_request(methods::PUT, append_uri, build_json_object(vector<pair<string,string>> {make_pair(updates, "second")})).first);
+
+    pair<status_code,value> result {
+      do_request(methods::GET, string(BasicFixture::addr) + read_entity_admin + "/" + BasicFixture::table + "/"
+                 + BasicFixture::partition + "/" + BasicFixture::row)};
+    CHECK_EQUAL(status_codes::OK, result.first);
+    CHECK_EQUAL("first\nsecond\n", result.second[updates].as_string());
+    // Properties the appends did not name are left as they were
+    CHECK_EQUAL(BasicFixture::prop_val, result.second[BasicFixture::property].as_string());
+
+    // Several entries, each ended by a newline, are appended in order
+    CHECK_EQUAL(status_codes::OK,
+                do_request(methods::PUT, append_uri, build_json_object(vector<pair<string,string>> {make_pair(updates, "third\nfourth\n")})).first);
+    result = do_request(methods::GET, string(BasicFixture::addr) + read_entity_admin + "/" + BasicFixture::table + "/"
+                        + BasicFixture::partition + "/" + BasicFixture::row);
+    CHECK_EQUAL("first\nsecond\nthird\nfourth\n", result.second[updates].as_string());
+
+    // One entry, with no newline in it, and a full entity path
+    CHECK_EQUAL(status_codes::BadRequest,
+                do_request(methods::PUT, append_uri, build_json_object(vector<pair<string,string>> {make_pair(updates, "a\nb")})).first);
+    CHECK_EQUAL(status_codes::BadRequest,
+                do_request(methods::PUT, append_uri, value::object()).first);
+    CHECK_EQUAL(status_codes::BadRequest,
+                do_request(methods::PUT, string(BasicFixture::addr) + append_property_admin + "/" + BasicFixture::table + "/"
+                           + BasicFixture::partition, build_json_object(vector<pair<string,string>> {make_pair(updates, "third")})).first);
+  }
+}
+
 /////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////
 ////                                                             ////
@@ -3005,6 +3103,255 @@ SUITE(SignOnAndOff)
     cout << "SignOff response " << sign_off_result.first << endl;
     CHECK_EQUAL(status_codes::OK, sign_off_result.first);
   }
+
+  TEST_FIXTURE(UserFixture, ReadUpdatesPagesThroughArchivedUpdates)
+  {
+    pair<status_code,value> sign_on_result = do_request(methods::POST, string(user_url) + sign_on + "/" + UserFixture::user1_id, 
+        value::object (vector<pair<string,value>>{make_pair("Password", value::string(UserFixture::user1_password))}));
+    CHECK_EQUAL(status_codes::OK, sign_on_result.first);
+
+    // One more status than the Updates ring holds, so its oldest page is archived
+    for (int i = 0; i <= 100; i++) {
+      auto update_res = do_request(methods::PUT, string(user_url) + update_status + "/" + UserFixture::user1_id + "/" + "s" + std::to_string(i));
+      CHECK_EQUAL(status_codes::OK, update_res.first);
+    }
+
+    pair<status_code, value> get_result { do_request(methods::GET, basic_url + read_entity_admin + "/" + data_table_name + "/" + UserFixture::user1_DataPartition + "/" + UserFixture::user1_DataRow) };
+    CHECK_EQUAL(status_codes::OK, get_result.first);
+    CHECK_EQUAL("1", get_result.second["UpdatesArchived"].as_string());
+    CHECK_EQUAL(0u, get_result.second["Updates"].as_string().find("s50\n"));
+
+    //Newest first, with a cursor to the rest
+    pair<status_code, value> read_res = do_request(methods::GET, string(user_url) + read_updates + "/" + UserFixture::user1_id + "/" + "3");
+    cout << "ReadUpdates response " << read_res.first << endl;
+    CHECK_EQUAL(status_codes::OK, read_res.first);
+    CHECK_EQUAL(value::array(vector<value>{value::string("s100"), value::string("s99"), value::string("s98")}), read_res.second["Updates"]);
+    CHECK_EQUAL("98", read_res.second["Cursor"].as_string());
+
+    //Across the end of the ring into the archived page, to the oldest status
+    read_res = do_request(methods::GET, string(user_url) + read_updates + "/" + UserFixture::user1_id + "/" + "60" + "/" + "52");
+    CHECK_EQUAL(status_codes::OK, read_res.first);
+    CHECK_EQUAL(52u, read_res.second["Updates"].size());
+    CHECK_EQUAL("s51", read_res.second["Updates"][0].as_string());
+    CHECK_EQUAL("s49", read_res.second["Updates"][2].as_string());
+    CHECK_EQUAL("s0", read_res.second["Updates"][51].as_string());
+    CHECK_EQUAL("", read_res.second["Cursor"].as_string());
+
+    //Bad count
+    read_res = do_request(methods::GET, string(user_url) + read_updates + "/" + UserFixture::user1_id + "/" + "0");
+    CHECK_EQUAL(status_codes::BadRequest, read_res.first);
+
+    pair<status_code, value> sign_off_result = do_request(methods::POST, string(user_url) + sign_off + "/" + UserFixture::user1_id);
+    CHECK_EQUAL(status_codes::OK, sign_off_result.first);
+
+    //No active session
+    read_res = do_request(methods::GET, string(user_url) + read_updates + "/" + UserFixture::user1_id + "/" + "3");
+    CHECK_EQUAL(status_codes::Forbidden, read_res.first);
+  }
+
+  TEST_FIXTURE(UserFixture, GetFeedPagesNewestFirst)
+  {
+    // Feed rows are the user's data row, a reverse timestamp and the poster; smaller sorts newer
+    int make_result {create_table(basic_url, feed_table_name)};
+    CHECK(make_result == status_codes::Created || make_result == status_codes::Accepted);
+    string prefix {string(UserFixture::user1_DataRow) + ";"};
+    vector<string> rows {prefix + "9999998239999999997;Korea;Song,Andrew",
+                         prefix + "9999998239999999999;Korea;Song,Andrew",
+                         prefix + "9999998239999999998;Korea;Singh,Angel"};
+    vector<string> statuses {"newest", "oldest", "middle"};
+    for (std::size_t i = 0; i < rows.size(); i++) {
+      int put_result {put_entity(basic_url, feed_table_name, UserFixture::user1_DataPartition, rows[i], "Status", statuses[i])};
+      CHECK_EQUAL(status_codes::OK, put_result);
+    }
+
+    pair<status_code,value> sign_on_result = do_request(methods::POST, string(user_url) + sign_on + "/" + UserFixture::user1_id, 
+        value::object (vector<pair<string,value>>{make_pair("Password", value::string(UserFixture::user1_password))}));
+    CHECK_EQUAL(status_codes::OK, sign_on_result.first);
+
+    pair<status_code, value> feed_res = do_request(methods::GET, string(user_url) + get_feed + "/" + UserFixture::user1_id + "/" + "2");
+    cout << "GetFeed response " << feed_res.first << endl;
+    CHECK_EQUAL(status_codes::OK, feed_res.first);
+    CHECK_EQUAL(2u, feed_res.second["Updates"].size());
+    CHECK_EQUAL("newest", feed_res.second["Updates"][0]["Status"].as_string());
+    CHECK_EQUAL("middle", feed_res.second["Updates"][1]["Status"].as_string());
+    CHECK(feed_res.second["Updates"][0]["Time"].as_number().to_uint64() > feed_res.second["Updates"][1]["Time"].as_number().to_uint64());
+    string cursor {feed_res.second["Cursor"].as_string()};
+    CHECK(!cursor.empty());
+
+    //The cursor resumes after the last entry
+    feed_res = do_request(methods::GET, string(user_url) + get_feed + "/" + UserFixture::user1_id + "/" + "2" + "/" + cursor);
+    CHECK_EQUAL(status_codes::OK, feed_res.first);
+    CHECK_EQUAL(1u, feed_res.second["Updates"].size());
+    CHECK_EQUAL("oldest", feed_res.second["Updates"][0]["Status"].as_string());
+    CHECK_EQUAL("", feed_res.second["Cursor"].as_string());
+
+    //Bad count
+    feed_res = do_request(methods::GET, string(user_url) + get_feed + "/" + UserFixture::user1_id + "/" + "none");
+    CHECK_EQUAL(status_codes::BadRequest, feed_res.first);
+
+    pair<status_code, value> sign_off_result = do_request(methods::POST, string(user_url) + sign_off + "/" + UserFixture::user1_id);
+    CHECK_EQUAL(status_codes::OK, sign_off_result.first);
+
+    //No active session
+    feed_res = do_request(methods::GET, string(user_url) + get_feed + "/" + UserFixture::user1_id + "/" + "2");
+    CHECK_EQUAL(status_codes::Forbidden, feed_res.first);
+
+    for (const string& r : rows)
+      CHECK_EQUAL(status_codes::OK, delete_entity(basic_url, feed_table_name, UserFixture::user1_DataPartition, r));
+  }
+
+  TEST_FIXTURE(UserFixture, FollowersIndexFollowsAddAndUnFriend)
+  {
+    pair<status_code,value> sign_on_result = do_request(methods::POST, string(user_url) + sign_on + "/" + UserFixture::user1_id, 
+        value::object (vector<pair<string,value>>{make_pair("Password", value::string(UserFixture::user1_password))}));
+    CHECK_EQUAL(status_codes::OK, sign_on_result.first);
+
+    string followers_uri {string(basic_url) + read_entity_admin + "/" + followers_table_name + "/" +
+                          UserFixture::user3_DataPartition + "/" + UserFixture::user3_DataRow};
+    string user1_key {string(UserFixture::user1_DataPartition) + ";" + UserFixture::user1_DataRow};
+
+    auto friend_res = do_request(methods::PUT, string(user_url) + add_friend + "/" + UserFixture::user1_id + "/" +
+                                 UserFixture::user3_DataPartition + "/" + UserFixture::user3_DataRow);
+    CHECK_EQUAL(status_codes::OK, friend_res.first);
+
+    pair<status_code, value> index_res {do_request(methods::GET, followers_uri)};
+    CHECK_EQUAL(status_codes::OK, index_res.first);
+    CHECK_EQUAL(user1_key, index_res.second["Followers"].as_string());
+
+    friend_res = do_request(methods::PUT, string(user_url) + unfriend + "/" + UserFixture::user1_id + "/" +
+                            UserFixture::user3_DataPartition + "/" + UserFixture::user3_DataRow);
+    CHECK_EQUAL(status_codes::OK, friend_res.first);
+
+    index_res = do_request(methods::GET, followers_uri);
+    CHECK_EQUAL(status_codes::OK, index_res.first);
+    CHECK_EQUAL("", index_res.second["Followers"].as_string());
+
+    pair<status_code, value> sign_off_result = do_request(methods::POST, string(user_url) + sign_off + "/" + UserFixture::user1_id);
+    CHECK_EQUAL(status_codes::OK, sign_off_result.first);
+
+    CHECK_EQUAL(status_codes::OK, delete_entity(basic_url, followers_table_name,
+                                                UserFixture::user3_DataPartition, UserFixture::user3_DataRow));
+  }
+
+  TEST_FIXTURE(UserFixture, FriendGraphStatsFollowFriendChanges)
+  {
+    pair<status_code, value> stats_res {do_request(methods::GET, string(user_url) + friend_graph_stats)};
+    cout << "FriendGraphStats response " << stats_res.first << endl;
+    CHECK_EQUAL(status_codes::OK, stats_res.first);
+    CHECK(stats_res.second["Users"].as_number().to_uint64() >= 1);
+    CHECK(stats_res.second["AdjacencyBytes"].is_number());
+    CHECK(stats_res.second["IdBytes"].is_number());
+    CHECK(stats_res.second["BytesPerEdge"].is_number());
+    uint64_t edges {stats_res.second["Edges"].as_number().to_uint64()};
+
+    pair<status_code,value> sign_on_result = do_request(methods::POST, string(user_url) + sign_on + "/" + UserFixture::user1_id, 
+        value::object (vector<pair<string,value>>{make_pair("Password", value::string(UserFixture::user1_password))}));
+    CHECK_EQUAL(status_codes::OK, sign_on_result.first);
+
+    auto friend_res = do_request(methods::PUT, string(user_url) + add_friend + "/" + UserFixture::user1_id + "/" +
+                                 UserFixture::user3_DataPartition + "/" + UserFixture::user3_DataRow);
+    CHECK_EQUAL(status_codes::OK, friend_res.first);
+
+    //The new friend is an edge of the next snapshot, and a user if it was not one already
+    stats_res = do_request(methods::GET, string(user_url) + friend_graph_stats);
+    CHECK_EQUAL(status_codes::OK, stats_res.first);
+    CHECK_EQUAL(edges + 1, stats_res.second["Edges"].as_number().to_uint64());
+    CHECK(stats_res.second["Users"].as_number().to_uint64() >= 2);
+    CHECK(stats_res.second["BytesPerEdge"].as_double() > 0);
+
+    friend_res = do_request(methods::PUT, string(user_url) + unfriend + "/" + UserFixture::user1_id + "/" +
+                            UserFixture::user3_DataPartition + "/" + UserFixture::user3_DataRow);
+    CHECK_EQUAL(status_codes::OK, friend_res.first);
+
+    stats_res = do_request(methods::GET, string(user_url) + friend_graph_stats);
+    CHECK_EQUAL(edges, stats_res.second["Edges"].as_number().to_uint64());
+
+    pair<status_code, value> sign_off_result = do_request(methods::POST, string(user_url) + sign_off + "/" + UserFixture::user1_id);
+    CHECK_EQUAL(status_codes::OK, sign_off_result.first);
+
+    //malformed request
+    stats_res = do_request(methods::GET, string(user_url) + friend_graph_stats + "/" + "extra");
+    CHECK_EQUAL(status_codes::BadRequest, stats_res.first);
+  }
+
+  TEST_FIXTURE(UserFixture, MutualFriendsAndSuggestions)
+  {
+    // User3 signs on too, so both friends lists change through UserServer
+    pair<status_code,value> put_result {
+      do_request (methods::PUT,
+                  string(basic_url) + update_entity_admin + "/" + auth_table_name + "/" + auth_table_partition + "/" + UserFixture::user3_id,
+                  value::object (vector<pair<string,value>>{make_pair("Password", value::string(UserFixture::user3_password)),
+                                                            make_pair("DataPartition", value::string(UserFixture::user3_DataPartition)),
+                                                            make_pair("DataRow", value::string(UserFixture::user3_DataRow))}))};
+    CHECK_EQUAL(status_codes::OK, put_result.first);
+    put_result = do_request (methods::PUT,
+                  string(basic_url) + update_entity_admin + "/" + data_table_name + "/" + UserFixture::user3_DataPartition + "/" + UserFixture::user3_DataRow,
+                  value::object (vector<pair<string,value>>{make_pair("Friends", value::string("")),
+                                                            make_pair("Status", value::string("")),
+                                                            make_pair("Updates", value::string(""))}));
+    CHECK_EQUAL(status_codes::OK, put_result.first);
+
+    vector<pair<string,string>> users {make_pair(UserFixture::user1_id, UserFixture::user1_password),
+                                       make_pair(UserFixture::user3_id, UserFixture::user3_password)};
+    for (const auto& u : users) {
+      pair<status_code,value> sign_on_result = do_request(methods::POST, string(user_url) + sign_on + "/" + u.first, 
+          value::object (vector<pair<string,value>>{make_pair("Password", value::string(u.second))}));
+      CHECK_EQUAL(status_codes::OK, sign_on_result.first);
+    }
+
+    //User1 has friends user3 and user4; user3 has friends user4 and user2
+    vector<vector<string>> adds {{UserFixture::user1_id, UserFixture::user3_DataPartition, UserFixture::user3_DataRow},
+                                 {UserFixture::user1_id, UserFixture::user4_DataPartition, UserFixture::user4_DataRow},
+                                 {UserFixture::user3_id, UserFixture::user4_DataPartition, UserFixture::user4_DataRow},
+                                 {UserFixture::user3_id, UserFixture::user2_DataPartition, UserFixture::user2_DataRow}};
+    for (const auto& a : adds) {
+      auto friend_res = do_request(methods::PUT, string(user_url) + add_friend + "/" + a[0] + "/" + a[1] + "/" + a[2]);
+      CHECK_EQUAL(status_codes::OK, friend_res.first);
+    }
+
+    pair<status_code, value> mutual_res {
+      do_request(methods::GET, string(user_url) + mutual_friends + "/" + UserFixture::user1_id + "/" +
+                 UserFixture::user3_DataPartition + "/" + UserFixture::user3_DataRow)};
+    cout << "MutualFriends response " << mutual_res.first << endl;
+    CHECK_EQUAL(status_codes::OK, mutual_res.first);
+    CHECK_EQUAL(string(UserFixture::user4_DataPartition) + ";" + UserFixture::user4_DataRow, mutual_res.second["Friends"].as_string());
+
+    //Only user2 is new to user1, with user3 as the one mutual friend
+    pair<status_code, value> suggest_res {
+      do_request(methods::GET, string(user_url) + suggest_friends + "/" + UserFixture::user1_id + "/" + "5")};
+    cout << "SuggestFriends response " << suggest_res.first << endl;
+    CHECK_EQUAL(status_codes::OK, suggest_res.first);
+    CHECK_EQUAL(1u, suggest_res.second["Suggestions"].size());
+    CHECK_EQUAL(string(UserFixture::user2_DataPartition) + ";" + UserFixture::user2_DataRow,
+                suggest_res.second["Suggestions"][0]["Friend"].as_string());
+    CHECK_EQUAL(1, suggest_res.second["Suggestions"][0]["Mutual"].as_integer());
+
+    //Bad count
+    suggest_res = do_request(methods::GET, string(user_url) + suggest_friends + "/" + UserFixture::user1_id + "/" + "0");
+    CHECK_EQUAL(status_codes::BadRequest, suggest_res.first);
+
+    for (const auto& a : adds) {
+      auto friend_res = do_request(methods::PUT, string(user_url) + unfriend + "/" + a[0] + "/" + a[1] + "/" + a[2]);
+      CHECK_EQUAL(status_codes::OK, friend_res.first);
+    }
+    for (const auto& u : users) {
+      pair<status_code, value> sign_off_result = do_request(methods::POST, string(user_url) + sign_off + "/" + u.first);
+      CHECK_EQUAL(status_codes::OK, sign_off_result.first);
+    }
+
+    //No active session
+    mutual_res = do_request(methods::GET, string(user_url) + mutual_friends + "/" + UserFixture::user1_id + "/" +
+                            UserFixture::user3_DataPartition + "/" + UserFixture::user3_DataRow);
+    CHECK_EQUAL(status_codes::Forbidden, mutual_res.first);
+
+    CHECK_EQUAL(status_codes::OK, delete_entity(basic_url, auth_table_name, auth_table_partition, UserFixture::user3_id));
+    CHECK_EQUAL(status_codes::OK, delete_entity(basic_url, data_table_name, UserFixture::user3_DataPartition, UserFixture::user3_DataRow));
+    vector<pair<string,string>> followed {make_pair(UserFixture::user2_DataPartition, UserFixture::user2_DataRow),
+                                          make_pair(UserFixture::user3_DataPartition, UserFixture::user3_DataRow),
+                                          make_pair(UserFixture::user4_DataPartition, UserFixture::user4_DataRow)};
+    for (const auto& f : followed)
+      CHECK_EQUAL(status_codes::OK, delete_entity(basic_url, followers_table_name, f.first, f.second));
+  }
 }
 
 //GetFriendsList tests
@@ -3296,6 +3643,85 @@ SUITE(GetFriendsList)
     sign_off_result = do_request(methods::POST, string(user_url) + sign_off + "/" + user2_id);
     CHECK_EQUAL(status_codes::OK, sign_off_result.first);
   }
+
+  TEST_FIXTURE(GetFriendsListFixture, CompactFriendsListReadsAsText)
+  {
+    //Store user1's friends in the compact form, "USA;Doe,Jane|Korea;Kim,Min|USA;Roe,Rick"
+    pair<status_code, value> put_result = do_request (methods::PUT,
+                    string(basic_url) + update_entity_admin + "/" + data_table_name + "/" + user1_DataPartition + "/" + user1_DataRow,
+                    value::object (vector<pair<string,value>>{make_pair("Friends", value::string("#CDUSAFKoreaAIDoe,JaneBHKim,MinAIRoe,Rick"))}));
+    CHECK_EQUAL(status_codes::OK, put_result.first);
+
+    //SignOn user1
+    pair<status_code, value> sign_on_result = do_request(methods::POST, string(user_url) + sign_on + "/" + user1_id,
+    value::object (vector<pair<string,value>>{make_pair("Password", value::string(user1_password))}));
+    CHECK_EQUAL(status_codes::OK, sign_on_result.first);
+
+    pair<status_code,value> read_friend_list_result = do_request(methods::GET, string(user_url) + read_friend_list + "/" + user1_id);
+    cout << "CompactFriendsListReadsAsText User1 ReadFriendList response " << read_friend_list_result.first << endl;
+    CHECK_EQUAL(status_codes::OK, read_friend_list_result.first);
+    CHECK_EQUAL(value::object(vector<pair<string,value>>{make_pair("Friends", value::string("USA;Doe,Jane|Korea;Kim,Min|USA;Roe,Rick"))}), read_friend_list_result.second);
+
+    //Addfriend and UnFriend user1 work on the decoded list
+    pair<status_code, value> add_friend_result = do_request(methods::PUT, string(user_url) + add_friend + "/" + user1_id + "/" + "Canada" + "/" + "Poe,Pat");
+    CHECK_EQUAL(status_codes::OK, add_friend_result.first);
+    pair<status_code, value> unfriend_result = do_request(methods::PUT, string(user_url) + unfriend + "/" + user1_id + "/" + "Korea" + "/" + "Kim,Min");
+    CHECK_EQUAL(status_codes::OK, unfriend_result.first);
+
+    read_friend_list_result = do_request(methods::GET, string(user_url) + read_friend_list + "/" + user1_id);
+    CHECK_EQUAL(status_codes::OK, read_friend_list_result.first);
+    CHECK_EQUAL(value::object(vector<pair<string,value>>{make_pair("Friends", value::string("USA;Doe,Jane|USA;Roe,Rick|Canada;Poe,Pat"))}), read_friend_list_result.second);
+
+    //SignOff user1
+    pair<status_code, value> sign_off_result = do_request(methods::POST, string(user_url) + sign_off + "/" + user1_id);
+    CHECK_EQUAL(status_codes::OK, sign_off_result.first);
+  }
+
+  TEST_FIXTURE(GetFriendsListFixture, BulkFriendsAddsAndRemovesInOneRequest)
+  {
+    //SignOn user1
+    pair<status_code, value> sign_on_result = do_request(methods::POST, string(user_url) + sign_on + "/" + user1_id, 
+    value::object (vector<pair<string,value>>{make_pair("Password", value::string(user1_password))}));
+    CHECK_EQUAL(status_codes::OK, sign_on_result.first);
+
+    //Bulk add user1, with one friend given twice
+    pair<status_code, value> bulk_result = do_request(methods::PUT, string(user_url) + bulk_friends + "/" + user1_id,
+    value::object (vector<pair<string,value>>{make_pair("Add", value::string("USA;Doe,Jane|Korea;Kim,Min|USA;Doe,Jane"))}));
+    cout << "BulkFriendsAddsAndRemovesInOneRequest User1 BulkFriends response " << bulk_result.first << endl;
+    CHECK_EQUAL(status_codes::OK, bulk_result.first);
+    CHECK_EQUAL(2, bulk_result.second["Add"].as_integer());
+    CHECK_EQUAL(0, bulk_result.second["Remove"].as_integer());
+
+    pair<status_code,value> read_friend_list_result = do_request(methods::GET, string(user_url) + read_friend_list + "/" + user1_id);
+    CHECK_EQUAL(status_codes::OK, read_friend_list_result.first);
+    CHECK_EQUAL(value::object(vector<pair<string,value>>{make_pair("Friends", value::string("USA;Doe,Jane|Korea;Kim,Min"))}), read_friend_list_result.second);
+
+    //Bulk remove and add user1, removing one friend who is not there
+    bulk_result = do_request(methods::PUT, string(user_url) + bulk_friends + "/" + user1_id,
+    value::object (vector<pair<string,value>>{make_pair("Remove", value::string("USA;Doe,Jane|Nowhere;No,One")),
+                                              make_pair("Add", value::string("Canada;Roe,Rick"))}));
+    CHECK_EQUAL(status_codes::OK, bulk_result.first);
+    CHECK_EQUAL(1, bulk_result.second["Add"].as_integer());
+    CHECK_EQUAL(1, bulk_result.second["Remove"].as_integer());
+
+    read_friend_list_result = do_request(methods::GET, string(user_url) + read_friend_list + "/" + user1_id);
+    CHECK_EQUAL(status_codes::OK, read_friend_list_result.first);
+    CHECK_EQUAL(value::object(vector<pair<string,value>>{make_pair("Friends", value::string("Korea;Kim,Min|Canada;Roe,Rick"))}), read_friend_list_result.second);
+
+    //Malformed friends list
+    bulk_result = do_request(methods::PUT, string(user_url) + bulk_friends + "/" + user1_id,
+    value::object (vector<pair<string,value>>{make_pair("Add", value::string("NoDelimiter|USA;Doe,Jane"))}));
+    CHECK_EQUAL(status_codes::BadRequest, bulk_result.first);
+
+    //SignOff user1
+    pair<status_code, value> sign_off_result = do_request(methods::POST, string(user_url) + sign_off + "/" + user1_id);
+    CHECK_EQUAL(status_codes::OK, sign_off_result.first);
+
+    //Bulk add without an active session
+    bulk_result = do_request(methods::PUT, string(user_url) + bulk_friends + "/" + user1_id,
+    value::object (vector<pair<string,value>>{make_pair("Add", value::string("USA;Doe,Jane"))}));
+    CHECK_EQUAL(status_codes::Forbidden, bulk_result.first);
+  }
 }
 
 
@@ -3618,4 +4044,183 @@ SUITE(PushStatus)
     CHECK_EQUAL(status_codes::OK, push_status_result.first);
 
   }
+
+  TEST_FIXTURE(PushStatusFixture, EnqueueStatusIsAcceptedThenPushed)
+  {
+    pair <status_code, value> friends_list { do_request(methods::GET, string(user_url) + read_friend_list + "/" + user1_id) };
+    pair<status_code, value> enqueue_result { do_request(methods::POST, push_url + enqueue_status + "/" + user1_DataPartition + "/" + user1_DataRow + "/" + "queued_face", friends_list.second)};
+    cout << "EnqueueStatusIsAcceptedThenPushed User1 EnqueueStatus response " << enqueue_result.first << endl << endl;
+    CHECK_EQUAL(status_codes::Accepted, enqueue_result.first);
+
+    // The push happens in the background, so give it a few seconds to arrive
+    pair<status_code, value> get_result {};
+    for (int attempt = 0; attempt < 50; attempt++) {
+      get_result = do_request(methods::GET, basic_url + read_entity_admin + "/" + data_table_name + "/" + user2_DataPartition + "/" + user2_DataRow);
+      if (get_result.first == status_codes::OK && get_result.second["Updates"].as_string() == "queued_face\n")
+        break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    CHECK_EQUAL(status_codes::OK, get_result.first);
+    cout << "EnqueueStatusIsAcceptedThenPushed User2 Updates: " << get_result.second["Updates"].as_string() << endl;
+    CHECK_EQUAL("queued_face\n", get_result.second["Updates"].as_string());
+
+    //less than 4 parameters
+    enqueue_result = do_request(methods::POST, push_url + enqueue_status + "/" + user1_DataRow + "/" + "queued_face", friends_list.second);
+    CHECK_EQUAL(status_codes::BadRequest, enqueue_result.first);
+  }
+
+  TEST_FIXTURE(PushStatusFixture, PushStatusReportsFanOut)
+  {
+    pair<status_code, value> metrics_before { do_request(methods::GET, push_url + push_metrics) };
+    CHECK_EQUAL(status_codes::OK, metrics_before.first);
+
+    //User1 has three friends, all with data entities
+    pair <status_code, value> friends_list { do_request(methods::GET, string(user_url) + read_friend_list + "/" + user1_id) };
+    pair<status_code, value> push_status_result { do_request(methods::POST, push_url + push_status + "/" + user1_DataPartition + "/" + user1_DataRow + "/" + "fan_out_face", friends_list.second)};
+    cout << "PushStatusReportsFanOut User1 PushStatus response " << push_status_result.first << endl;
+    CHECK_EQUAL(status_codes::OK, push_status_result.first);
+    CHECK_EQUAL(3, push_status_result.second["Delivered"].as_integer());
+    CHECK_EQUAL(0, push_status_result.second["Failed"].as_integer());
+    CHECK(push_status_result.second["FanOutMicros"].is_number());
+
+    pair<status_code, value> metrics_after { do_request(methods::GET, push_url + push_metrics) };
+    CHECK_EQUAL(status_codes::OK, metrics_after.first);
+    CHECK(metrics_after.second["FanOuts"].as_number().to_uint64() > metrics_before.second["FanOuts"].as_number().to_uint64());
+    CHECK(metrics_after.second["RecipientsDelivered"].as_number().to_uint64() >=
+          metrics_before.second["RecipientsDelivered"].as_number().to_uint64() + 3);
+  }
+
+  TEST_FIXTURE(PushStatusFixture, EnqueuedStatusesDrainFromTheQueue)
+  {
+    pair<status_code, value> metrics_before { do_request(methods::GET, push_url + push_metrics) };
+    CHECK_EQUAL(status_codes::OK, metrics_before.first);
+
+    pair <status_code, value> friends_list { do_request(methods::GET, string(user_url) + read_friend_list + "/" + user1_id) };
+    for (const string& face : vector<string> {"first_face", "second_face"}) {
+      pair<status_code, value> enqueue_result { do_request(methods::POST, push_url + enqueue_status + "/" + user1_DataPartition + "/" + user1_DataRow + "/" + face, friends_list.second)};
+      CHECK_EQUAL(status_codes::Accepted, enqueue_result.first);
+    }
+
+    // Both are queued durably, then delivered and acknowledged in the background
+    pair<status_code, value> metrics_after {};
+    for (int attempt = 0; attempt < 50; attempt++) {
+      metrics_after = do_request(methods::GET, push_url + push_metrics);
+      if (metrics_after.first == status_codes::OK && metrics_after.second["QueueDepth"].as_integer() == 0)
+        break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    CHECK_EQUAL(status_codes::OK, metrics_after.first);
+    CHECK_EQUAL(0, metrics_after.second["QueueDepth"].as_integer());
+    CHECK_EQUAL(0, metrics_after.second["QueueLagMicros"].as_integer());
+    CHECK(metrics_after.second["QueueAppended"].as_number().to_uint64() >=
+          metrics_before.second["QueueAppended"].as_number().to_uint64() + 2);
+    CHECK(metrics_after.second["DeliveryWrites"].as_number().to_uint64() >
+          metrics_before.second["DeliveryWrites"].as_number().to_uint64());
+
+    pair<status_code, value> get_result { do_request(methods::GET, basic_url + read_entity_admin + "/" + data_table_name + "/" + user2_DataPartition + "/" + user2_DataRow) };
+    CHECK_EQUAL(status_codes::OK, get_result.first);
+    CHECK_EQUAL("first_face\nsecond_face\n", get_result.second["Updates"].as_string());
+  }
+
+  TEST_FIXTURE(PushStatusFixture, BurstToOneRecipientArrivesInOrder)
+  {
+    pair<status_code, value> metrics_before { do_request(methods::GET, push_url + push_metrics) };
+    CHECK_EQUAL(status_codes::OK, metrics_before.first);
+
+    /*
+      A burst to the same friends. Whether any of it falls in one
+      coalescing window depends on timing, so only the order and the
+      counts are checked, not how many writes it took.
+     */
+    pair <status_code, value> friends_list { do_request(methods::GET, string(user_url) + read_friend_list + "/" + user1_id) };
+    vector<string> faces {"burst_a", "burst_b", "burst_c", "burst_d"};
+    for (const string& face : faces) {
+      pair<status_code, value> enqueue_result { do_request(methods::POST, push_url + enqueue_status + "/" + user1_DataPartition + "/" + user1_DataRow + "/" + face, friends_list.second)};
+      CHECK_EQUAL(status_codes::Accepted, enqueue_result.first);
+    }
+
+    pair<status_code, value> get_result {};
+    for (int attempt = 0; attempt < 50; attempt++) {
+      get_result = do_request(methods::GET, basic_url + read_entity_admin + "/" + data_table_name + "/" + user2_DataPartition + "/" + user2_DataRow);
+      if (get_result.first == status_codes::OK && get_result.second["Updates"].as_string() == "burst_a\nburst_b\nburst_c\nburst_d\n")
+        break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    // Coalesced or not, each friend gets the statuses in the order they were posted
+    CHECK_EQUAL("burst_a\nburst_b\nburst_c\nburst_d\n", get_result.second["Updates"].as_string());
+
+    pair<status_code, value> metrics_after { do_request(methods::GET, push_url + push_metrics) };
+    CHECK_EQUAL(status_codes::OK, metrics_after.first);
+    uint64_t statuses {metrics_after.second["CoalescedStatuses"].as_number().to_uint64() -
+                       metrics_before.second["CoalescedStatuses"].as_number().to_uint64()};
+    uint64_t writes {metrics_after.second["DeliveryWrites"].as_number().to_uint64() -
+                     metrics_before.second["DeliveryWrites"].as_number().to_uint64()};
+    CHECK(statuses >= 3 * faces.size());
+    CHECK(writes >= 1);
+    CHECK(writes <= statuses);
+    CHECK(metrics_after.second["CoalescingRatio"].as_double() >= 1.0);
+  }
+
+  TEST_FIXTURE(PushStatusFixture, UpdateStatusSpoolsWhilePushServerIsDown)
+  {
+    pair<status_code, value> spool_before { do_request(methods::GET, string(user_url) + push_spool) };
+    CHECK_EQUAL(status_codes::OK, spool_before.first);
+
+    // PushServer refuses queued pushes, as if it were down; it serves PauseIntakeAdmin only if started with --test-admin
+    if (do_request(methods::POST, push_url + pause_intake_admin).first != status_codes::OK) {
+      cout << "Skipping UpdateStatusSpoolsWhilePushServerIsDown: start PushServer with --test-admin to run it" << endl;
+      return;
+    }
+    pair<status_code, value> update_result { do_request(methods::PUT, string(user_url) + update_status + "/" + user1_id + "/" + "spooled_face") };
+    pair<status_code, value> spool_paused { do_request(methods::GET, string(user_url) + push_spool) };
+    pair<status_code, value> get_paused { do_request(methods::GET, basic_url + read_entity_admin + "/" + data_table_name + "/" + user2_DataPartition + "/" + user2_DataRow) };
+    CHECK_EQUAL(status_codes::OK, do_request(methods::POST, push_url + resume_intake_admin).first);
+
+    // The status is stored and its push spooled, not lost
+    CHECK_EQUAL(status_codes::OK, update_result.first);
+    CHECK_EQUAL(status_codes::OK, spool_paused.first);
+    CHECK(spool_paused.second["Waiting"].as_integer() >= 1);
+    CHECK(spool_paused.second["Spooled"].as_number().to_uint64() > spool_before.second["Spooled"].as_number().to_uint64());
+    CHECK_EQUAL("", get_paused.second["Updates"].as_string());
+
+    // Once PushServer takes pushes again, the spooled one reaches the friends
+    pair<status_code, value> get_result {};
+    for (int attempt = 0; attempt < 50; attempt++) {
+      get_result = do_request(methods::GET, basic_url + read_entity_admin + "/" + data_table_name + "/" + user2_DataPartition + "/" + user2_DataRow);
+      if (get_result.first == status_codes::OK && get_result.second["Updates"].as_string() == "spooled_face\n")
+        break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    CHECK_EQUAL("spooled_face\n", get_result.second["Updates"].as_string());
+    pair<status_code, value> spool_after { do_request(methods::GET, string(user_url) + push_spool) };
+    CHECK_EQUAL(0, spool_after.second["Waiting"].as_integer());
+  }
+
+  TEST_FIXTURE(PushStatusFixture, PushMetricsReportsWriteCounts)
+  {
+    pair<status_code, value> metrics_result { do_request(methods::GET, push_url + push_metrics) };
+    cout << "PushMetricsReportsWriteCounts PushMetrics response " << metrics_result.first << endl;
+    CHECK_EQUAL(status_codes::OK, metrics_result.first);
+    CHECK(metrics_result.second["StatusesPushed"].is_number());
+    CHECK(metrics_result.second["FeedInserts"].is_number());
+    CHECK(metrics_result.second["OutboxStatuses"].is_number());
+    CHECK(metrics_result.second["InsertsSaved"].is_number());
+    CHECK(metrics_result.second["FanOuts"].is_number());
+    CHECK(metrics_result.second["RecipientsDelivered"].is_number());
+    CHECK(metrics_result.second["RecipientsFailed"].is_number());
+    CHECK(metrics_result.second["FanOutMicros"].is_number());
+    CHECK(metrics_result.second["FanOutMicrosMax"].is_number());
+    CHECK(metrics_result.second["MaxInFlight"].is_number());
+    CHECK(metrics_result.second["QueueDepth"].is_number());
+    CHECK(metrics_result.second["QueueLagMicros"].is_number());
+    CHECK(metrics_result.second["QueueBytes"].is_number());
+    CHECK(metrics_result.second["DeliveryBatches"].is_number());
+    CHECK(metrics_result.second["CoalescedStatuses"].is_number());
+    CHECK(metrics_result.second["CoalescingRatio"].is_number());
+    CHECK(metrics_result.second["CoalesceWindowMillis"].is_number());
+
+    //malformed request
+    metrics_result = do_request(methods::GET, push_url + push_metrics + "/" + "extra");
+    CHECK_EQUAL(status_codes::BadRequest, metrics_result.first);
+  }
 }
\ No newline at end of file